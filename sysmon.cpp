@@ -5,6 +5,29 @@
 #include <signal.h>
 #include <pwd.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <linux/ioprio.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #include <string>
 #include <vector>
@@ -17,6 +40,26 @@
 #include <iomanip>
 #include <iostream>
 #include <cstring>
+#include <ctime>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <functional>
+#include <future>
+#include <utility>
+#include <coroutine>
+#include <type_traits>
+#include <random>
+#include <cstdarg>
+#include <bitset>
+#include <array>
+#include <string_view>
+#include <limits>
+#include <cmath>
+#include <deque>
 
 using namespace std;
 using namespace std::chrono;
@@ -24,21 +67,53 @@ using namespace std::chrono;
 struct ProcTimes {
     unsigned long long utime = 0;
     unsigned long long stime = 0;
+    int processor = -1; // CPU it last ran on
 };
 
+// One process in a snapshot: 64 bytes (one cache line), trivially copyable,
+// no heap. The fields the CPU pass, the sorts and the merge-joins read come
+// first and fill the first 32 bytes; the rest is only read for drawn rows and
+// the cores panel. The user name lives in a uid -> name table shared by the
+// whole frame, and MEM% is derived from mem_kb when drawn.
 struct ProcInfo {
+    int32_t pid = 0;
+    float cpu_percent = 0.0f;
+    uint64_t starttime = 0;     // clock ticks after boot
+    uint64_t total_time = 0;    // utime + stime, clock ticks
+    uint32_t mem_kb = 0;        // RSS
+    uint32_t uid = (uint32_t)-1;
+    char name[16] = {};         // comm, NUL terminated (TASK_COMM_LEN)
+    uint64_t cpus_allowed = 0;  // affinity mask of CPUs 0-63
+    uint16_t ncpus_allowed = 0; // CPUs in the whole mask; 0 if unknown
+    int16_t last_cpu = -1;      // CPU it last ran on; -1 if unknown
+    uint32_t pad = 0;
+};
+static_assert(sizeof(ProcInfo) == 64, "ProcInfo layout");
+static_assert(is_trivially_copyable<ProcInfo>::value, "ProcInfo must stay trivially copyable");
+
+void set_comm(ProcInfo &p, const char *s, size_t len) {
+    len = min(len, sizeof(p.name) - 1);
+    memcpy(p.name, s, len);
+    memset(p.name + len, 0, sizeof(p.name) - len);
+}
+void set_comm(ProcInfo &p, const string &s) { set_comm(p, s.data(), s.size()); }
+
+struct ProcKey {
     int pid = 0;
-    string user;
-    string name;
-    double cpu_percent = 0.0;
-    size_t mem_kb = 0;
-    double mem_percent = 0.0;
-    ProcTimes times;
-    unsigned long long total_time = 0; 
+    unsigned long long starttime = 0;
+    bool operator<(const ProcKey &o) const {
+        if (pid != o.pid) return pid < o.pid;
+        return starttime < o.starttime;
+    }
+    bool operator==(const ProcKey &o) const { return pid == o.pid && starttime == o.starttime; }
 };
 
+ProcKey proc_key(const ProcInfo &p) { return ProcKey{p.pid, p.starttime}; }
+
 enum SortMode { SORT_CPU=0, SORT_MEM=1, SORT_PID=2 };
 
+enum PanelMode { PANEL_NONE=0, PANEL_KERNEL=1, PANEL_FS=2, PANEL_NET=3, PANEL_CORES=4 };
+
 long long get_uptime_seconds() {
     ifstream f("/proc/uptime");
     double up=0;
@@ -46,6 +121,17 @@ long long get_uptime_seconds() {
     return (long long)up;
 }
 
+long long read_boot_time() {
+    ifstream f("/proc/stat");
+    string line;
+    while (getline(f, line)) {
+        if (line.rfind("btime ", 0) == 0) {
+            try { return stoll(line.substr(6)); } catch(...) { return 0; }
+        }
+    }
+    return 0;
+}
+
 unsigned long long parse_ull(const string &s) {
     try { return stoull(s); } catch(...) { return 0ULL; }
 }
@@ -84,15 +170,551 @@ bool read_total_cpu(vector<unsigned long long>& fields) {
     return !fields.empty();
 }
 
-bool read_proc_times(int pid, ProcTimes &pt, unsigned long long &rss_kb, string &comm, uid_t &uid) {
-    string sfn = "/proc/" + to_string(pid) + "/stat";
-    ifstream f(sfn);
+bool read_file(const string &path, string &out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    out.clear();
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) out.append(chunk, (size_t)n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+// for sysfs/cgroupfs control files, where the write itself reports the error
+bool write_file(const string &path, const string &data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = write(fd, data.data(), data.size());
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == (ssize_t)data.size();
+}
+
+// Parses "key value..." files such as /proc/vmstat or /proc/softirqs. The line
+// each key was found on is remembered, so the next read checks that line first
+// and only falls back to a full scan when the layout has changed.
+struct KeyedFileParser {
+    string path;
+    vector<string> keys;
+    vector<int> line_hint;
+    vector<vector<unsigned long long>> values;
+    string buf;
+    vector<size_t> line_starts;
+
+    KeyedFileParser(const string &p, const vector<string> &k)
+        : path(p), keys(k), line_hint(k.size(), -1), values(k.size()) {}
+
+    bool line_has_key(size_t line, const string &key) const {
+        size_t pos = line_starts[line];
+        while (pos < buf.size() && buf[pos] == ' ') ++pos;
+        if (buf.compare(pos, key.size(), key) != 0) return false;
+        size_t end = pos + key.size();
+        return end < buf.size() && (buf[end] == ' ' || buf[end] == '\t');
+    }
+
+    void parse_values(size_t line, const string &key, vector<unsigned long long> &out) const {
+        out.clear();
+        size_t end = (line + 1 < line_starts.size()) ? line_starts[line + 1] : buf.size();
+        const char *p = buf.c_str() + buf.find(key, line_starts[line]) + key.size();
+        const char *e = buf.c_str() + end;
+        while (p < e) {
+            while (p < e && (*p == ' ' || *p == '\t')) ++p;
+            if (p >= e || *p < '0' || *p > '9') break;
+            char *next = nullptr;
+            out.push_back(strtoull(p, &next, 10));
+            p = next;
+        }
+    }
+
+    bool read() {
+        if (!read_file(path, buf)) return false;
+        line_starts.clear();
+        for (size_t pos = 0; pos < buf.size(); ) {
+            line_starts.push_back(pos);
+            size_t nl = buf.find('\n', pos);
+            if (nl == string::npos) break;
+            pos = nl + 1;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            int h = line_hint[i];
+            if (h < 0 || h >= (int)line_starts.size() || !line_has_key(h, keys[i])) {
+                h = -1;
+                for (size_t l = 0; l < line_starts.size(); ++l) {
+                    if (line_has_key(l, keys[i])) { h = (int)l; break; }
+                }
+                line_hint[i] = h;
+            }
+            if (h < 0) values[i].clear();
+            else parse_values(h, keys[i], values[i]);
+        }
+        return true;
+    }
+
+    unsigned long long value(size_t i) const { return values[i].empty() ? 0 : values[i][0]; }
+};
+
+// sums the per-CPU columns of /proc/interrupts over every interrupt line
+bool read_interrupts_per_cpu(vector<unsigned long long> &per_cpu) {
+    ifstream f("/proc/interrupts");
     if (!f) return false;
-    string content;
-    getline(f, content);
+    string line;
+    if (!getline(f, line)) return false;
+    istringstream hdr(line);
+    string tok;
+    size_t ncpu = 0;
+    while (hdr >> tok) ncpu++;
+    per_cpu.assign(ncpu, 0);
+    while (getline(f, line)) {
+        const char *p = line.c_str();
+        const char *colon = strchr(p, ':');
+        if (!colon) continue;
+        p = colon + 1;
+        for (size_t c = 0; c < ncpu; ++c) {
+            while (*p == ' ') ++p;
+            if (*p < '0' || *p > '9') break;
+            char *next = nullptr;
+            per_cpu[c] += strtoull(p, &next, 10);
+            p = next;
+        }
+    }
+    return true;
+}
+
+struct KernelStats {
+    KeyedFileParser vmstat{"/proc/vmstat", {"pgfault", "pgmajfault", "pswpin", "pswpout"}};
+    KeyedFileParser procstat{"/proc/stat", {"procs_running", "procs_blocked"}};
+    KeyedFileParser softirqs{"/proc/softirqs", {"HI:", "TIMER:", "NET_TX:", "NET_RX:", "BLOCK:", "IRQ_POLL:", "TASKLET:", "SCHED:", "HRTIMER:", "RCU:"}};
+
+    double load[3] = {0, 0, 0};
+    unsigned long long tasks_total = 0;
+    unsigned long long procs_running = 0, procs_blocked = 0;
+
+    vector<unsigned long long> prev_vm, prev_irq, prev_softirq_cpu, prev_softirq_type;
+    vector<double> vm_rate, irq_rate, softirq_cpu_rate, softirq_type_rate;
+    steady_clock::time_point prev_time;
+    bool have_prev = false;
+
+    static void rates(const vector<unsigned long long> &cur, const vector<unsigned long long> &prev, double secs, vector<double> &out) {
+        out.assign(cur.size(), 0.0);
+        if (prev.size() != cur.size() || secs <= 0) return;
+        for (size_t i = 0; i < cur.size(); ++i) {
+            if (cur[i] >= prev[i]) out[i] = (double)(cur[i] - prev[i]) / secs;
+        }
+    }
+
+    void sample() {
+        auto now = steady_clock::now();
+        ifstream la("/proc/loadavg");
+        string running_total;
+        if (la) {
+            la >> load[0] >> load[1] >> load[2] >> running_total;
+            size_t slash = running_total.find('/');
+            if (slash != string::npos) tasks_total = parse_ull(running_total.substr(slash + 1));
+        }
+        procstat.read();
+        procs_running = procstat.value(0);
+        procs_blocked = procstat.value(1);
+
+        vector<unsigned long long> vm;
+        if (vmstat.read()) for (size_t i = 0; i < vmstat.keys.size(); ++i) vm.push_back(vmstat.value(i));
+
+        vector<unsigned long long> irq;
+        read_interrupts_per_cpu(irq);
+
+        vector<unsigned long long> sirq_cpu, sirq_type;
+        if (softirqs.read()) {
+            for (auto &row : softirqs.values) {
+                unsigned long long sum = 0;
+                if (sirq_cpu.size() < row.size()) sirq_cpu.resize(row.size(), 0);
+                for (size_t c = 0; c < row.size(); ++c) { sirq_cpu[c] += row[c]; sum += row[c]; }
+                sirq_type.push_back(sum);
+            }
+        }
+
+        double secs = have_prev ? duration<double>(now - prev_time).count() : 0.0;
+        rates(vm, prev_vm, secs, vm_rate);
+        rates(irq, prev_irq, secs, irq_rate);
+        rates(sirq_cpu, prev_softirq_cpu, secs, softirq_cpu_rate);
+        rates(sirq_type, prev_softirq_type, secs, softirq_type_rate);
+        prev_vm = vm; prev_irq = irq; prev_softirq_cpu = sirq_cpu; prev_softirq_type = sirq_type;
+        prev_time = now;
+        have_prev = true;
+    }
+};
+
+struct MountEntry {
+    string device;
+    string mountpoint;
+    string fstype;
+    bool network = false;
+};
+
+string unescape_mount_field(const string &in) {
+    string out;
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] == '\\' && i + 3 < in.size() && isdigit((unsigned char)in[i+1])) {
+            out += (char)strtol(in.substr(i + 1, 3).c_str(), nullptr, 8);
+            i += 3;
+        } else out += in[i];
+    }
+    return out;
+}
+
+bool is_pseudo_fs(const string &t) {
+    static const set<string> pseudo = {
+        "autofs", "binfmt_misc", "bpf", "cgroup", "cgroup2", "configfs", "debugfs", "devpts",
+        "devtmpfs", "efivarfs", "fusectl", "hugetlbfs", "mqueue", "nsfs", "proc", "pstore",
+        "ramfs", "rpc_pipefs", "securityfs", "selinuxfs", "squashfs", "sysfs", "tracefs"
+    };
+    return pseudo.count(t) > 0;
+}
+
+bool is_network_fs(const string &t) {
+    static const set<string> net = {"nfs", "nfs4", "cifs", "smb3", "smbfs", "ceph", "glusterfs", "fuse.sshfs", "9p", "afs"};
+    return net.count(t) > 0;
+}
+
+// Keeps /proc/self/mountinfo open and only re-parses it when poll() reports
+// that the mount table changed.
+struct MountTable {
+    int fd = -1;
+    vector<MountEntry> mounts;
+    bool loaded = false;
+
+    ~MountTable() { if (fd >= 0) close(fd); }
+
+    bool changed() {
+        if (fd < 0) return true;
+        struct pollfd pfd = {fd, POLLPRI, 0};
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR))) return true;
+        return false;
+    }
+
+    void parse(const string &content) {
+        mounts.clear();
+        set<string> seen_dev;
+        map<string, size_t> by_mountpoint;
+        istringstream in(content);
+        string line;
+        while (getline(in, line)) {
+            istringstream ls(line);
+            string id, parent, devno, root, mountpoint, tok;
+            ls >> id >> parent >> devno >> root >> mountpoint;
+            while (ls >> tok && tok != "-") {}
+            MountEntry m;
+            ls >> m.fstype >> m.device;
+            if (m.fstype.empty() || is_pseudo_fs(m.fstype)) continue;
+            // bind mounts of an already listed device would only repeat its numbers
+            if (!seen_dev.insert(devno).second) continue;
+            m.mountpoint = unescape_mount_field(mountpoint);
+            m.device = unescape_mount_field(m.device);
+            m.network = is_network_fs(m.fstype);
+            // a later mount on the same path hides the earlier one
+            auto it = by_mountpoint.find(m.mountpoint);
+            if (it != by_mountpoint.end()) mounts[it->second] = m;
+            else {
+                by_mountpoint[m.mountpoint] = mounts.size();
+                mounts.push_back(m);
+            }
+        }
+    }
+
+    void refresh() {
+        if (loaded && !changed()) return;
+        if (fd < 0) fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        string content;
+        char buf[8192];
+        lseek(fd, 0, SEEK_SET);
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) content.append(buf, (size_t)n);
+        parse(content);
+        loaded = true;
+    }
+};
+
+struct FsUsage {
+    unsigned long long total_kb = 0, used_kb = 0, avail_kb = 0;
+    unsigned long long inodes = 0, inodes_used = 0;
+    bool ok = false;
+    time_t when = 0;
+};
+
+// statvfs() can hang on an unresponsive network mount, so mounts are probed
+// off the sampler thread by a small pool of workers. Each refresh queues up
+// to PER_REFRESH mounts, taking the table in turn, and a mount whose probe is
+// queued or running is skipped and keeps its last known numbers; past
+// DEADLINE_MS it shows as not responding. A worker stuck on a mount is
+// replaced, up to MAX_THREADS in all, and local mounts are queued first, so
+// hung network mounts hold up no local one.
+struct FsProber {
+    static const int DEADLINE_MS = 2000;
+    static const int WORKERS = 2;
+    static const int MAX_THREADS = 8;
+    static const size_t PER_REFRESH = 32;
+    struct Shared {
+        mutex mtx;
+        condition_variable cv;
+        deque<string> queue;
+        set<string> current;                             // mountpoints in the table
+        map<string, FsUsage> results;
+        map<string, steady_clock::time_point> in_flight; // mountpoint -> probe start
+        int threads = 0, idle = 0;
+    };
+    shared_ptr<Shared> sh = make_shared<Shared>();
+    size_t next = 0; // where the next refresh starts in the mount table
+
+    static FsUsage probe(const string &path) {
+        struct statvfs sv;
+        FsUsage u;
+        if (statvfs(path.c_str(), &sv) == 0) {
+            unsigned long long frsize = sv.f_frsize ? sv.f_frsize : sv.f_bsize;
+            u.total_kb = sv.f_blocks * frsize / 1024;
+            u.avail_kb = sv.f_bavail * frsize / 1024;
+            u.used_kb = (sv.f_blocks - sv.f_bfree) * frsize / 1024;
+            u.inodes = sv.f_files;
+            u.inodes_used = sv.f_files - sv.f_ffree;
+            u.ok = true;
+        }
+        u.when = time(nullptr);
+        return u;
+    }
+
+    // a worker blocked in statvfs() keeps its own reference to sh; one that
+    // comes back when enough others are running leaves
+    static void worker(shared_ptr<Shared> sh) {
+        unique_lock<mutex> lk(sh->mtx);
+        while (true) {
+            sh->idle++;
+            bool got = sh->cv.wait_for(lk, seconds(30), [&] { return !sh->queue.empty(); });
+            sh->idle--;
+            if (!got || sh->threads - stalled_workers(*sh) > WORKERS) break;
+            string path = std::move(sh->queue.front());
+            sh->queue.pop_front();
+            sh->in_flight[path] = steady_clock::now();
+            lk.unlock();
+            FsUsage u = probe(path);
+            lk.lock();
+            sh->in_flight.erase(path);
+            if (sh->current.count(path)) sh->results[path] = u;
+        }
+        sh->threads--;
+    }
+
+    static int stalled_workers(const Shared &s) {
+        auto now = steady_clock::now();
+        int n = 0;
+        for (auto &f : s.in_flight) n += now - f.second > milliseconds(DEADLINE_MS);
+        return n;
+    }
+
+    void schedule(const vector<MountEntry> &mounts) {
+        lock_guard<mutex> lk(sh->mtx);
+        sh->current.clear();
+        for (auto &m : mounts) sh->current.insert(m.mountpoint);
+        // forget mounts that are gone
+        for (auto it = sh->results.begin(); it != sh->results.end(); ) {
+            if (sh->current.count(it->first)) ++it;
+            else it = sh->results.erase(it);
+        }
+        sh->queue.erase(remove_if(sh->queue.begin(), sh->queue.end(), [&](const string &p) { return !sh->current.count(p); }), sh->queue.end());
+        set<string> queued(sh->queue.begin(), sh->queue.end());
+        // network mounts go behind local ones: they are the ones that hang
+        vector<string> network;
+        size_t added = 0;
+        for (size_t i = 0; i < mounts.size() && added < PER_REFRESH; ++i) {
+            const MountEntry &m = mounts[(next + i) % mounts.size()];
+            if (sh->in_flight.count(m.mountpoint) || queued.count(m.mountpoint)) continue;
+            if (m.network) network.push_back(m.mountpoint);
+            else sh->queue.push_back(m.mountpoint);
+            added++;
+            if (added == PER_REFRESH) next = (next + i + 1) % mounts.size();
+        }
+        sh->queue.insert(sh->queue.end(), network.begin(), network.end());
+        // top the workers that are not stuck back up to WORKERS
+        int live = sh->threads - stalled_workers(*sh);
+        while (!sh->queue.empty() && live < WORKERS && sh->threads < MAX_THREADS) {
+            try {
+                thread(worker, sh).detach();
+            } catch (const system_error &) {
+                break;
+            }
+            sh->threads++;
+            live++;
+        }
+        sh->cv.notify_all();
+    }
+
+    // stalled: the mounts whose probe has been pending for over DEADLINE_MS
+    map<string, FsUsage> snapshot(set<string> &stalled) {
+        auto now = steady_clock::now();
+        lock_guard<mutex> lk(sh->mtx);
+        stalled.clear();
+        for (auto &f : sh->in_flight) {
+            if (now - f.second > milliseconds(DEADLINE_MS)) stalled.insert(f.first);
+        }
+        return sh->results;
+    }
+};
+
+enum SockProto { SOCK_TCP=0, SOCK_UDP=1, SOCK_UNIX=2 };
+
+// TCP states as numbered in /proc/net/tcp (include/net/tcp_states.h)
+const char* tcp_state_name(int st) {
+    static const char* names[] = {"?", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2",
+                                  "TIME_WAIT", "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING"};
+    return (st > 0 && st < 12) ? names[st] : names[0];
+}
+const int TCP_STATE_COUNT = 12;
+const int TCP_ESTABLISHED_ST = 1;
+const int TCP_LISTEN_ST = 10;
+
+struct SockInfo {
+    unsigned char proto = SOCK_TCP;
+    unsigned char state = 0;
+};
+
+struct SockCounts {
+    int tcp_by_state[TCP_STATE_COUNT] = {0};
+    int tcp = 0, udp = 0, unix_socks = 0;
+    int total() const { return tcp + udp + unix_socks; }
+};
+
+inline const char* skip_spaces(const char *p, const char *e) {
+    while (p < e && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+inline const char* skip_token(const char *p, const char *e) {
+    while (p < e && *p != ' ' && *p != '\t' && *p != '\n') ++p;
+    return p;
+}
+
+inline unsigned long long parse_hex_token(const char *&p, const char *e) {
+    unsigned long long v = 0;
+    for (; p < e; ++p) {
+        char c = *p;
+        if (c >= '0' && c <= '9') v = (v << 4) | (unsigned)(c - '0');
+        else if (c >= 'A' && c <= 'F') v = (v << 4) | (unsigned)(c - 'A' + 10);
+        else if (c >= 'a' && c <= 'f') v = (v << 4) | (unsigned)(c - 'a' + 10);
+        else break;
+    }
+    return v;
+}
+
+inline unsigned long long parse_dec_token(const char *&p, const char *e) {
+    unsigned long long v = 0;
+    for (; p < e && *p >= '0' && *p <= '9'; ++p) v = v * 10 + (unsigned)(*p - '0');
+    return v;
+}
+
+// Inode-indexed table of every socket in /proc/net/{tcp,tcp6,udp,udp6,unix}.
+// The files have a fixed column layout, so each line is walked once with
+// pointer arithmetic instead of being tokenized into strings.
+struct SocketTable {
+    unordered_map<unsigned long long, SockInfo> by_inode;
+    SockCounts host;
+    uint64_t generation = 0;
+    string buf;
+
+    // state_col/inode_col are 0-based whitespace-separated columns
+    void parse_file(const char *path, SockProto proto, int state_col, int inode_col) {
+        if (!read_file(path, buf)) return;
+        const char *p = buf.c_str();
+        const char *e = p + buf.size();
+        const char *nl = (const char*)memchr(p, '\n', (size_t)(e - p));
+        if (!nl) return;
+        p = nl + 1; // header line
+        while (p < e) {
+            const char *eol = (const char*)memchr(p, '\n', (size_t)(e - p));
+            if (!eol) eol = e;
+            SockInfo si;
+            si.proto = (unsigned char)proto;
+            unsigned long long inode = 0;
+            const char *q = p;
+            for (int col = 0; q < eol; ++col) {
+                q = skip_spaces(q, eol);
+                if (q >= eol) break;
+                if (col == state_col) si.state = (unsigned char)parse_hex_token(q, eol);
+                else if (col == inode_col) { inode = parse_dec_token(q, eol); break; }
+                q = skip_token(q, eol);
+            }
+            if (inode) {
+                by_inode[inode] = si;
+                if (proto == SOCK_TCP) {
+                    host.tcp++;
+                    if (si.state < TCP_STATE_COUNT) host.tcp_by_state[si.state]++;
+                } else if (proto == SOCK_UDP) host.udp++;
+                else host.unix_socks++;
+            }
+            p = eol + 1;
+        }
+    }
+
+    void rebuild() {
+        by_inode.clear();
+        host = SockCounts();
+        parse_file("/proc/net/tcp", SOCK_TCP, 3, 9);
+        parse_file("/proc/net/tcp6", SOCK_TCP, 3, 9);
+        parse_file("/proc/net/udp", SOCK_UDP, 3, 9);
+        parse_file("/proc/net/udp6", SOCK_UDP, 3, 9);
+        parse_file("/proc/net/unix", SOCK_UNIX, 5, 6);
+    }
+
+    // joins the socket inodes behind /proc/[pid]/fd against the table
+    SockCounts counts_for(const ProcInfo &p) const {
+        SockCounts c;
+        string dir = "/proc/" + to_string(p.pid) + "/fd";
+        DIR* d = opendir(dir.c_str());
+        if (d) {
+            char link[64];
+            struct dirent* entry;
+            while ((entry = readdir(d)) != nullptr) {
+                if (entry->d_name[0] == '.') continue;
+                ssize_t n = readlinkat(dirfd(d), entry->d_name, link, sizeof(link) - 1);
+                if (n < 9 || memcmp(link, "socket:[", 8) != 0) continue;
+                link[n] = '\0';
+                unsigned long long inode = strtoull(link + 8, nullptr, 10);
+                auto si = by_inode.find(inode);
+                if (si == by_inode.end()) continue;
+                if (si->second.proto == SOCK_TCP) {
+                    c.tcp++;
+                    if (si->second.state < TCP_STATE_COUNT) c.tcp_by_state[si->second.state]++;
+                } else if (si->second.proto == SOCK_UDP) c.udp++;
+                else c.unix_socks++;
+            }
+            closedir(d);
+        }
+        return c;
+    }
+};
+
+// Per-reader memo of SocketTable::counts_for(), kept until the table is
+// rebuilt so redraws do not walk the fds again.
+struct SockCountCache {
+    uint64_t generation = 0;
+    map<ProcKey, SockCounts> counts;
+
+    const SockCounts& get(const SocketTable &st, const ProcInfo &p) {
+        if (st.generation != generation) {
+            counts.clear();
+            generation = st.generation;
+        }
+        auto it = counts.find(proc_key(p));
+        if (it == counts.end()) it = counts.emplace(proc_key(p), st.counts_for(p)).first;
+        return it->second;
+    }
+};
+
+// parses the first line of /proc/<pid>/stat
+bool parse_proc_stat(const string &content, ProcTimes &pt, unsigned long long &rss_kb, string &comm, unsigned long long &starttime) {
     size_t p1 = content.find('(');
     size_t p2 = content.rfind(')');
-    if (p1==string::npos || p2==string::npos || p2<=p1) return false;
+    if (p1==string::npos || p2==string::npos || p2<=p1 || p2 + 2 > content.size()) return false;
     comm = content.substr(p1+1, p2-p1-1);
     string after = content.substr(p2+2);
     istringstream iss(after);
@@ -100,30 +722,72 @@ bool read_proc_times(int pid, ProcTimes &pt, unsigned long long &rss_kb, string
     string tok;
     while (iss >> tok) toks.push_back(tok);
     if (toks.size() < 22) return false;
-    unsigned long long utime = parse_ull(toks[13]);
-    unsigned long long stime = parse_ull(toks[14]);
+    // toks[0] is field 3 (state): utime=14, stime=15, starttime=22, rss=24, processor=39
+    unsigned long long utime = parse_ull(toks[11]);
+    unsigned long long stime = parse_ull(toks[12]);
+    starttime = parse_ull(toks[19]);
     long rss_pages = 0;
     try { rss_pages = stol(toks[21]); } catch(...) { rss_pages = 0; }
     long page_size_kb = sysconf(_SC_PAGE_SIZE) / 1024;
     rss_kb = (rss_pages>0) ? (rss_pages * page_size_kb) : 0;
     pt.utime = utime;
     pt.stime = stime;
+    pt.processor = toks.size() > 36 ? atoi(toks[36].c_str()) : -1;
+    return true;
+}
+
+// real uid from the "Uid:" line of /proc/<pid>/status
+uid_t parse_status_uid(const string &content) {
+    size_t at = content.find("\nUid:");
+    if (at == string::npos) return (uid_t)-1;
+    return (uid_t)strtoul(content.c_str() + at + 5, nullptr, 10);
+}
+
+// CPUs a task may run on
+struct CpuAffinity {
+    uint64_t low = 0;   // CPUs 0-63
+    uint16_t count = 0; // all allowed CPUs; 0 if unknown
+};
+
+// the "Cpus_allowed:" line of /proc/<pid>/status: comma-separated 32-bit hex
+// words, highest CPUs first
+CpuAffinity parse_status_affinity(const char *buf, size_t len) {
+    CpuAffinity a;
+    const char *at = (const char*)memmem(buf, len, "\nCpus_allowed:", 14);
+    if (!at) return a;
+    unsigned count = 0;
+    for (const char *p = at + 14, *end = buf + len; p < end && *p != '\n'; ++p) {
+        int v;
+        if (*p >= '0' && *p <= '9') v = *p - '0';
+        else if (*p >= 'a' && *p <= 'f') v = *p - 'a' + 10;
+        else continue;
+        a.low = (a.low << 4) | (uint64_t)v;
+        count += (unsigned)__builtin_popcount((unsigned)v);
+    }
+    a.count = (uint16_t)min(count, 65535u);
+    return a;
+}
+
+void set_affinity(ProcInfo &p, const CpuAffinity &a) {
+    p.cpus_allowed = a.low;
+    p.ncpus_allowed = a.count;
+}
+
+bool read_proc_times(const string &proc_root, int pid, ProcTimes &pt, unsigned long long &rss_kb, string &comm, uid_t &uid, CpuAffinity &aff, unsigned long long &starttime, bool want_status) {
+    string sfn = proc_root + "/" + to_string(pid) + "/stat";
+    ifstream f(sfn);
+    if (!f) return false;
+    string content;
+    getline(f, content);
+    if (!parse_proc_stat(content, pt, rss_kb, comm, starttime)) return false;
 
-   
-    string sfn2 = "/proc/" + to_string(pid) + "/status";
-    ifstream f2(sfn2);
     uid = (uid_t)-1;
-    if (f2) {
-        string line;
-        while (getline(f2, line)) {
-            if (line.rfind("Uid:",0) == 0) {
-                istringstream is(line.substr(4));
-                unsigned long uid_val;
-                is >> uid_val;
-                uid = (uid_t)uid_val;
-                break;
-            }
-        }
+    aff = CpuAffinity();
+    if (!want_status) return true;
+    string status;
+    if (read_file(proc_root + "/" + to_string(pid) + "/status", status)) {
+        uid = parse_status_uid(status);
+        aff = parse_status_affinity(status.data(), status.size());
     }
     return true;
 }
@@ -134,13 +798,46 @@ string username_from_uid(uid_t uid) {
     return to_string((unsigned)uid);
 }
 
-vector<int> list_pids() {
+typedef map<uid_t, string> UserNames;
+
+// getpwuid() may re-read /etc/passwd on every call, so names are resolved once
+// per uid. Frames share one copy of the table, replaced only when a new uid
+// shows up.
+struct UserCache {
+    UserNames names;
+    shared_ptr<const UserNames> shared = make_shared<const UserNames>();
+
+    void resolve(const vector<ProcInfo> &procs) {
+        bool added = false;
+        uint32_t last = (uint32_t)-1;
+        for (auto &p : procs) {
+            if (p.uid == last || p.uid == (uint32_t)-1) continue;
+            last = p.uid;
+            if (names.count(p.uid)) continue;
+            names.emplace(p.uid, username_from_uid(p.uid));
+            added = true;
+        }
+        if (added) shared = make_shared<const UserNames>(names);
+    }
+    void preload(const UserNames &saved) {
+        names = saved;
+        shared = make_shared<const UserNames>(names);
+    }
+};
+
+const char *user_name(const UserNames &users, uint32_t uid) {
+    if (uid == (uint32_t)-1) return "?";
+    auto it = users.find(uid);
+    return it == users.end() ? "?" : it->second.c_str();
+}
+
+vector<int> list_pids(const string &proc_root = "/proc") {
     vector<int> pids;
-    DIR* d = opendir("/proc");
+    DIR* d = opendir(proc_root.c_str());
     if (!d) return pids;
     struct dirent* entry;
     while ((entry = readdir(d)) != nullptr) {
-        if (entry->d_type == DT_DIR) {
+        if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
             string name = entry->d_name;
             bool all_digits = !name.empty() && all_of(name.begin(), name.end(), ::isdigit);
             if (all_digits) pids.push_back(stoi(name));
@@ -151,297 +848,7425 @@ vector<int> list_pids() {
     return pids;
 }
 
-void collect_processes(map<int, ProcInfo>& procs, unsigned long long mem_total_kb) {
-    vector<int> pids = list_pids();
-    procs.clear();
-    for (int pid : pids) {
-        ProcInfo pi;
-        pi.pid = pid;
-        ProcTimes pt;
-        unsigned long long rss_kb = 0;
-        string comm;
-        uid_t uid;
-        if (!read_proc_times(pid, pt, rss_kb, comm, uid)) continue;
-        pi.name = comm;
-        pi.times = pt;
-        pi.total_time = pt.utime + pt.stime;
-        pi.mem_kb = (size_t)rss_kb;
-        pi.user = username_from_uid(uid);
-        if (mem_total_kb>0) {
-            pi.mem_percent = (100.0 * (double)pi.mem_kb) / (double)mem_total_kb;
-        } else pi.mem_percent = 0.0;
-        procs[pid] = pi;
-    }
-}
-
-void update_cpu_percent(const map<int, ProcInfo>& oldp, map<int, ProcInfo>& newp, unsigned long long old_total_cpu, unsigned long long new_total_cpu) {
-    unsigned long long total_delta = new_total_cpu - old_total_cpu;
-    if (total_delta == 0) total_delta = 1;
-    for (auto &kv : newp) {
-        int pid = kv.first;
-        ProcInfo &npi = kv.second;
-        auto it = oldp.find(pid);
-        unsigned long long old_total_proc = 0;
-        if (it != oldp.end()) old_total_proc = it->second.total_time;
-        unsigned long long delta_proc = 0;
-        if (npi.total_time >= old_total_proc) delta_proc = npi.total_time - old_total_proc;
-        double pct = 100.0 * (double)delta_proc / (double)total_delta;
-        npi.cpu_percent = pct;
+// Per-process fields a collector backend can fill in.
+enum ProcField : unsigned {
+    FIELD_COMM      = 1u << 0,
+    FIELD_TIMES     = 1u << 1,
+    FIELD_RSS       = 1u << 2,
+    FIELD_UID       = 1u << 3,
+    FIELD_STARTTIME = 1u << 4,
+    FIELD_LAST_CPU  = 1u << 5,
+    FIELD_AFFINITY  = 1u << 6,
+};
+const unsigned FIELDS_DEFAULT = FIELD_COMM | FIELD_TIMES | FIELD_RSS | FIELD_UID | FIELD_STARTTIME | FIELD_LAST_CPU | FIELD_AFFINITY;
+// what procfs gets from stat alone; the rest needs a read of status
+const unsigned FIELDS_STAT = FIELD_COMM | FIELD_TIMES | FIELD_RSS | FIELD_STARTTIME | FIELD_LAST_CPU;
+const unsigned FIELDS_STATUS = FIELD_UID | FIELD_AFFINITY;
+
+string field_names(unsigned fields) {
+    static const pair<unsigned, const char*> names[] = {
+        {FIELD_COMM, "comm"}, {FIELD_TIMES, "times"}, {FIELD_RSS, "rss"}, {FIELD_UID, "uid"}, {FIELD_STARTTIME, "starttime"},
+        {FIELD_LAST_CPU, "last_cpu"}, {FIELD_AFFINITY, "affinity"},
+    };
+    string out;
+    for (auto &n : names) {
+        if (!(fields & n.first)) continue;
+        if (!out.empty()) out += ",";
+        out += n.second;
     }
+    return out;
 }
 
-string human_kb(size_t kb) {
-    if (kb > 1024ULL*1024ULL) {
-        double gb = (double)kb / (1024.0*1024.0);
-        char buf[64]; snprintf(buf, sizeof(buf), "%.2fGB", gb);
-        return string(buf);
-    } else if (kb > 1024) {
-        double mb = (double)kb / 1024.0;
-        char buf[64]; snprintf(buf, sizeof(buf), "%.1fMB", mb);
-        return string(buf);
-    } else {
-        return to_string(kb) + "KB";
-    }
+// One sample of the process table, sorted by ProcKey.
+struct ProcSnapshot {
+    vector<ProcInfo> procs;
+    unsigned fields = 0;
+    string backend;
+};
+
+// A source of per-process data. Backends declare which fields they fill and
+// roughly what a task costs them, so the sampler can pick the cheapest one
+// that covers the columns on screen.
+class CollectorBackend {
+public:
+    virtual ~CollectorBackend() {}
+    virtual const char* name() const = 0;
+    virtual unsigned fields() const = 0;
+    // estimated microseconds of sampler wall time per task for the wanted fields
+    virtual double cost(unsigned wanted) const = 0;
+    virtual bool available() const { return true; }
+    virtual string unavailable_reason() const { return string(); }
+    // only auto-selected backends are considered when no backend is forced
+    virtual bool auto_select() const { return true; }
+    virtual bool collect(ProcSnapshot &snap, unsigned wanted) = 0;
+
+    // When set, backends that read process by process call this every
+    // PROGRESS_MS with what they have so far (sorted by ProcKey) and how many
+    // of the pids they have been through.
+    function<void(const vector<ProcInfo>&, size_t done, size_t total)> progress;
+    static const int PROGRESS_MS = 20;
+};
+
+bool read_proc_info(const string &proc_root, int pid, ProcInfo &pi, unsigned wanted) {
+    ProcTimes pt;
+    unsigned long long rss_kb = 0;
+    string comm;
+    uid_t uid;
+    CpuAffinity aff;
+    unsigned long long starttime = 0;
+    if (!read_proc_times(proc_root, pid, pt, rss_kb, comm, uid, aff, starttime, (wanted & FIELDS_STATUS) != 0)) return false;
+    pi.pid = pid;
+    set_comm(pi, comm);
+    pi.starttime = starttime;
+    pi.total_time = pt.utime + pt.stime;
+    pi.mem_kb = (uint32_t)rss_kb;
+    pi.uid = (wanted & FIELD_UID) ? (uint32_t)uid : (uint32_t)-1;
+    pi.last_cpu = (int16_t)pt.processor;
+    if (wanted & FIELD_AFFINITY) set_affinity(pi, aff);
+    return true;
 }
 
-void draw_header(WINDOW* win, unsigned long long mem_total_kb, double total_cpu_percent, int refresh_sec, SortMode sort_mode) {
-    werase(win);
-    int w = getmaxx(win);
-    string left = " SysMon - Press 'q' to quit | 's' sort | 'k' kill | 'r' refresh ";
-    mvwprintw(win, 0, 1, "%s", left.c_str());
-    mvwprintw(win, 0, max(1, w - 50), "Refresh: %ds | Sort: %s", refresh_sec,
-              (sort_mode==SORT_CPU?"CPU":(sort_mode==SORT_MEM?"MEM":"PID")));
-    mvwprintw(win, 0, max(1, w - 100), "CPU: %.2f%%", total_cpu_percent);
-    unsigned long long mem_total = mem_total_kb;
-    if (mem_total) {
-        unsigned long long mem_free, mem_avail;
-        read_meminfo(mem_total, mem_free, mem_avail);
-        unsigned long long used = mem_total - mem_avail;
-        double mempct = 100.0 * (double)used / (double)mem_total;
-        mvwprintw(win, 0, max(1, w - 34), "Mem: %lluMB (%.2f%%)", mem_total/1024, mempct);
-    }
-    box(win, 0,0);
-    wrefresh(win);
-}
-
-void draw_processes(WINDOW* win, const vector<ProcInfo>& procs, int selected, int page_offset) {
-    werase(win);
-    int rows, cols;
-    getmaxyx(win, rows, cols);
-    mvwprintw(win, 0, 1, "%5s %-10s %6s %8s %8s %6s", "PID", "USER", "%CPU", "MEM(%)", "RSS", "NAME");
-    for (int c=1; c<cols-1; ++c) mvwaddch(win, 1, c, ACS_HLINE);
-    int maxlines = rows - 3;
-    for (int i = 0; i < maxlines; ++i) {
-        int idx = page_offset + i;
-        if (idx >= (int)procs.size()) break;
-        const ProcInfo &p = procs[idx];
-        int y = i + 2;
-        if (idx == selected) {
-            wattron(win, A_REVERSE);
-        }
-        mvwprintw(win, y, 1, "%5d %-10.10s %6.2f %8.2f %8s %6.30s", p.pid, p.user.c_str(), p.cpu_percent, p.mem_percent, human_kb(p.mem_kb).c_str(), p.name.c_str());
-        if (idx == selected) {
-            wattroff(win, A_REVERSE);
+class ProcfsSyncBackend : public CollectorBackend {
+public:
+    explicit ProcfsSyncBackend(const string &root = "/proc", const char *label = "procfs-sync")
+        : proc_root(root), label(label) {}
+    const char* name() const override { return label; }
+    unsigned fields() const override { return FIELDS_DEFAULT; }
+    double cost(unsigned wanted) const override { return (wanted & FIELDS_STATUS) ? 18.0 : 9.0; }
+    bool available() const override {
+        if (proc_root == "/proc") return access("/proc/self", F_OK) == 0;
+        for (int pid : list_pids(proc_root))
+            if (access((proc_root + "/" + to_string(pid) + "/stat").c_str(), R_OK) == 0) return true;
+        return false;
+    }
+    string unavailable_reason() const override {
+        return proc_root == "/proc" ? "/proc is not mounted" : "no <pid>/stat files under " + proc_root;
+    }
+    bool auto_select() const override { return proc_root == "/proc"; }
+    bool collect(ProcSnapshot &snap, unsigned wanted) override {
+        vector<int> pids = list_pids(proc_root);
+        snap.procs.clear();
+        snap.procs.reserve(pids.size());
+        auto next_progress = steady_clock::now() + milliseconds(PROGRESS_MS);
+        for (size_t i = 0; i < pids.size(); ++i) {
+            ProcInfo pi;
+            if (read_proc_info(proc_root, pids[i], pi, wanted)) snap.procs.push_back(pi);
+            if (progress && (i & 63) == 63 && steady_clock::now() >= next_progress) {
+                progress(snap.procs, i + 1, pids.size());
+                next_progress = steady_clock::now() + milliseconds(PROGRESS_MS);
+            }
         }
+        snap.fields = fields() & (wanted | FIELDS_STAT);
+        return true;
     }
-    box(win, 0,0);
-    wrefresh(win);
-}
+protected:
+    string proc_root;
+    const char *label;
+};
 
-void sort_processes(vector<ProcInfo>& vec, SortMode mode) {
-    if (mode == SORT_CPU) {
-        sort(vec.begin(), vec.end(), [](const ProcInfo &a, const ProcInfo &b) {
-            if (a.cpu_percent == b.cpu_percent) return a.pid < b.pid;
-            return a.cpu_percent > b.cpu_percent;
-        });
-    } else if (mode == SORT_MEM) {
-        sort(vec.begin(), vec.end(), [](const ProcInfo &a, const ProcInfo &b) {
-            if (a.mem_percent == b.mem_percent) return a.pid < b.pid;
-            return a.mem_percent > b.mem_percent;
-        });
-    } else {
-        sort(vec.begin(), vec.end(), [](const ProcInfo &a, const ProcInfo &b) {
-            return a.pid < b.pid;
-        });
+// Minimal fixed-size pool; run() hands out jobs and waits until all are done.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned n) {
+        for (unsigned i = 0; i < n; ++i) workers.emplace_back([this]{ loop(); });
     }
-}
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lk(mtx);
+            quit = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers) t.join();
+    }
+    size_t size() const { return workers.size(); }
+    void run(vector<function<void()>> &batch) {
+        unique_lock<mutex> lk(mtx);
+        jobs = &batch;
+        next_job = 0;
+        pending = batch.size();
+        cv.notify_all();
+        done_cv.wait(lk, [&]{ return pending == 0; });
+        jobs = nullptr;
+    }
+private:
+    void loop() {
+        unique_lock<mutex> lk(mtx);
+        while (true) {
+            cv.wait(lk, [&]{ return quit || (jobs && next_job < jobs->size()); });
+            if (quit) return;
+            function<void()> &job = (*jobs)[next_job++];
+            lk.unlock();
+            job();
+            lk.lock();
+            if (--pending == 0) done_cv.notify_all();
+        }
+    }
+    vector<thread> workers;
+    mutex mtx;
+    condition_variable cv, done_cv;
+    vector<function<void()>> *jobs = nullptr;
+    size_t next_job = 0;
+    size_t pending = 0;
+    bool quit = false;
+};
 
-bool confirm_kill(WINDOW* win, int pid) {
-    int rows, cols; getmaxyx(win, rows, cols);
-    string msg = "Send SIGTERM or SIGKILL to PID " + to_string(pid) + "? (t=TERM / k=KILL / c=cancel)";
-    WINDOW* dlg = newwin(5, min((int)msg.size()+4, cols-4), (rows-5)/2, (cols - (int)msg.size()-4)/2);
-    box(dlg, 0,0);
-    mvwprintw(dlg, 2, 2, "%s", msg.c_str());
-    wrefresh(dlg);
-    nodelay(stdscr, FALSE);
-    int ch = wgetch(dlg);
-    nodelay(stdscr, TRUE);
-    bool do_kill = false;
-    int sig = 0;
-    if (ch == 't' || ch == 'T') { do_kill = true; sig = SIGTERM; }
-    else if (ch == 'k' || ch == 'K') { do_kill = true; sig = SIGKILL; }
-    delwin(dlg);
-    if (do_kill) {
-        if (kill(pid, sig) == 0) {
-            
-            WINDOW* ok = newwin(3, 40, (rows-3)/2, (cols-40)/2);
-            box(ok,0,0);
-            mvwprintw(ok,1,2, "Signal %d sent to PID %d", sig, pid);
-            wrefresh(ok);
-            std::this_thread::sleep_for(std::chrono::milliseconds(700));
-            delwin(ok);
-            return true;
-        } else {
-            WINDOW* err = newwin(5, 60, (rows-5)/2, max(1,(cols-60)/2));
-            box(err,0,0);
-            mvwprintw(err,1,2, "Failed to send signal %d to PID %d: %s", sig, pid, strerror(errno));
-            mvwprintw(err,3,2, "Press any key...");
-            wrefresh(err);
-            nodelay(stdscr, FALSE);
-            wgetch(err);
-            nodelay(stdscr, TRUE);
-            delwin(err);
-            return false;
+// Splits the pid list into contiguous chunks read on a thread pool; chunks are
+// concatenated in order so the snapshot stays sorted.
+class ProcfsParallelBackend : public ProcfsSyncBackend {
+public:
+    ProcfsParallelBackend() : ProcfsSyncBackend("/proc", "procfs-parallel") {
+        unsigned hw = thread::hardware_concurrency();
+        nthreads = max(1u, min(hw ? hw : 1u, 8u));
+    }
+    double cost(unsigned wanted) const override {
+        // fan-out and merge overhead only pays off with more than one CPU
+        return ProcfsSyncBackend::cost(wanted) / nthreads + 1.0;
+    }
+    bool auto_select() const override { return true; }
+    bool collect(ProcSnapshot &snap, unsigned wanted) override {
+        if (!pool) pool.reset(new ThreadPool(nthreads));
+        vector<int> pids = list_pids(proc_root);
+        size_t chunks = nthreads * 4;
+        vector<vector<ProcInfo>> parts(chunks);
+        vector<function<void()>> jobs;
+        size_t per = (pids.size() + chunks - 1) / chunks;
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t lo = c * per, hi = min(pids.size(), lo + per);
+            if (lo >= hi) break;
+            jobs.push_back([&, c, lo, hi]{
+                parts[c].reserve(hi - lo);
+                for (size_t i = lo; i < hi; ++i) {
+                    ProcInfo pi;
+                    if (read_proc_info(proc_root, pids[i], pi, wanted)) parts[c].push_back(std::move(pi));
+                }
+            });
         }
+        pool->run(jobs);
+        snap.procs.clear();
+        snap.procs.reserve(pids.size());
+        for (auto &part : parts) for (auto &pi : part) snap.procs.push_back(std::move(pi));
+        snap.fields = fields() & (wanted | FIELDS_STAT);
+        return true;
     }
-    return false;
-}
+private:
+    unsigned nthreads = 1;
+    unique_ptr<ThreadPool> pool;
+};
 
-int main(int argc, char** argv) {
-    int refresh_sec = 2;
-    if (argc >= 2) {
-        try { refresh_sec = stoi(argv[1]); if (refresh_sec < 1) refresh_sec = 1; } catch(...) { refresh_sec = 2; }
+// Bare io_uring: one submission and one completion ring mapped from the
+// kernel, driven with io_uring_enter(). Only what the event loop needs.
+class IoUring {
+public:
+    ~IoUring() {
+        if (sq_ptr && sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_map_len);
+        if (cq_ptr && cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_map_len);
+        if (sqes && sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        if (fd >= 0) close(fd);
     }
 
-    
-    initscr();
-    noecho();
-    cbreak();
-    curs_set(0);
-    keypad(stdscr, TRUE);
-    nodelay(stdscr, TRUE);
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
+    bool init(unsigned entries, string &why) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // completions are only ever reaped by the sampling thread (6.1+)
+        p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0 && errno == EINVAL) {
+            memset(&p, 0, sizeof(p));
+            fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        }
+        if (fd < 0) { why = string("io_uring_setup: ") + strerror(errno); return false; }
+        sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) sq_map_len = cq_map_len = max(sq_map_len, cq_map_len);
+        sq_ptr = mmap(nullptr, sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) { why = "mmap sq ring failed"; return false; }
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) { why = "mmap cq ring failed"; return false; }
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) { why = "mmap sqes failed"; return false; }
+        char *sq = (char*)sq_ptr, *cq = (char*)cq_ptr;
+        sq_head = (unsigned*)(sq + p.sq_off.head);
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        sq_entries = p.sq_entries;
+        return true;
+    }
 
-    
-    int header_h = 3;
-    WINDOW* header = newwin(header_h, cols, 0, 0);
-    WINDOW* body = newwin(rows - header_h, cols, header_h, 0);
+    // nullptr when the submission ring is full; call enter() to drain it
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries) return nullptr;
+        unsigned idx = local_tail & sq_mask;
+        sq_array[idx] = idx;
+        local_tail++;
+        to_submit++;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
 
-    SortMode sort_mode = SORT_CPU;
-    int selected = 0;
-    int page_offset = 0;
+    // submits queued entries and optionally waits for one completion
+    int enter(bool wait) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned n = to_submit;
+        to_submit = 0;
+        int rc = (int)syscall(__NR_io_uring_enter, fd, n, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        return rc;
+    }
 
-    map<int, ProcInfo> old_procs;
-    map<int, ProcInfo> cur_procs;
+    template <typename F>
+    unsigned reap(F &&on_cqe) {
+        unsigned head = *cq_head, count = 0;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            count++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            on_cqe(cqe);
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+        return count;
+    }
 
-    vector<unsigned long long> old_cpu_fields, cur_cpu_fields;
-    read_total_cpu(old_cpu_fields);
-    unsigned long long old_total_cpu = total_cpu_time(old_cpu_fields);
+    unsigned pending_submit() const { return to_submit; }
 
-    unsigned long long mem_total_kb = 0, mem_free_kb=0, mem_available_kb=0;
-    read_meminfo(mem_total_kb, mem_free_kb, mem_available_kb);
+private:
+    int fd = -1;
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    size_t sq_map_len = 0, cq_map_len = 0, sqes_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, cq_mask = 0, sq_entries = 0;
+    unsigned local_tail = 0, to_submit = 0;
+};
 
-    double total_cpu_percent = 0.0;
+// Coroutine type for work run on an EventLoop. A CoTask starts suspended and
+// owns its frame; co_await on it runs it to completion as a child.
+struct CoTask {
+    struct promise_type {
+        coroutine_handle<> continuation;
+        CoTask get_return_object() { return CoTask(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> h) noexcept {
+                coroutine_handle<> c = h.promise().continuation;
+                return c ? c : noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+
+    explicit CoTask(coroutine_handle<promise_type> h) : h(h) {}
+    CoTask(CoTask &&o) noexcept : h(exchange(o.h, {})) {}
+    CoTask(const CoTask&) = delete;
+    ~CoTask() { if (h) h.destroy(); }
+
+    bool done() const { return !h || h.done(); }
+    void start() { h.resume(); }
+
+    bool await_ready() const noexcept { return done(); }
+    coroutine_handle<> await_suspend(coroutine_handle<> c) noexcept { h.promise().continuation = c; return h; }
+    void await_resume() const noexcept {}
+
+private:
+    coroutine_handle<promise_type> h;
+};
+
+// Single-threaded executor: coroutines queue io_uring requests and suspend;
+// run() submits everything queued in one io_uring_enter(), then resumes each
+// coroutine whose request completed, until all given tasks are done.
+class EventLoop {
+public:
+    bool init(string &why) { return ring.init(256, why); }
+
+    struct Op {
+        EventLoop &loop;
+        io_uring_sqe req;
+        int result = 0;
+        coroutine_handle<> waiter;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) { waiter = h; loop.queue(req, (uint64_t)(uintptr_t)this); }
+        int await_resume() const noexcept { return result; }
+    };
+
+    Op openat(const char *path, int flags) {
+        Op op{*this, {}, 0, {}};
+        op.req.opcode = IORING_OP_OPENAT;
+        op.req.fd = AT_FDCWD;
+        op.req.addr = (uint64_t)(uintptr_t)path;
+        op.req.open_flags = (uint32_t)flags;
+        return op;
+    }
+    Op read(int fd, char *buf, unsigned len, uint64_t off) {
+        Op op{*this, {}, 0, {}};
+        op.req.opcode = IORING_OP_READ;
+        op.req.fd = fd;
+        op.req.addr = (uint64_t)(uintptr_t)buf;
+        op.req.len = len;
+        op.req.off = off;
+        return op;
+    }
+    // nobody waits for a close; its completion is dropped
+    void close_fd(int fd) {
+        io_uring_sqe req;
+        memset(&req, 0, sizeof(req));
+        req.opcode = IORING_OP_CLOSE;
+        req.fd = fd;
+        queue(req, 0);
+    }
+
+    // on_batch, if given, runs after each batch of completions
+    // false if io_uring_enter() failed
+    bool run(vector<CoTask> &tasks, const function<void()> &on_batch = nullptr) {
+        for (auto &t : tasks) t.start();
+        auto all_done = [&]{
+            for (auto &t : tasks) if (!t.done()) return false;
+            return true;
+        };
+        while (!all_done() || in_flight > 0) {
+            if (ring.enter(in_flight > 0) < 0 && errno != EINTR) return false;
+            ring.reap([&](const io_uring_cqe &cqe) {
+                in_flight--;
+                if (!cqe.user_data) return;
+                Op *op = (Op*)(uintptr_t)cqe.user_data;
+                op->result = cqe.res;
+                op->waiter.resume();
+            });
+            if (on_batch) on_batch();
+        }
+        return true;
+    }
+
+private:
+    void queue(const io_uring_sqe &req, uint64_t user_data) {
+        io_uring_sqe *sqe;
+        while (!(sqe = ring.get_sqe())) ring.enter(false);
+        *sqe = req;
+        sqe->user_data = user_data;
+        in_flight++;
+    }
+
+    IoUring ring;
+    size_t in_flight = 0;
+};
+
+// Reads a whole small file (up to buf.size() bytes) through the loop.
+CoTask co_read_file(EventLoop &loop, const string &path, string &buf, int &len) {
+    len = -1;
+    int fd = co_await loop.openat(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) co_return;
+    int n = co_await loop.read(fd, buf.data(), (unsigned)buf.size(), 0);
+    loop.close_fd(fd);
+    len = n;
+}
+
+// procfs reader on a coroutine event loop: a window of worker coroutines
+// walks the pid list, each co_awaiting its stat/status reads, so one thread
+// keeps many requests in flight and submits them in a single syscall.
+class ProcfsUringBackend : public CollectorBackend {
+public:
+    // the ring is only probed here; the one used is made on the first
+    // collect(), since a single-issuer ring belongs to the thread creating it
+    ProcfsUringBackend() {
+        IoUring probe;
+        ok = probe.init(8, why);
+    }
+    const char* name() const override { return "procfs-uring"; }
+    unsigned fields() const override { return FIELDS_DEFAULT; }
+    // same syscalls as procfs-sync minus most of the per-call entry cost
+    double cost(unsigned wanted) const override { return (wanted & FIELDS_STATUS) ? 16.0 : 8.0; }
+    bool available() const override { return ok; }
+    string unavailable_reason() const override { return why; }
+    bool auto_select() const override { return true; }
+
+    bool collect(ProcSnapshot &snap, unsigned wanted) override {
+        if (!ok) return false;
+        if (!loop_ready && !(loop_ready = loop.init(why))) {
+            ok = false;
+            return false;
+        }
+        pids = list_pids("/proc");
+        results.assign(pids.size(), ProcInfo());
+        found.assign(pids.size(), 0);
+        next = 0;
+        vector<CoTask> workers;
+        size_t window = min<size_t>(WINDOW, pids.size());
+        for (size_t w = 0; w < window; ++w) workers.push_back(worker(wanted));
+        function<void()> on_batch;
+        auto next_progress = steady_clock::now() + milliseconds(PROGRESS_MS);
+        if (progress) on_batch = [&]{
+            if (steady_clock::now() < next_progress) return;
+            vector<ProcInfo> part;
+            for (size_t i = 0; i < pids.size(); ++i) if (found[i]) part.push_back(results[i]);
+            progress(part, min(next, pids.size()), pids.size());
+            next_progress = steady_clock::now() + milliseconds(PROGRESS_MS);
+        };
+        if (!loop.run(workers, on_batch)) {
+            // requests may still be in flight into the workers' buffers, so
+            // their frames are leaked rather than freed
+            why = string("io_uring_enter: ") + strerror(errno);
+            ok = false;
+            for (auto &w : workers) (void)new CoTask(std::move(w));
+            return false;
+        }
+        snap.procs.clear();
+        snap.procs.reserve(pids.size());
+        for (size_t i = 0; i < pids.size(); ++i) if (found[i]) snap.procs.push_back(std::move(results[i]));
+        snap.fields = fields() & (wanted | FIELDS_STAT);
+        return true;
+    }
+
+private:
+    static const size_t WINDOW = 64;
+
+    CoTask worker(unsigned wanted) {
+        string buf(4096, '\0');
+        string path;
+        while (next < pids.size()) {
+            size_t i = next++;
+            string dir = "/proc/" + to_string(pids[i]);
+            int len;
+            path = dir + "/stat";
+            co_await co_read_file(loop, path, buf, len);
+            if (len <= 0) continue;
+            ProcInfo &pi = results[i];
+            ProcTimes pt;
+            unsigned long long rss_kb = 0, starttime = 0;
+            string comm;
+            if (!parse_proc_stat(string(buf.data(), (size_t)len), pt, rss_kb, comm, starttime)) continue;
+            pi.pid = pids[i];
+            set_comm(pi, comm);
+            pi.starttime = starttime;
+            pi.total_time = pt.utime + pt.stime;
+            pi.mem_kb = (uint32_t)rss_kb;
+            pi.last_cpu = (int16_t)pt.processor;
+            pi.uid = (uint32_t)-1;
+            if (wanted & FIELDS_STATUS) {
+                path = dir + "/status";
+                co_await co_read_file(loop, path, buf, len);
+                if (len > 0 && (wanted & FIELD_UID)) pi.uid = parse_status_uid(string(buf.data(), (size_t)len));
+                if (len > 0 && (wanted & FIELD_AFFINITY)) set_affinity(pi, parse_status_affinity(buf.data(), (size_t)len));
+            }
+            found[i] = 1;
+        }
+    }
+
+    EventLoop loop;
+    bool ok = false, loop_ready = false;
+    string why;
+    vector<int> pids;
+    vector<ProcInfo> results;
+    vector<char> found;
+    size_t next = 0;
+};
+
+// Just enough of the kernel's BTF to find a few struct member offsets and the
+// id of the task iterator's attach function.
+struct BtfTypes {
+    string raw;
+    const char *strs = nullptr;
+    size_t str_len = 0;
+    vector<const btf_type*> types;
+
+    bool load(const char *path) {
+        if (!read_file(path, raw) || raw.size() < sizeof(btf_header)) return false;
+        const btf_header *hdr = (const btf_header*)raw.data();
+        if (hdr->magic != BTF_MAGIC) return false;
+        size_t base = hdr->hdr_len;
+        if (base + hdr->str_off + hdr->str_len > raw.size() || base + hdr->type_off + hdr->type_len > raw.size()) return false;
+        strs = raw.data() + base + hdr->str_off;
+        str_len = hdr->str_len;
+        const char *p = raw.data() + base + hdr->type_off;
+        const char *end = p + hdr->type_len;
+        types.push_back(nullptr); // type id 0 is void
+        while (p + sizeof(btf_type) <= end) {
+            const btf_type *t = (const btf_type*)p;
+            types.push_back(t);
+            size_t vlen = BTF_INFO_VLEN(t->info);
+            p += sizeof(btf_type);
+            switch (BTF_INFO_KIND(t->info)) {
+            case BTF_KIND_INT: p += 4; break;
+            case BTF_KIND_ARRAY: p += sizeof(btf_array); break;
+            case BTF_KIND_STRUCT:
+            case BTF_KIND_UNION: p += vlen * sizeof(btf_member); break;
+            case BTF_KIND_ENUM: p += vlen * sizeof(btf_enum); break;
+            case BTF_KIND_FUNC_PROTO: p += vlen * sizeof(btf_param); break;
+            case BTF_KIND_VAR: p += sizeof(btf_var); break;
+            case BTF_KIND_DATASEC: p += vlen * sizeof(btf_var_secinfo); break;
+            case BTF_KIND_DECL_TAG: p += sizeof(btf_decl_tag); break;
+            case BTF_KIND_ENUM64: p += vlen * sizeof(btf_enum64); break;
+            default: break;
+            }
+        }
+        return types.size() > 1;
+    }
+
+    const char* name_of(const btf_type *t) const {
+        return (t && t->name_off < str_len) ? strs + t->name_off : "";
+    }
+
+    int find(unsigned kind, const char *name) const {
+        for (size_t id = 1; id < types.size(); ++id) {
+            if (BTF_INFO_KIND(types[id]->info) == kind && strcmp(name_of(types[id]), name) == 0) return (int)id;
+        }
+        return -1;
+    }
+
+    // follows typedefs and qualifiers to the underlying type
+    const btf_type* resolve(unsigned id) const {
+        while (id && id < types.size()) {
+            unsigned k = BTF_INFO_KIND(types[id]->info);
+            if (k != BTF_KIND_TYPEDEF && k != BTF_KIND_VOLATILE && k != BTF_KIND_CONST &&
+                k != BTF_KIND_RESTRICT && k != BTF_KIND_TYPE_TAG) return types[id];
+            id = types[id]->type;
+        }
+        return nullptr;
+    }
+
+    // byte offset of a member, looking inside anonymous structs and unions
+    bool member(const btf_type *st, const char *name, unsigned &off, unsigned &type_id) const {
+        if (!st) return false;
+        unsigned k = BTF_INFO_KIND(st->info);
+        if (k != BTF_KIND_STRUCT && k != BTF_KIND_UNION) return false;
+        const btf_member *m = (const btf_member*)(st + 1);
+        for (unsigned i = 0; i < BTF_INFO_VLEN(st->info); ++i) {
+            unsigned bit_off = BTF_INFO_KFLAG(st->info) ? BTF_MEMBER_BIT_OFFSET(m[i].offset) : m[i].offset;
+            if (m[i].name_off == 0) {
+                unsigned inner_off = 0;
+                if (member(resolve(m[i].type), name, inner_off, type_id)) {
+                    off = bit_off / 8 + inner_off;
+                    return true;
+                }
+            } else if (strcmp(strs + m[i].name_off, name) == 0) {
+                off = bit_off / 8;
+                type_id = m[i].type;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool member(const char *struct_name, const char *name, unsigned &off, unsigned &type_id) const {
+        int id = find(BTF_KIND_STRUCT, struct_name);
+        return id > 0 && member(types[id], name, off, type_id);
+    }
+};
+
+// Record emitted by the iterator program for every task (thread).
+struct BpfTaskRecord {
+    uint32_t pid;
+    uint32_t tgid;
+    uint64_t utime_ns;
+    uint64_t stime_ns;
+    uint64_t runtime_ns;
+    uint64_t dead_runtime_ns;
+    uint64_t start_boottime_ns;
+    char comm[16];
+    uint32_t uid;
+    uint32_t pad;
+    int64_t rss_pages[3];
+    int32_t cpu;
+    int32_t nr_cpus_allowed;
+    uint64_t cpus_allowed;      // first word of the task's cpumask
+};
+
+// Dumps every task with a BPF task iterator: one read() per sample and no
+// per-process file opens. The program is assembled here with member offsets
+// taken from /sys/kernel/btf/vmlinux, so no libbpf or compiler is needed.
+// Times follow procfs: per-thread sched runtime plus the signal struct's total
+// for exited threads, split by the utime/stime ratio.
+class BpfTaskIterBackend : public CollectorBackend {
+public:
+    ~BpfTaskIterBackend() override {
+        if (link_fd >= 0) close(link_fd);
+        if (prog_fd >= 0) close(prog_fd);
+    }
+    const char* name() const override { return "bpf-task-iter"; }
+    unsigned fields() const override { return FIELDS_DEFAULT; }
+    double cost(unsigned) const override { return 0.6; }
+    bool available() const override {
+        if (!probed) const_cast<BpfTaskIterBackend*>(this)->probe();
+        return link_fd >= 0;
+    }
+    string unavailable_reason() const override { return err; }
+
+    bool collect(ProcSnapshot &snap, unsigned wanted) override {
+        if (!available() || !collect_iter(snap, wanted)) return false;
+        if (!gaps.empty()) {
+            for (size_t i = 0; i < gaps.size(); ) {
+                ProcInfo pi;
+                if (!read_proc_info("/proc", gaps[i], pi, wanted)) { gaps.erase(gaps.begin() + i); continue; }
+                snap.procs.push_back(pi);
+                ++i;
+            }
+            sort(snap.procs.begin(), snap.procs.end(), [](const ProcInfo &x, const ProcInfo &y) { return proc_key(x) < proc_key(y); });
+            snap.procs.erase(unique(snap.procs.begin(), snap.procs.end(), [](const ProcInfo &x, const ProcInfo &y) { return x.pid == y.pid; }), snap.procs.end());
+        }
+        return true;
+    }
+
+private:
+    bool collect_iter(ProcSnapshot &snap, unsigned wanted) {
+        int iter_fd = (int)bpf_cmd_iter_create();
+        if (iter_fd < 0) { err = string("BPF_ITER_CREATE: ") + strerror(errno); return false; }
+        buf.clear();
+        char chunk[65536];
+        ssize_t n;
+        while ((n = read(iter_fd, chunk, sizeof(chunk))) > 0) buf.append(chunk, (size_t)n);
+        close(iter_fd);
+        if (n < 0) { err = string("read iterator: ") + strerror(errno); return false; }
+
+        static long clk_tck = sysconf(_SC_CLK_TCK);
+        static long page_kb = sysconf(_SC_PAGE_SIZE) / 1024;
+        unsigned long long ns_per_tick = 1000000000ULL / (unsigned long long)(clk_tck > 0 ? clk_tck : 100);
+        struct Acc { uint64_t ut = 0, st = 0, rt = 0; bool leader = false; };
+        unordered_map<uint32_t, size_t> index;
+        vector<Acc> acc;
+        snap.procs.clear();
+        size_t count = buf.size() / sizeof(BpfTaskRecord);
+        for (size_t i = 0; i < count; ++i) {
+            BpfTaskRecord r;
+            memcpy(&r, buf.data() + i * sizeof(r), sizeof(r));
+            auto it = index.find(r.tgid);
+            if (it == index.end()) {
+                it = index.emplace(r.tgid, snap.procs.size()).first;
+                snap.procs.emplace_back();
+                snap.procs.back().pid = (int)r.tgid;
+                acc.emplace_back();
+            }
+            ProcInfo &pi = snap.procs[it->second];
+            Acc &a = acc[it->second];
+            a.ut += r.utime_ns;
+            a.st += r.stime_ns;
+            a.rt += r.runtime_ns;
+            if (r.pid == r.tgid) {
+                a.leader = true;
+                a.rt += r.dead_runtime_ns;
+                set_comm(pi, r.comm, strnlen(r.comm, sizeof(r.comm)));
+                pi.starttime = r.start_boottime_ns / ns_per_tick;
+                pi.uid = (wanted & FIELD_UID) ? r.uid : (uint32_t)-1;
+                int64_t pages = 0;
+                for (int k = 0; k < 3; ++k) if (r.rss_pages[k] > 0) pages += r.rss_pages[k];
+                pi.mem_kb = (uint32_t)(pages * page_kb);
+                pi.last_cpu = (int16_t)r.cpu;
+                if (wanted & FIELD_AFFINITY) {
+                    pi.cpus_allowed = r.cpus_allowed;
+                    pi.ncpus_allowed = (uint16_t)max(0, min(r.nr_cpus_allowed, 65535));
+                }
+            }
+        }
+        for (size_t i = 0; i < snap.procs.size(); ++i) {
+            ProcInfo &pi = snap.procs[i];
+            const Acc &a = acc[i];
+            uint64_t ut = a.rt, st = 0;
+            if (a.ut + a.st > 0) {
+                ut = (uint64_t)((long double)a.rt * a.ut / (a.ut + a.st));
+                st = a.rt - ut;
+            }
+            pi.total_time = ut / ns_per_tick + st / ns_per_tick;
+        }
+        // the walk can miss a group leader while its threads are listed; the
+        // leader carries the process-wide fields, so take that entry from procfs
+        size_t keep = 0;
+        for (size_t i = 0; i < snap.procs.size(); ++i) {
+            if (!acc[i].leader && !read_proc_info("/proc", snap.procs[i].pid, snap.procs[i], wanted)) continue;
+            if (keep != i) snap.procs[keep] = std::move(snap.procs[i]);
+            keep++;
+        }
+        snap.procs.resize(keep);
+        sort(snap.procs.begin(), snap.procs.end(), [](const ProcInfo &x, const ProcInfo &y) { return proc_key(x) < proc_key(y); });
+        snap.fields = fields() & (wanted | FIELDS_STAT);
+        return true;
+    }
+
+    static long sys_bpf(int cmd, union bpf_attr *attr) {
+        return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+    }
+
+    long bpf_cmd_iter_create() {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.iter_create.link_fd = (uint32_t)link_fd;
+        return sys_bpf(BPF_ITER_CREATE, &attr);
+    }
+
+    struct Offsets {
+        unsigned pid, tgid, comm, utime, stime, runtime, start, real_cred, cred_uid;
+        unsigned mm, rss[3], signal, dead_runtime;
+        unsigned cpu, nr_cpus_allowed, cpus;
+        bool cpus_is_ptr;
+    };
+
+    bool resolve_offsets(const BtfTypes &btf, Offsets &o) {
+        unsigned t = 0, se_off = 0, sum_off = 0;
+        if (!btf.member("task_struct", "pid", o.pid, t) || !btf.member("task_struct", "tgid", o.tgid, t) ||
+            !btf.member("task_struct", "comm", o.comm, t) || !btf.member("task_struct", "utime", o.utime, t) ||
+            !btf.member("task_struct", "stime", o.stime, t) || !btf.member("task_struct", "real_cred", o.real_cred, t) ||
+            !btf.member("task_struct", "mm", o.mm, t) || !btf.member("task_struct", "signal", o.signal, t) ||
+            !btf.member("task_struct", "se", se_off, t) || !btf.member("sched_entity", "sum_exec_runtime", sum_off, t) ||
+            !btf.member("cred", "uid", o.cred_uid, t) || !btf.member("signal_struct", "sum_sched_runtime", o.dead_runtime, t)) {
+            err = "task_struct layout not found in BTF";
+            return false;
+        }
+        o.runtime = se_off + sum_off;
+        if (!btf.member("task_struct", "start_boottime", o.start, t) && !btf.member("task_struct", "real_start_time", o.start, t)) {
+            err = "no start_boottime in task_struct";
+            return false;
+        }
+        // task_cpu(): task_struct.cpu with THREAD_INFO_IN_TASK, else thread_info.cpu
+        unsigned ti_off = 0, ti_cpu = 0;
+        if (!btf.member("task_struct", "cpu", o.cpu, t)) {
+            if (!btf.member("task_struct", "thread_info", ti_off, t) || !btf.member("thread_info", "cpu", ti_cpu, t)) {
+                err = "no task cpu in BTF";
+                return false;
+            }
+            o.cpu = ti_off + ti_cpu;
+        }
+        // 5.3+ reaches the mask through cpus_ptr; before that it is inline
+        o.cpus_is_ptr = btf.member("task_struct", "cpus_ptr", o.cpus, t);
+        if ((!o.cpus_is_ptr && !btf.member("task_struct", "cpus_allowed", o.cpus, t)) ||
+            !btf.member("task_struct", "nr_cpus_allowed", o.nr_cpus_allowed, t)) {
+            err = "no task affinity in BTF";
+            return false;
+        }
+        // MM_FILEPAGES, MM_ANONPAGES and MM_SHMEMPAGES are what get_mm_rss() adds up
+        static const unsigned counters[3] = {0, 1, 3};
+        unsigned rss_off = 0, rss_type = 0;
+        if (!btf.member("mm_struct", "rss_stat", rss_off, rss_type)) { err = "no mm_struct.rss_stat in BTF"; return false; }
+        const btf_type *rt = btf.resolve(rss_type);
+        if (rt && BTF_INFO_KIND(rt->info) == BTF_KIND_ARRAY) {
+            // 6.2+: struct percpu_counter rss_stat[NR_MM_COUNTERS]
+            const btf_array *arr = (const btf_array*)(rt + 1);
+            const btf_type *elem = btf.resolve(arr->type);
+            unsigned count_off = 0;
+            if (!elem || !btf.member(elem, "count", count_off, t)) { err = "unknown rss_stat element"; return false; }
+            for (int k = 0; k < 3; ++k) o.rss[k] = rss_off + counters[k] * elem->size + count_off;
+        } else if (rt && BTF_INFO_KIND(rt->info) == BTF_KIND_STRUCT) {
+            // older kernels: struct mm_rss_stat { atomic_long_t count[NR_MM_COUNTERS]; }
+            unsigned count_off = 0;
+            if (!btf.member(rt, "count", count_off, t)) { err = "unknown mm_rss_stat layout"; return false; }
+            for (int k = 0; k < 3; ++k) o.rss[k] = rss_off + count_off + counters[k] * 8;
+        } else {
+            err = "unknown rss_stat type";
+            return false;
+        }
+        return true;
+    }
+
+    static bpf_insn ins(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        bpf_insn i;
+        memset(&i, 0, sizeof(i));
+        i.code = code; i.dst_reg = dst; i.src_reg = src; i.off = off; i.imm = imm;
+        return i;
+    }
+
+    vector<bpf_insn> assemble(const Offsets &o) {
+        const int REC = -(int)sizeof(BpfTaskRecord);
+        const int TMP = REC - 8;
+        vector<bpf_insn> p;
+        auto mov_reg = [&](int d, int s) { p.push_back(ins(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)); };
+        auto mov_imm = [&](int d, int v) { p.push_back(ins(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, v)); };
+        auto add_imm = [&](int d, int v) { p.push_back(ins(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, v)); };
+        auto ldx64 = [&](int d, int s, int off) { p.push_back(ins(BPF_LDX | BPF_MEM | BPF_DW, d, s, (int16_t)off, 0)); };
+        auto call = [&](int fn) { p.push_back(ins(BPF_JMP | BPF_CALL, 0, 0, 0, fn)); };
+        // returns the index of a jump whose offset is patched by land()
+        auto jeq0 = [&](int r) { p.push_back(ins(BPF_JMP | BPF_JEQ | BPF_K, r, 0, 0, 0)); return p.size() - 1; };
+        auto land = [&](size_t j) { p[j].off = (int16_t)(p.size() - j - 1); };
+        // bpf_probe_read_kernel(r10 + dst, size, src_reg + off)
+        auto read_into = [&](int dst, int size, int src, int off) {
+            mov_reg(BPF_REG_1, BPF_REG_10); add_imm(BPF_REG_1, dst);
+            mov_imm(BPF_REG_2, size);
+            mov_reg(BPF_REG_3, src); add_imm(BPF_REG_3, off);
+            call(BPF_FUNC_probe_read_kernel);
+        };
+        mov_reg(BPF_REG_6, BPF_REG_1);
+        ldx64(BPF_REG_7, BPF_REG_6, 8);                 // ctx->task
+        size_t no_task = jeq0(BPF_REG_7);
+        for (int off = TMP; off < 0; off += 8) p.push_back(ins(BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0, (int16_t)off, 0));
+        read_into(REC + (int)offsetof(BpfTaskRecord, pid), 4, BPF_REG_7, o.pid);
+        read_into(REC + (int)offsetof(BpfTaskRecord, tgid), 4, BPF_REG_7, o.tgid);
+        read_into(REC + (int)offsetof(BpfTaskRecord, utime_ns), 8, BPF_REG_7, o.utime);
+        read_into(REC + (int)offsetof(BpfTaskRecord, stime_ns), 8, BPF_REG_7, o.stime);
+        read_into(REC + (int)offsetof(BpfTaskRecord, runtime_ns), 8, BPF_REG_7, o.runtime);
+        read_into(REC + (int)offsetof(BpfTaskRecord, start_boottime_ns), 8, BPF_REG_7, o.start);
+        read_into(REC + (int)offsetof(BpfTaskRecord, comm), 16, BPF_REG_7, o.comm);
+        read_into(REC + (int)offsetof(BpfTaskRecord, cpu), 4, BPF_REG_7, o.cpu);
+        read_into(REC + (int)offsetof(BpfTaskRecord, nr_cpus_allowed), 4, BPF_REG_7, o.nr_cpus_allowed);
+        if (o.cpus_is_ptr) {
+            read_into(TMP, 8, BPF_REG_7, o.cpus);
+            ldx64(BPF_REG_8, BPF_REG_10, TMP);
+            size_t no_mask = jeq0(BPF_REG_8);
+            read_into(REC + (int)offsetof(BpfTaskRecord, cpus_allowed), 8, BPF_REG_8, 0);
+            land(no_mask);
+        } else {
+            read_into(REC + (int)offsetof(BpfTaskRecord, cpus_allowed), 8, BPF_REG_7, o.cpus);
+        }
+        read_into(TMP, 8, BPF_REG_7, o.real_cred);
+        ldx64(BPF_REG_8, BPF_REG_10, TMP);
+        size_t no_cred = jeq0(BPF_REG_8);
+        read_into(REC + (int)offsetof(BpfTaskRecord, uid), 4, BPF_REG_8, o.cred_uid);
+        land(no_cred);
+        read_into(TMP, 8, BPF_REG_7, o.signal);
+        ldx64(BPF_REG_8, BPF_REG_10, TMP);
+        size_t no_signal = jeq0(BPF_REG_8);
+        read_into(REC + (int)offsetof(BpfTaskRecord, dead_runtime_ns), 8, BPF_REG_8, o.dead_runtime);
+        land(no_signal);
+        read_into(TMP, 8, BPF_REG_7, o.mm);
+        ldx64(BPF_REG_8, BPF_REG_10, TMP);
+        size_t no_mm = jeq0(BPF_REG_8);
+        for (int k = 0; k < 3; ++k) read_into(REC + (int)offsetof(BpfTaskRecord, rss_pages) + 8 * k, 8, BPF_REG_8, o.rss[k]);
+        land(no_mm);
+        ldx64(BPF_REG_1, BPF_REG_6, 0);                 // ctx->meta
+        ldx64(BPF_REG_1, BPF_REG_1, 0);                 // meta->seq
+        mov_reg(BPF_REG_2, BPF_REG_10); add_imm(BPF_REG_2, REC);
+        mov_imm(BPF_REG_3, sizeof(BpfTaskRecord));
+        call(BPF_FUNC_seq_write);
+        land(no_task);
+        mov_imm(BPF_REG_0, 0);
+        p.push_back(ins(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+        return p;
+    }
+
+    void probe() {
+        probed = true;
+        BtfTypes btf;
+        if (!btf.load("/sys/kernel/btf/vmlinux")) { err = "kernel BTF not available"; return; }
+        int attach_id = btf.find(BTF_KIND_FUNC, "bpf_iter_task");
+        if (attach_id < 0) { err = "kernel has no task iterator"; return; }
+        Offsets o;
+        if (!resolve_offsets(btf, o)) return;
+        vector<bpf_insn> prog = assemble(o);
+
+        static char log[16384];
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_TRACING;
+        attr.expected_attach_type = BPF_TRACE_ITER;
+        attr.insns = (uint64_t)(uintptr_t)prog.data();
+        attr.insn_cnt = (uint32_t)prog.size();
+        attr.license = (uint64_t)(uintptr_t)"GPL";
+        attr.attach_btf_id = (uint32_t)attach_id;
+        attr.log_buf = (uint64_t)(uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        strncpy(attr.prog_name, "sysmon_tasks", sizeof(attr.prog_name) - 1);
+        prog_fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+        if (prog_fd < 0) {
+            err = string("BPF_PROG_LOAD: ") + strerror(errno);
+            return;
+        }
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = (uint32_t)prog_fd;
+        attr.link_create.attach_type = BPF_TRACE_ITER;
+        link_fd = (int)sys_bpf(BPF_LINK_CREATE, &attr);
+        if (link_fd < 0) {
+            err = string("BPF_LINK_CREATE: ") + strerror(errno);
+            return;
+        }
+        // the iterator reports pids of the namespace it was created in; make
+        // sure that is the one /proc shows us
+        vector<int> before = list_pids();
+        ProcSnapshot self;
+        bool found = false;
+        if (collect_iter(self, FIELD_COMM)) {
+            for (auto &pi : self.procs) if (pi.pid == getpid()) found = true;
+        }
+        if (!found) {
+            err = "iterator output does not match this pid namespace";
+            close(link_fd);
+            link_fd = -1;
+            return;
+        }
+        // some kernels leave a few tasks out of the iterator (seen with pid 1);
+        // those are filled in from procfs on every sample
+        vector<int> after = list_pids();
+        size_t j = 0;
+        for (int pid : before) {
+            while (j < self.procs.size() && self.procs[j].pid < pid) ++j;
+            bool listed = j < self.procs.size() && self.procs[j].pid == pid;
+            if (!listed && binary_search(after.begin(), after.end(), pid)) gaps.push_back(pid);
+        }
+    }
+
+    bool probed = false;
+    int prog_fd = -1;
+    int link_fd = -1;
+    string err;
+    string buf;
+    vector<int> gaps;
+};
+
+struct BackendRegistry {
+    vector<unique_ptr<CollectorBackend>> backends;
+
+    CollectorBackend* find(const string &name) {
+        for (auto &b : backends) if (name == b->name()) return b.get();
+        return nullptr;
+    }
+
+    // cheapest available backend whose fields cover the wanted ones
+    CollectorBackend* choose(unsigned wanted, const CollectorBackend *except = nullptr) {
+        CollectorBackend *best = nullptr;
+        for (auto &b : backends) {
+            if (b.get() == except || !b->auto_select() || !b->available()) continue;
+            if ((b->fields() & wanted) != wanted) continue;
+            if (!best || b->cost(wanted) < best->cost(wanted)) best = b.get();
+        }
+        return best;
+    }
+};
+
+void register_backends(BackendRegistry &reg, const string &fixture_root) {
+    reg.backends.emplace_back(new ProcfsSyncBackend());
+    reg.backends.emplace_back(new ProcfsParallelBackend());
+    reg.backends.emplace_back(new ProcfsUringBackend());
+    reg.backends.emplace_back(new BpfTaskIterBackend());
+    if (!fixture_root.empty()) reg.backends.emplace_back(new ProcfsSyncBackend(fixture_root, "fixture"));
+}
+
+// both snapshots are sorted by ProcKey, so matching is a single merge pass
+void update_cpu_percent(const vector<ProcInfo>& oldp, vector<ProcInfo>& newp, unsigned long long old_total_cpu, unsigned long long new_total_cpu) {
+    unsigned long long total_delta = new_total_cpu - old_total_cpu;
+    if (total_delta == 0) total_delta = 1;
+    size_t j = 0;
+    for (auto &npi : newp) {
+        ProcKey key = proc_key(npi);
+        while (j < oldp.size() && proc_key(oldp[j]) < key) ++j;
+        // a reused PID has a different starttime, so it starts from zero instead of the old process's total
+        unsigned long long old_total_proc = 0;
+        if (j < oldp.size() && proc_key(oldp[j]) == key) old_total_proc = oldp[j].total_time;
+        unsigned long long delta_proc = 0;
+        if (npi.total_time >= old_total_proc) delta_proc = npi.total_time - old_total_proc;
+        double pct = 100.0 * (double)delta_proc / (double)total_delta;
+        npi.cpu_percent = (float)pct;
+    }
+}
+
+// Last CPU% samples of one process, oldest overwritten first. Values are
+// stored as 0..255 for 0..100% to keep a ring at 34 bytes.
+struct CpuHistory {
+    static const int LEN = 32;
+    uint8_t head = 0, len = 0;
+    uint8_t v[LEN] = {};
+
+    void push(double pct) {
+        double q = pct * 2.55 + 0.5;
+        v[head] = (uint8_t)(q < 0 ? 0 : (q > 255 ? 255 : q));
+        head = (uint8_t)((head + 1) % LEN);
+        if (len < LEN) len++;
+    }
+    // i = 0 is the newest sample
+    double at(int i) const { return v[(head + LEN - 1 - i) % LEN] / 2.55; }
+};
+
+// carries each surviving process's ring over to the new list (same merge as
+// update_cpu_percent) and appends the new sample when it is a real delta
+void update_history(const vector<ProcInfo>& oldp, const vector<CpuHistory>& oldh, const vector<ProcInfo>& newp, vector<CpuHistory>& newh, bool push) {
+    newh.assign(newp.size(), CpuHistory());
+    size_t j = 0;
+    for (size_t i = 0; i < newp.size(); ++i) {
+        ProcKey key = proc_key(newp[i]);
+        while (j < oldp.size() && proc_key(oldp[j]) < key) ++j;
+        if (j < oldp.size() && j < oldh.size() && proc_key(oldp[j]) == key) newh[i] = oldh[j];
+        if (push) newh[i].push(newp[i].cpu_percent);
+    }
+}
+
+string sparkline(const CpuHistory &h, int width) {
+    static const char levels[] = " .:-=+*#";
+    string out(width, ' ');
+    int n = min<int>(width, h.len);
+    double top = 10.0; // idle processes stay flat instead of amplifying noise
+    for (int i = 0; i < n; ++i) top = max(top, h.at(i));
+    for (int i = 0; i < n; ++i) {
+        int lvl = (int)(h.at(i) / top * 7.0 + 0.5);
+        out[width - 1 - i] = levels[max(0, min(7, lvl))];
+    }
+    return out;
+}
+
+// What happened to one process between two snapshots. A process in only one
+// of them is new (before < 0) or gone (after < 0).
+struct ProcDelta {
+    int32_t before = -1, after = -1; // indices into the snapshots
+    int64_t rss_delta_kb = 0;
+    double cpu_sec = 0;              // CPU time used between the two
+};
+
+struct Comparison {
+    shared_ptr<const vector<ProcInfo>> before, after; // sorted by ProcKey
+    uint64_t before_time = 0, after_time = 0;          // wall clock seconds
+    vector<ProcDelta> rows;
+    size_t added = 0, gone = 0;
+    int64_t rss_delta_kb = 0;
+    double cpu_sec = 0;
+
+    const ProcInfo &proc(const ProcDelta &d) const { return d.after >= 0 ? (*after)[d.after] : (*before)[d.before]; }
+};
+
+// One merge pass over both lists. A new process's CPU time all falls inside
+// the interval; a gone one's last stretch is not known and counts as none.
+// hz is the clock tick rate the lists' CPU times were taken in.
+void compare_snapshots(Comparison &c, double hz) {
+    const vector<ProcInfo> &a = *c.before, &b = *c.after;
+    c.rows.clear();
+    c.rows.reserve(max(a.size(), b.size()));
+    c.added = c.gone = 0;
+    c.rss_delta_kb = 0;
+    c.cpu_sec = 0;
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        ProcDelta d;
+        if (j >= b.size() || (i < a.size() && proc_key(a[i]) < proc_key(b[j]))) {
+            d.before = (int32_t)i++;
+            c.gone++;
+        } else if (i >= a.size() || proc_key(b[j]) < proc_key(a[i])) {
+            d.after = (int32_t)j++;
+            c.added++;
+        } else {
+            d.before = (int32_t)i++;
+            d.after = (int32_t)j++;
+        }
+        const ProcInfo *pa = d.before >= 0 ? &a[d.before] : nullptr, *pb = d.after >= 0 ? &b[d.after] : nullptr;
+        d.rss_delta_kb = (int64_t)(pb ? pb->mem_kb : 0) - (int64_t)(pa ? pa->mem_kb : 0);
+        uint64_t t0 = pa ? pa->total_time : 0, t1 = pb ? pb->total_time : t0;
+        d.cpu_sec = t1 > t0 ? (double)(t1 - t0) / hz : 0.0;
+        c.rss_delta_kb += d.rss_delta_kb;
+        c.cpu_sec += d.cpu_sec;
+        c.rows.push_back(d);
+    }
+}
+
+// CPU seconds, RSS growth or pid, like sort_order()
+void sort_deltas(const Comparison &c, vector<uint32_t> &order, SortMode mode) {
+    order.resize(c.rows.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = (uint32_t)i;
+    sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+        const ProcDelta &a = c.rows[x], &b = c.rows[y];
+        if (mode == SORT_CPU && a.cpu_sec != b.cpu_sec) return a.cpu_sec > b.cpu_sec;
+        if (mode == SORT_MEM && a.rss_delta_kb != b.rss_delta_kb) return a.rss_delta_kb > b.rss_delta_kb;
+        return c.proc(a).pid < c.proc(b).pid;
+    });
+}
+
+// The process list as columns (structure of arrays), built once per published
+// list. Names and users are dictionary encoded: a row holds an index into a
+// table of distinct values, so string predicates run once per distinct value.
+struct ProcColumns {
+    size_t rows = 0;
+    vector<int32_t> pid;
+    vector<float> cpu;
+    vector<uint32_t> rss_kb;
+    vector<uint64_t> starttime;
+    vector<uint64_t> total_time;
+    vector<int16_t> last_cpu;
+    vector<uint32_t> uid;
+    vector<uint32_t> name;     // index into names
+    vector<string> names;      // distinct comms, in order of first appearance
+    vector<uint32_t> user;     // index into uids
+    vector<uint32_t> uids;     // distinct uids
+};
+
+shared_ptr<const ProcColumns> build_columns(const vector<ProcInfo> &procs) {
+    auto c = make_shared<ProcColumns>();
+    size_t n = procs.size();
+    c->rows = n;
+    c->pid.resize(n);
+    c->cpu.resize(n);
+    c->rss_kb.resize(n);
+    c->starttime.resize(n);
+    c->total_time.resize(n);
+    c->last_cpu.resize(n);
+    c->uid.resize(n);
+    c->name.resize(n);
+    c->user.resize(n);
+    unordered_map<string_view, uint32_t> name_ids; // views into procs
+    unordered_map<uint32_t, uint32_t> uid_ids;
+    for (size_t i = 0; i < n; ++i) {
+        const ProcInfo &p = procs[i];
+        c->pid[i] = p.pid;
+        c->cpu[i] = p.cpu_percent;
+        c->rss_kb[i] = p.mem_kb;
+        c->starttime[i] = p.starttime;
+        c->total_time[i] = p.total_time;
+        c->last_cpu[i] = p.last_cpu;
+        c->uid[i] = p.uid;
+        auto nit = name_ids.emplace(string_view(p.name, strnlen(p.name, sizeof(p.name))), (uint32_t)c->names.size());
+        if (nit.second) c->names.push_back(p.name);
+        c->name[i] = nit.first->second;
+        auto uit = uid_ids.emplace(p.uid, (uint32_t)c->uids.size());
+        if (uit.second) c->uids.push_back(p.uid);
+        c->user[i] = uit.first->second;
+    }
+    return c;
+}
+
+// A list's columns, built by the first reader that asks for them and then
+// shared by every frame and reader of that list.
+class LazyColumns {
+public:
+    explicit LazyColumns(shared_ptr<const vector<ProcInfo>> procs) : procs(std::move(procs)) {}
+    const ProcColumns& get() const { return *shared(); }
+    shared_ptr<const ProcColumns> shared() const {
+        call_once(once, [this]{ cols = build_columns(*procs); });
+        return cols;
+    }
+private:
+    shared_ptr<const vector<ProcInfo>> procs;
+    mutable once_flag once;
+    mutable shared_ptr<const ProcColumns> cols;
+};
+
+// A small regular expression engine: the pattern becomes a Thompson NFA, run
+// as a DFA whose states are built the first time they are reached. Supports
+// literals, ., [a-z] and [^...], \d \w \s and escaped punctuation, * + ?, |,
+// groups, and ^ / $, which anchor the branch they are in wherever they
+// appear (so a|b$ is a anywhere or b at the end). A match is searched
+// for anywhere in the text unless anchored.
+class Regex {
+public:
+    bool compile(const string &pattern, string &why) {
+        src = pattern.c_str();
+        at = 0;
+        nfa.clear();
+        err.clear();
+        Frag f = alternation();
+        if (err.empty() && src[at]) err = string("unexpected '") + src[at] + "'";
+        if (!err.empty()) { why = "regex: " + err; return false; }
+        int match = node(MATCH);
+        patch(f, match);
+        start = f.start;
+        reset_dfa();
+        return true;
+    }
+
+    bool match(const char *s, size_t n) {
+        // the DFA cache is bounded; it only starts over between matches
+        if (dstates.size() >= MAX_STATES) reset_dfa();
+        int d = start_id;
+        if (accepting[d]) return true;
+        if (n == 0) return start_accepts_empty;
+        for (size_t i = 0; i < n; ++i) {
+            d = next_state(d, (unsigned char)s[i]);
+            if (accepting[d]) return true;
+            if (dead[d]) return false;
+        }
+        return accepting_end[d];
+    }
+    bool match(const string &s) { return match(s.data(), s.size()); }
+
+private:
+    // BOL and EOL are ^ and $: they only let a path through at the start or
+    // the end of the input, so each anchors just its own branch
+    enum Kind : uint8_t { SET, SPLIT, EPS, MATCH, BOL, EOL };
+    struct Node {
+        Kind kind;
+        int out = -1, out1 = -1;
+        bitset<256> set;
+    };
+    // a partial NFA: its entry and the unconnected exits, as (node, which out)
+    struct Frag {
+        int start;
+        vector<pair<int, int>> exits;
+    };
+    static const size_t MAX_STATES = 2048;
+
+    int node(Kind k) {
+        nfa.push_back(Node());
+        nfa.back().kind = k;
+        return (int)nfa.size() - 1;
+    }
+    void patch(const Frag &f, int to) {
+        for (auto &e : f.exits) (e.second ? nfa[e.first].out1 : nfa[e.first].out) = to;
+    }
+
+    Frag alternation() {
+        Frag left = concatenation();
+        while (err.empty() && src[at] == '|') {
+            ++at;
+            Frag right = concatenation();
+            int s = node(SPLIT);
+            nfa[s].out = left.start;
+            nfa[s].out1 = right.start;
+            left.start = s;
+            left.exits.insert(left.exits.end(), right.exits.begin(), right.exits.end());
+        }
+        return left;
+    }
+
+    Frag concatenation() {
+        int e = node(EPS);
+        Frag f{e, {{e, 0}}};
+        while (err.empty() && src[at] && src[at] != '|' && src[at] != ')') {
+            Frag next = repetition();
+            if (!err.empty()) break;
+            patch(f, next.start);
+            f.exits = next.exits;
+        }
+        return f;
+    }
+
+    Frag repetition() {
+        Frag f = atom();
+        while (err.empty() && (src[at] == '*' || src[at] == '+' || src[at] == '?')) {
+            char op = src[at++];
+            int s = node(SPLIT);
+            nfa[s].out = f.start;
+            if (op == '*') {
+                patch(f, s);
+                f = Frag{s, {{s, 1}}};
+            } else if (op == '+') {
+                patch(f, s);
+                f.exits = {{s, 1}};
+            } else {
+                f.exits.push_back({s, 1});
+                f.start = s;
+            }
+        }
+        return f;
+    }
+
+    Frag atom() {
+        char c = src[at];
+        if (c == '(') {
+            ++at;
+            Frag f = alternation();
+            if (src[at] != ')') { if (err.empty()) err = "missing )"; return f; }
+            ++at;
+            return f;
+        }
+        if (c == '*' || c == '+' || c == '?') { err = string("nothing to repeat before '") + c + "'"; return Frag{node(EPS), {}}; }
+        if (c == '^' || c == '$') {
+            int n = node(c == '^' ? BOL : EOL);
+            ++at;
+            return Frag{n, {{n, 0}}};
+        }
+        int n = node(SET);
+        bitset<256> &set = nfa[n].set;
+        if (c == '.') {
+            set.set();
+            set.reset('\n');
+            ++at;
+        } else if (c == '[') {
+            ++at;
+            bool negate = src[at] == '^';
+            if (negate) ++at;
+            bool first = true;
+            while (src[at] && (src[at] != ']' || first)) {
+                first = false;
+                if (src[at] == '\\') { ++at; if (!escape(set)) return Frag{n, {{n, 0}}}; continue; }
+                unsigned char lo = (unsigned char)src[at++];
+                if (src[at] == '-' && src[at + 1] && src[at + 1] != ']') {
+                    unsigned char hi = (unsigned char)src[at + 1];
+                    at += 2;
+                    for (unsigned v = lo; v <= hi; ++v) set.set(v);
+                } else {
+                    set.set(lo);
+                }
+            }
+            if (src[at] != ']') { err = "missing ]"; return Frag{n, {{n, 0}}}; }
+            ++at;
+            if (negate) set.flip();
+        } else if (c == '\\') {
+            ++at;
+            escape(set);
+        } else {
+            set.set((unsigned char)c);
+            ++at;
+        }
+        return Frag{n, {{n, 0}}};
+    }
+
+    // after a backslash: a class (\d \w \s) or a literal character
+    bool escape(bitset<256> &set) {
+        char c = src[at];
+        if (!c) { err = "trailing \\"; return false; }
+        ++at;
+        if (c == 'd') { for (int v = '0'; v <= '9'; ++v) set.set(v); }
+        else if (c == 'w') { for (int v = 0; v < 256; ++v) if (isalnum(v) || v == '_') set.set(v); }
+        else if (c == 's') { for (char v : string(" \t\n\r\f\v")) set.set((unsigned char)v); }
+        else if (c == 'n') set.set('\n');
+        else if (c == 't') set.set('\t');
+        else set.set((unsigned char)c);
+        return true;
+    }
+
+    // the SET, MATCH and EOL nodes reachable without reading a character;
+    // at_end also goes past EOL, for the check at the end of the input
+    void closure(int n, vector<char> &seen, vector<int> &out, bool at_start, bool at_end = false) const {
+        if (n < 0 || seen[n]) return;
+        seen[n] = 1;
+        Kind k = nfa[n].kind;
+        if (k == BOL && !at_start) return;
+        if (k == SPLIT || k == EPS || k == BOL || (k == EOL && at_end)) {
+            closure(nfa[n].out, seen, out, at_start, at_end);
+            if (k == SPLIT) closure(nfa[n].out1, seen, out, at_start, at_end);
+        } else {
+            out.push_back(n);
+        }
+    }
+    bool accepts_at_end(const vector<int> &set, bool at_start) const {
+        vector<char> seen(nfa.size(), 0);
+        vector<int> reached;
+        for (int n : set) {
+            if (nfa[n].kind == MATCH) return true;
+            if (nfa[n].kind == EOL) closure(nfa[n].out, seen, reached, at_start, true);
+        }
+        for (int n : reached) if (nfa[n].kind == MATCH) return true;
+        return false;
+    }
+
+    int intern(vector<int> set) {
+        sort(set.begin(), set.end());
+        auto it = ids.find(set);
+        if (it != ids.end()) return it->second;
+        int id = (int)dstates.size();
+        bool acc = false;
+        for (int n : set) acc = acc || nfa[n].kind == MATCH;
+        ids.emplace(set, id);
+        dstates.push_back(set);
+        trans.emplace_back();
+        trans.back().fill(-1);
+        accepting.push_back(acc);
+        accepting_end.push_back(accepts_at_end(set, false));
+        // nothing left to match, and no branch can start over past the start
+        dead.push_back(set.empty() && restart_set.empty());
+        return id;
+    }
+
+    void reset_dfa() {
+        ids.clear();
+        dstates.clear();
+        trans.clear();
+        accepting.clear();
+        accepting_end.clear();
+        dead.clear();
+        // where a search starting past the first character begins: ^ blocks
+        vector<char> seen(nfa.size(), 0);
+        restart_set.clear();
+        closure(start, seen, restart_set, false);
+        seen.assign(nfa.size(), 0);
+        vector<int> set;
+        closure(start, seen, set, true);
+        start_accepts_empty = accepts_at_end(set, true);
+        start_id = intern(set);
+    }
+
+    int next_state(int d, unsigned char ch) {
+        if (trans[d][ch] >= 0) return trans[d][ch];
+        vector<char> seen(nfa.size(), 0);
+        vector<int> next;
+        for (int n : dstates[d]) {
+            if (nfa[n].kind == SET && nfa[n].set.test(ch)) closure(nfa[n].out, seen, next, false);
+        }
+        // the search may start over at every character
+        for (int n : restart_set) if (!seen[n]) { seen[n] = 1; next.push_back(n); }
+        int id = intern(next);
+        trans[d][ch] = id;
+        return id;
+    }
+
+    const char *src = "";
+    size_t at = 0;
+    string err;
+    vector<Node> nfa;
+    int start = 0;
+    vector<int> restart_set;
+    int start_id = 0;
+    bool start_accepts_empty = false;
+    map<vector<int>, int> ids;
+    vector<vector<int>> dstates;
+    vector<array<int, 256>> trans;
+    vector<bool> accepting, accepting_end, dead;
+};
+
+// What a query needs beyond the columns to turn its values into thresholds.
+struct QueryContext {
+    const UserNames *users = nullptr;
+    unsigned long long mem_total_kb = 0;
+    long long boot_time = 0;
+    time_t now = 0;
+};
+
+// Filter expressions over the process list, for example
+//   cpu > 5 and user != "root" and name ~ "^python"
+// Fields: pid cpu mem rss uid user name core age time; operators == != < <=
+// > >= and ~ !~ (regex); and/or/not (or && || !) and parentheses. A bare word
+// or string matches names containing it. rss takes K/M/G (plain numbers are
+// KB), age and time s/m/h/d, mem is percent of RAM.
+// Each predicate is one loop over one column that fills a selection bitmap,
+// 64 rows per word; and/or/not then combine whole words. Name and user
+// predicates are decided once per distinct value and looked up per row.
+class Query {
+public:
+    bool compile(const string &text, string &why) {
+        src = text;
+        at = 0;
+        nodes.clear();
+        err.clear();
+        root = -1;
+        skip_space();
+        if (at == src.size()) return true; // empty: matches everything
+        root = parse_or();
+        skip_space();
+        if (err.empty() && at != src.size()) err = "unexpected '" + src.substr(at, 12) + "'";
+        if (!err.empty()) {
+            why = err;
+            nodes.clear();
+            root = -1;
+            return false;
+        }
+        return true;
+    }
+    bool empty() const { return root < 0; }
+
+    // one bit per row, set where the row matches
+    void select(const ProcColumns &c, const QueryContext &ctx, vector<uint64_t> &sel) {
+        size_t words = (c.rows + 63) / 64;
+        sel.assign(words, ~0ULL);
+        if (root >= 0) eval(root, c, ctx, sel.data(), 0);
+        if (c.rows % 64 && words) sel[words - 1] &= (1ULL << (c.rows % 64)) - 1;
+    }
+
+private:
+    enum Field { F_PID, F_CPU, F_MEM, F_RSS, F_UID, F_USER, F_NAME, F_CORE, F_AGE, F_TIME };
+    enum Cmp { EQ, NE, LT, LE, GT, GE, RE, NRE };
+    enum Op { AND, OR, NOT, PRED };
+    struct Node {
+        Op op;
+        int a = -1, b = -1;
+        Field field = F_PID;
+        Cmp cmp = EQ;
+        double num = 0;
+        string str;
+        shared_ptr<Regex> re;
+    };
+
+    void skip_space() { while (at < src.size() && isspace((unsigned char)src[at])) ++at; }
+    bool word_at(const char *w) {
+        size_t n = strlen(w);
+        if (src.compare(at, n, w) != 0) return false;
+        if (at + n < src.size() && (isalnum((unsigned char)src[at + n]) || src[at + n] == '_')) return false;
+        at += n;
+        return true;
+    }
+    bool keyword(const char *word, const char *sym) {
+        skip_space();
+        if (src.compare(at, strlen(sym), sym) == 0) { at += strlen(sym); return true; }
+        return word_at(word);
+    }
+    int add(Node n) {
+        nodes.push_back(std::move(n));
+        return (int)nodes.size() - 1;
+    }
+
+    int parse_or() {
+        int left = parse_and();
+        while (err.empty() && keyword("or", "||")) {
+            Node n;
+            n.op = OR;
+            n.a = left;
+            n.b = parse_and();
+            left = add(std::move(n));
+        }
+        return left;
+    }
+    int parse_and() {
+        int left = parse_unary();
+        while (err.empty() && keyword("and", "&&")) {
+            Node n;
+            n.op = AND;
+            n.a = left;
+            n.b = parse_unary();
+            left = add(std::move(n));
+        }
+        return left;
+    }
+    int parse_unary() {
+        skip_space();
+        if (at < src.size() && src[at] == '!' && src.compare(at, 2, "!=") != 0 && src.compare(at, 2, "!~") != 0) {
+            ++at;
+            Node n;
+            n.op = NOT;
+            n.a = parse_unary();
+            return add(std::move(n));
+        }
+        if (word_at("not")) {
+            Node n;
+            n.op = NOT;
+            n.a = parse_unary();
+            return add(std::move(n));
+        }
+        if (at < src.size() && src[at] == '(') {
+            ++at;
+            int inner = parse_or();
+            skip_space();
+            if (at >= src.size() || src[at] != ')') { if (err.empty()) err = "missing )"; return inner; }
+            ++at;
+            return inner;
+        }
+        return parse_predicate();
+    }
+
+    // a quoted string, or a run of characters up to a space or parenthesis
+    bool value(string &out, bool &quoted) {
+        skip_space();
+        out.clear();
+        quoted = at < src.size() && (src[at] == '"' || src[at] == '\'');
+        if (quoted) {
+            char q = src[at++];
+            while (at < src.size() && src[at] != q) {
+                // \" and \' are unescaped; other escapes reach the regex as is
+                if (src[at] == '\\' && at + 1 < src.size() && src[at + 1] == q) ++at;
+                out += src[at++];
+            }
+            if (at >= src.size()) { err = "unterminated string"; return false; }
+            ++at;
+            return true;
+        }
+        while (at < src.size() && !isspace((unsigned char)src[at]) && src[at] != '(' && src[at] != ')') out += src[at++];
+        if (out.empty()) { err = at < src.size() ? "expected a value before '" + src.substr(at, 1) + "'" : "expected a value"; return false; }
+        return true;
+    }
+
+    // number with an optional unit: K/M/G for sizes (in KB), s/m/h/d for times
+    // (in seconds)
+    bool number(const string &s, Field f, double &out) {
+        char *end = nullptr;
+        out = strtod(s.c_str(), &end);
+        if (end == s.c_str()) return false;
+        string unit = end;
+        for (auto &ch : unit) ch = (char)tolower((unsigned char)ch);
+        if (unit.empty()) return true;
+        if (f == F_RSS) {
+            if (unit == "k" || unit == "kb") return true;
+            if (unit == "m" || unit == "mb") { out *= 1024; return true; }
+            if (unit == "g" || unit == "gb") { out *= 1024 * 1024; return true; }
+        } else if (f == F_AGE || f == F_TIME) {
+            if (unit == "s") return true;
+            if (unit == "m") { out *= 60; return true; }
+            if (unit == "h") { out *= 3600; return true; }
+            if (unit == "d") { out *= 86400; return true; }
+        } else if ((f == F_CPU || f == F_MEM) && unit == "%") {
+            return true;
+        }
+        return false;
+    }
+
+    int parse_predicate() {
+        static const pair<const char*, Field> fields[] = {
+            {"pid", F_PID}, {"cpu", F_CPU}, {"mem", F_MEM}, {"rss", F_RSS}, {"uid", F_UID}, {"user", F_USER},
+            {"name", F_NAME}, {"core", F_CORE}, {"age", F_AGE}, {"time", F_TIME},
+        };
+        static const pair<const char*, Cmp> cmps[] = {
+            {"==", EQ}, {"!=", NE}, {"<=", LE}, {">=", GE}, {"!~", NRE}, {"=", EQ}, {"<", LT}, {">", GT}, {"~", RE},
+        };
+        skip_space();
+        size_t start = at;
+        Node n;
+        n.op = PRED;
+        bool have_field = false;
+        for (auto &fd : fields) {
+            if (!word_at(fd.first)) continue;
+            n.field = fd.second;
+            have_field = true;
+            break;
+        }
+        bool have_cmp = false;
+        if (have_field) {
+            skip_space();
+            for (auto &c : cmps) {
+                if (src.compare(at, strlen(c.first), c.first) != 0) continue;
+                at += strlen(c.first);
+                n.cmp = c.second;
+                have_cmp = true;
+                break;
+            }
+        }
+        string v;
+        bool quoted = false;
+        if (!have_cmp) {
+            // a bare word: names containing it
+            at = start;
+            if (!value(v, quoted)) return add(std::move(n));
+            string pattern;
+            for (char ch : v) {
+                if (!isalnum((unsigned char)ch)) pattern += '\\';
+                pattern += ch;
+            }
+            n.field = F_NAME;
+            n.cmp = RE;
+            v = pattern;
+        } else if (!value(v, quoted)) {
+            return add(std::move(n));
+        }
+        bool text_field = n.field == F_NAME || n.field == F_USER;
+        if (n.cmp == RE || n.cmp == NRE) {
+            if (!text_field) { err = "~ only applies to name and user"; return add(std::move(n)); }
+            n.re = make_shared<Regex>();
+            string why;
+            if (!n.re->compile(v, why)) { err = why; return add(std::move(n)); }
+        } else if (text_field) {
+            if (n.cmp != EQ && n.cmp != NE) { err = "name and user only compare with ==, !=, ~ and !~"; return add(std::move(n)); }
+            n.str = v;
+        } else if (quoted || !number(v, n.field, n.num)) {
+            err = "not a number: " + v;
+        }
+        return add(std::move(n));
+    }
+
+    // The column loop: bit j of each word is pred(row). The predicate fills
+    // 64 bytes at a time, a fixed-count loop the compiler vectorizes at -O2,
+    // and a multiply packs each 8 bytes into 8 bits.
+    template <class T, class P>
+    static void scan(const T *col, size_t rows, P pred, uint64_t *out) {
+        alignas(64) uint8_t hit[64];
+        for (size_t w = 0; w * 64 < rows; ++w) {
+            const T *c = col + w * 64;
+            if (rows - w * 64 >= 64) {
+                for (int j = 0; j < 64; ++j) hit[j] = pred(c[j]);
+            } else {
+                memset(hit, 0, sizeof(hit));
+                for (size_t j = 0; j < rows - w * 64; ++j) hit[j] = pred(c[j]);
+            }
+            uint64_t bits = 0;
+            for (int k = 0; k < 8; ++k) {
+                uint64_t eight;
+                memcpy(&eight, hit + 8 * k, 8);
+                bits |= ((eight * 0x0102040810204080ULL) >> 56) << (8 * k);
+            }
+            out[w] = bits;
+        }
+    }
+    // The value is turned into a bound of the column's own type, so the loop
+    // compares without conversions: on integers x > 2.5 is x > 2 and x >= 2.5
+    // is x >= 3.
+    template <class T>
+    static void compare(const vector<T> &col, size_t rows, Cmp cmp, double v, uint64_t *out) {
+        size_t words = (rows + 63) / 64;
+        auto fill = [&](bool all) { for (size_t w = 0; w < words; ++w) out[w] = all ? ~0ULL : 0; };
+        T t;
+        if constexpr (is_floating_point<T>::value) {
+            t = (T)v;
+        } else {
+            double b = (cmp == GT || cmp == LE) ? floor(v) : ceil(v);
+            double lo = (double)numeric_limits<T>::min(), hi = (double)numeric_limits<T>::max();
+            if ((cmp == EQ || cmp == NE) && (b != v || b < lo || b >= hi)) return fill(cmp == NE);
+            if (b < lo) return fill(cmp == GT || cmp == GE || cmp == NE);
+            if (b >= hi) return fill(cmp == LT || cmp == LE || cmp == NE);
+            t = (T)b;
+        }
+        const T *p = col.data();
+        switch (cmp) {
+        case EQ: scan(p, rows, [t](T x) { return x == t; }, out); break;
+        case NE: scan(p, rows, [t](T x) { return x != t; }, out); break;
+        case LT: scan(p, rows, [t](T x) { return x < t; }, out); break;
+        case LE: scan(p, rows, [t](T x) { return x <= t; }, out); break;
+        case GT: scan(p, rows, [t](T x) { return x > t; }, out); break;
+        case GE: scan(p, rows, [t](T x) { return x >= t; }, out); break;
+        default: break;
+        }
+    }
+    // one verdict per dictionary entry, then a lookup per row
+    static void lookup(const vector<uint32_t> &ids, size_t rows, const vector<uint8_t> &verdict, uint64_t *out) {
+        size_t words = (rows + 63) / 64;
+        size_t yes = 0;
+        uint32_t last_yes = 0, last_no = 0;
+        for (size_t i = 0; i < verdict.size(); ++i) {
+            if (verdict[i]) { yes++; last_yes = (uint32_t)i; }
+            else last_no = (uint32_t)i;
+        }
+        if (yes == 0 || yes == verdict.size()) {
+            for (size_t w = 0; w < words; ++w) out[w] = yes ? ~0ULL : 0;
+            return;
+        }
+        // a single value in or out (user == root, name != bash) is a plain compare
+        if (yes == 1) return scan(ids.data(), rows, [last_yes](uint32_t id) { return id == last_yes; }, out);
+        if (yes + 1 == verdict.size()) return scan(ids.data(), rows, [last_no](uint32_t id) { return id != last_no; }, out);
+        const uint8_t *v = verdict.data();
+        const uint32_t *id = ids.data();
+        for (size_t w = 0; w < words; ++w) {
+            size_t base = w * 64, m = min<size_t>(64, rows - base);
+            uint64_t bits = 0;
+            for (size_t j = 0; j < m; ++j) bits |= (uint64_t)v[id[base + j]] << j;
+            out[w] = bits;
+        }
+    }
+
+    void predicate(const Node &n, const ProcColumns &c, const QueryContext &ctx, uint64_t *out) {
+        static const double hz = (double)max(1L, sysconf(_SC_CLK_TCK));
+        size_t rows = c.rows;
+        switch (n.field) {
+        case F_PID: compare(c.pid, rows, n.cmp, n.num, out); break;
+        case F_CPU: compare(c.cpu, rows, n.cmp, n.num, out); break;
+        case F_RSS: compare(c.rss_kb, rows, n.cmp, n.num, out); break;
+        case F_MEM: compare(c.rss_kb, rows, n.cmp, n.num * (double)ctx.mem_total_kb / 100.0, out); break;
+        case F_UID: compare(c.uid, rows, n.cmp, n.num, out); break;
+        case F_CORE: compare(c.last_cpu, rows, n.cmp, n.num, out); break;
+        case F_TIME: compare(c.total_time, rows, n.cmp, n.num * hz, out); break;
+        case F_AGE: {
+            // older means an earlier start, so the comparison turns around
+            double start = ((double)(ctx.now - ctx.boot_time) - n.num) * hz;
+            static const Cmp flipped[] = {EQ, NE, GT, GE, LT, LE, RE, NRE};
+            compare(c.starttime, rows, flipped[n.cmp], start, out);
+            break;
+        }
+        case F_NAME:
+        case F_USER: {
+            bool name = n.field == F_NAME;
+            size_t distinct = name ? c.names.size() : c.uids.size();
+            vector<uint8_t> verdict(distinct);
+            for (size_t i = 0; i < distinct; ++i) {
+                string uid_name;
+                if (!name) uid_name = ctx.users ? user_name(*ctx.users, c.uids[i]) : to_string(c.uids[i]);
+                const string &s = name ? c.names[i] : uid_name;
+                bool hit = n.re ? n.re->match(s) : s == n.str;
+                verdict[i] = (n.cmp == NE || n.cmp == NRE) ? !hit : hit;
+            }
+            lookup(name ? c.name : c.user, rows, verdict, out);
+            break;
+        }
+        }
+    }
+
+    // depth picks the scratch bitmap for the right-hand side
+    void eval(int id, const ProcColumns &c, const QueryContext &ctx, uint64_t *out, size_t depth) {
+        const Node &n = nodes[id];
+        size_t words = (c.rows + 63) / 64;
+        if (n.op == PRED) {
+            predicate(n, c, ctx, out);
+        } else if (n.op == NOT) {
+            eval(n.a, c, ctx, out, depth);
+            for (size_t w = 0; w < words; ++w) out[w] = ~out[w];
+        } else {
+            if (scratch.size() <= depth) scratch.resize(depth + 1);
+            eval(n.a, c, ctx, out, depth + 1);
+            scratch[depth].resize(words);
+            uint64_t *rhs = scratch[depth].data();
+            eval(n.b, c, ctx, rhs, depth + 1);
+            if (n.op == AND) for (size_t w = 0; w < words; ++w) out[w] &= rhs[w];
+            else for (size_t w = 0; w < words; ++w) out[w] |= rhs[w];
+        }
+    }
+
+    string src;
+    size_t at = 0;
+    string err;
+    vector<Node> nodes;
+    int root = -1;
+    vector<vector<uint64_t>> scratch;
+};
+
+// Scale mode, for hosts with hundreds of thousands of tasks. /proc is read as
+// a stream: every stat file goes through one fixed buffer and leaves a 24-byte
+// ScaleEntry behind, so neither the raw text nor a full ProcInfo list is held.
+// Only the top K under the current sort order become ProcInfo records (their
+// comm and uid are re-read then); the rest is summed exactly and described by
+// a fixed-size reservoir sample.
+struct ScaleEntry {
+    int32_t pid;
+    uint32_t mem_kb;
+    uint64_t starttime;
+    uint64_t total_time;
+};
+static_assert(sizeof(ScaleEntry) == 24, "ScaleEntry layout");
+
+struct ScaleStats {
+    size_t tasks = 0;           // in the last scan
+    size_t listed = 0;          // of those, turned into ProcInfo
+    uint64_t rss_total_kb = 0;
+    double cpu_total_percent = 0;
+    size_t sampled = 0;         // the percentiles come from this many tasks
+    float cpu_p50 = 0, cpu_p99 = 0;
+    uint32_t rss_p50_kb = 0, rss_p99_kb = 0;
+    double scan_ms = 0;
+    size_t bytes = 0;           // held by the collector between scans
+};
+
+// pid from a /proc directory name, or -1
+int parse_pid_name(const char *s) {
+    if (!*s) return -1;
+    int v = 0;
+    for (; *s; ++s) {
+        if (*s < '0' || *s > '9' || v > 100000000) return -1;
+        v = v * 10 + (*s - '0');
+    }
+    return v;
+}
+
+// reads up to cap bytes of <dir>/<pid>/<file>
+ssize_t read_pid_file(int dirfd, int pid, const char *file, char *buf, size_t cap) {
+    char path[64];
+    snprintf(path, sizeof(path), "%d/%s", pid, file);
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, cap);
+    close(fd);
+    return n;
+}
+
+// parse_proc_stat() without allocating: comm, times, starttime, rss and the
+// last CPU
+bool parse_stat_buf(const char *buf, size_t len, ProcInfo &pi) {
+    static const uint64_t page_kb = (uint64_t)sysconf(_SC_PAGE_SIZE) / 1024;
+    const char *open = (const char*)memchr(buf, '(', len);
+    const char *close = (const char*)memrchr(buf, ')', len);
+    if (!open || !close || close < open || close + 2 > buf + len) return false;
+    set_comm(pi, open + 1, (size_t)(close - open - 1));
+    const char *p = close + 2, *end = buf + len;
+    uint64_t utime = 0, stime = 0;
+    int field = 3; // state
+    for (; field <= 39 && p < end; ++field, ++p) {
+        uint64_t v = 0;
+        bool neg = (*p == '-');
+        for (; p < end && *p != ' ' && *p != '\n'; ++p) v = v * 10 + (uint64_t)(*p - '0');
+        if (neg) v = 0;
+        if (field == 14) utime = v;
+        else if (field == 15) stime = v;
+        else if (field == 22) pi.starttime = v;
+        else if (field == 24) pi.mem_kb = (uint32_t)(v * page_kb);
+        else if (field == 39) pi.last_cpu = (int16_t)v;
+    }
+    if (field <= 24) return false;
+    pi.total_time = utime + stime;
+    return true;
+}
+
+uint32_t parse_status_uid_buf(const char *buf, size_t len) {
+    const char *at = (const char*)memmem(buf, len, "\nUid:", 5);
+    if (!at) return (uint32_t)-1;
+    const char *p = at + 5, *end = buf + len;
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (p >= end || *p < '0' || *p > '9') return (uint32_t)-1;
+    uint32_t v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) v = v * 10 + (uint32_t)(*p - '0');
+    return v;
+}
+
+class ScaleCollector {
+public:
+    static const size_t SAMPLE = 4096;
+
+    ScaleCollector(const string &root, size_t k) : root(root), k(k) {}
+    const char *name() const { return "scale"; }
+    size_t top_k() const { return k; }
+    const ScaleStats &stats() const { return st; }
+    bool scanned() const { return has_scan; }
+
+    // called about every PROGRESS_MS during a scan with the tasks read so far
+    function<void(size_t done)> progress;
+
+    // One pass over the tree. cpu_delta is the /proc/stat total since the
+    // previous scan; the first scan has no baseline and reports 0% for all.
+    bool scan(unsigned long long cpu_delta) {
+        auto t0 = steady_clock::now();
+        DIR *d = opendir(root.c_str());
+        if (!d) return false;
+        prev.swap(cur);
+        cur.clear();
+        cur.reserve(prev.size() + prev.size() / 8 + 1024);
+        bool sorted = true;
+        char buf[1024];
+        auto next_progress = t0 + milliseconds(CollectorBackend::PROGRESS_MS);
+        struct dirent *de;
+        while ((de = readdir(d)) != nullptr) {
+            int pid = parse_pid_name(de->d_name);
+            if (pid <= 0) continue;
+            ssize_t n = read_pid_file(dirfd(d), pid, "stat", buf, sizeof(buf));
+            ProcInfo pi;
+            if (n <= 0 || !parse_stat_buf(buf, (size_t)n, pi)) continue;
+            if (!cur.empty() && cur.back().pid > pid) sorted = false;
+            cur.push_back(ScaleEntry{pid, pi.mem_kb, pi.starttime, pi.total_time});
+            if (progress && (cur.size() & 1023) == 0 && steady_clock::now() >= next_progress) {
+                progress(cur.size());
+                next_progress = steady_clock::now() + milliseconds(CollectorBackend::PROGRESS_MS);
+            }
+        }
+        closedir(d);
+        // /proc lists pids in order; a directory tree on disk does not
+        if (!sorted) sort(cur.begin(), cur.end(), [](const ScaleEntry &a, const ScaleEntry &b) {
+            return a.pid != b.pid ? a.pid < b.pid : a.starttime < b.starttime;
+        });
+        summarize(has_scan ? cpu_delta : 0);
+        // the baseline is only needed during the merge
+        vector<ScaleEntry>().swap(prev);
+        has_scan = true;
+        st.scan_ms = duration<double, milli>(steady_clock::now() - t0).count();
+        st.bytes = cur.capacity() * sizeof(ScaleEntry) + cpu.capacity() * sizeof(float)
+                 + (cpu_sample.capacity() + rss_sample.capacity()) * 4;
+        return true;
+    }
+
+    // The top K of the last scan under mode, sorted by ProcKey. Tasks that
+    // exited (or whose pid was reused) since the scan are left out.
+    vector<ProcInfo> top(SortMode mode, unsigned wanted) {
+        auto before = [&](uint32_t a, uint32_t b) {
+            const ScaleEntry &x = cur[a], &y = cur[b];
+            if (mode == SORT_CPU && cpu[a] != cpu[b]) return cpu[a] > cpu[b];
+            if (mode == SORT_MEM && x.mem_kb != y.mem_kb) return x.mem_kb > y.mem_kb;
+            return x.pid < y.pid;
+        };
+        // bounded heap with the worst of the kept ones on top: O(n log K)
+        vector<uint32_t> keep;
+        keep.reserve(k);
+        for (uint32_t i = 0; i < (uint32_t)cur.size(); ++i) {
+            if (keep.size() < k) {
+                keep.push_back(i);
+                push_heap(keep.begin(), keep.end(), before);
+            } else if (before(i, keep.front())) {
+                pop_heap(keep.begin(), keep.end(), before);
+                keep.back() = i;
+                push_heap(keep.begin(), keep.end(), before);
+            }
+        }
+        sort(keep.begin(), keep.end());
+        vector<ProcInfo> out;
+        out.reserve(keep.size());
+        int dir = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir < 0) return out;
+        char buf[1024], status[4096]; // Cpus_allowed is past the first 1 KB of status
+        for (uint32_t i : keep) {
+            const ScaleEntry &e = cur[i];
+            ProcInfo pi;
+            ssize_t n = read_pid_file(dir, e.pid, "stat", buf, sizeof(buf));
+            if (n <= 0 || !parse_stat_buf(buf, (size_t)n, pi) || pi.starttime != e.starttime) continue;
+            pi.pid = e.pid;
+            pi.total_time = e.total_time;
+            pi.mem_kb = e.mem_kb;
+            pi.cpu_percent = cpu[i];
+            if (wanted & FIELDS_STATUS) {
+                n = read_pid_file(dir, e.pid, "status", status, sizeof(status));
+                if (n > 0 && (wanted & FIELD_UID)) pi.uid = parse_status_uid_buf(status, (size_t)n);
+                if (n > 0 && (wanted & FIELD_AFFINITY)) set_affinity(pi, parse_status_affinity(status, (size_t)n));
+            }
+            out.push_back(pi);
+        }
+        close(dir);
+        st.listed = out.size();
+        return out;
+    }
+
+private:
+    // CPU% by merging with the previous scan; exact sums over every task and
+    // percentiles from a reservoir sample of SAMPLE of them
+    void summarize(unsigned long long cpu_delta) {
+        double scale = cpu_delta ? 100.0 / (double)cpu_delta : 0.0;
+        cpu.resize(cur.size());
+        cpu_sample.clear();
+        rss_sample.clear();
+        st = ScaleStats();
+        st.tasks = cur.size();
+        size_t j = 0;
+        for (size_t i = 0; i < cur.size(); ++i) {
+            const ScaleEntry &e = cur[i];
+            while (j < prev.size() && (prev[j].pid < e.pid || (prev[j].pid == e.pid && prev[j].starttime < e.starttime))) ++j;
+            uint64_t old = (j < prev.size() && prev[j].pid == e.pid && prev[j].starttime == e.starttime) ? prev[j].total_time : 0;
+            cpu[i] = (float)((double)(e.total_time >= old ? e.total_time - old : 0) * scale);
+            st.cpu_total_percent += cpu[i];
+            st.rss_total_kb += e.mem_kb;
+            size_t slot = i < SAMPLE ? i : (size_t)(rng() % (i + 1));
+            if (slot < SAMPLE) {
+                if (slot == cpu_sample.size()) {
+                    cpu_sample.push_back(cpu[i]);
+                    rss_sample.push_back(e.mem_kb);
+                } else {
+                    cpu_sample[slot] = cpu[i];
+                    rss_sample[slot] = e.mem_kb;
+                }
+            }
+        }
+        st.sampled = cpu_sample.size();
+        if (cpu_sample.empty()) return;
+        auto pct = [](auto v, double q) {
+            size_t at = min(v.size() - 1, (size_t)(q * (double)v.size()));
+            nth_element(v.begin(), v.begin() + at, v.end());
+            return v[at];
+        };
+        st.cpu_p50 = pct(cpu_sample, 0.50);
+        st.cpu_p99 = pct(cpu_sample, 0.99);
+        st.rss_p50_kb = pct(rss_sample, 0.50);
+        st.rss_p99_kb = pct(rss_sample, 0.99);
+    }
+
+    string root;
+    size_t k;
+    bool has_scan = false;
+    vector<ScaleEntry> prev, cur; // sorted by (pid, starttime)
+    vector<float> cpu;            // parallel to cur
+    vector<float> cpu_sample;
+    vector<uint32_t> rss_sample;
+    minstd_rand rng{1};
+    ScaleStats st;
+};
+
+string read_cmdline(int pid) {
+    ifstream f("/proc/" + to_string(pid) + "/cmdline", ios::binary);
+    if (!f) return string();
+    string raw((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    while (!raw.empty() && raw.back() == '\0') raw.pop_back();
+    replace(raw.begin(), raw.end(), '\0', ' ');
+    return raw;
+}
+
+// Full command lines are only read for rows that are drawn, and are cached by
+// identity because they almost never change over a process's lifetime.
+struct CmdlineCache {
+    struct Entry {
+        string cmdline;
+        unsigned long long last_used = 0;
+    };
+    map<ProcKey, Entry> entries;
+    size_t max_entries = 4096;
+    unsigned long long tick = 0;
+
+    const string& get(const ProcInfo &p) {
+        ++tick;
+        auto it = entries.find(proc_key(p));
+        if (it == entries.end()) {
+            if (entries.size() >= max_entries) evict();
+            Entry e;
+            e.cmdline = read_cmdline(p.pid);
+            if (e.cmdline.empty()) e.cmdline = string("[") + p.name + "]";
+            it = entries.emplace(proc_key(p), std::move(e)).first;
+        }
+        it->second.last_used = tick;
+        return it->second.cmdline;
+    }
+
+    // entries from a saved state; re-validated by ProcKey before use
+    void preload(const ProcKey &key, const string &cmdline) {
+        if (entries.size() >= max_entries) return;
+        Entry e;
+        e.cmdline = cmdline;
+        entries.emplace(key, std::move(e));
+    }
+
+    // drops the least recently drawn quarter of the cache
+    void evict() {
+        vector<unsigned long long> ticks;
+        ticks.reserve(entries.size());
+        for (auto &kv : entries) ticks.push_back(kv.second.last_used);
+        size_t drop = max<size_t>(1, entries.size() / 4);
+        nth_element(ticks.begin(), ticks.begin() + (drop - 1), ticks.end());
+        unsigned long long cutoff = ticks[drop - 1];
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            if (it->second.last_used <= cutoff) it = entries.erase(it);
+            else ++it;
+        }
+    }
+};
+
+string format_age(long long secs) {
+    if (secs < 0) secs = 0;
+    char buf[32];
+    if (secs < 60) snprintf(buf, sizeof(buf), "%llds", secs);
+    else if (secs < 3600) snprintf(buf, sizeof(buf), "%lldm%02llds", secs/60, secs%60);
+    else if (secs < 86400) snprintf(buf, sizeof(buf), "%lldh%02lldm", secs/3600, (secs%3600)/60);
+    else snprintf(buf, sizeof(buf), "%lldd%02lldh", secs/86400, (secs%86400)/3600);
+    return string(buf);
+}
+
+long long process_age(const ProcInfo &p, long long boot_time, time_t now) {
+    static long clk_tck = sysconf(_SC_CLK_TCK);
+    if (clk_tck <= 0) clk_tck = 100;
+    long long started = boot_time + (long long)(p.starttime / (unsigned long long)clk_tck);
+    return (long long)now - started;
+}
+
+string human_kb(size_t kb) {
+    if (kb > 1024ULL*1024ULL) {
+        double gb = (double)kb / (1024.0*1024.0);
+        char buf[64]; snprintf(buf, sizeof(buf), "%.2fGB", gb);
+        return string(buf);
+    } else if (kb > 1024) {
+        double mb = (double)kb / 1024.0;
+        char buf[64]; snprintf(buf, sizeof(buf), "%.1fMB", mb);
+        return string(buf);
+    } else {
+        return to_string(kb) + "KB";
+    }
+}
+
+string signed_kb(int64_t kb) {
+    return (kb < 0 ? "-" : "+") + human_kb((size_t)(kb < 0 ? -kb : kb));
+}
+
+// "all", a CPU list such as "0-3,8" ("+" when CPUs past 63 are allowed too),
+// or "-" if unknown
+string format_affinity(const ProcInfo &p, int ncpus) {
+    if (p.ncpus_allowed == 0) return "-";
+    if (p.ncpus_allowed >= ncpus) return "all";
+    string out;
+    for (int c = 0; c < 64; ++c) {
+        if (!(p.cpus_allowed >> c & 1)) continue;
+        int end = c;
+        while (end < 63 && (p.cpus_allowed >> (end + 1) & 1)) ++end;
+        if (!out.empty()) out += ",";
+        out += to_string(c);
+        if (end > c) out += "-" + to_string(end);
+        c = end;
+    }
+    if (p.ncpus_allowed > __builtin_popcountll(p.cpus_allowed)) out += "+";
+    return out;
+}
+
+// One rectangle of the screen that the draw_* functions paint into. Nothing
+// reaches the terminal until the renderer presents the frame.
+class Canvas {
+public:
+    virtual ~Canvas() {}
+    virtual int rows() const = 0;
+    virtual int cols() const = 0;
+    virtual void place(int h, int w, int y, int x) = 0;
+    virtual void blank() = 0;
+    virtual void outline() = 0;
+    virtual void hrule(int y, int x, int n) = 0;
+    virtual void cursor(int y, int x) = 0;
+    virtual void vprint(const char *fmt, va_list ap) = 0; // at the cursor
+    virtual void attr(int a, bool on) = 0;                // A_BOLD, A_REVERSE
+    virtual void finish() = 0;                            // done for this frame
+
+    void print(int y, int x, const char *fmt, ...) __attribute__((format(printf, 4, 5))) {
+        va_list ap;
+        va_start(ap, fmt);
+        cursor(y, x);
+        vprint(fmt, ap);
+        va_end(ap);
+    }
+    void append(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list ap;
+        va_start(ap, fmt);
+        vprint(fmt, ap);
+        va_end(ap);
+    }
+};
+
+// The terminal: hands out canvases, presents frames and reads keys (ncurses
+// KEY_* codes, ERR when there is none).
+class Renderer {
+public:
+    virtual ~Renderer() {}
+    virtual const char *name() const = 0;
+    virtual int rows() const = 0;
+    virtual int cols() const = 0;
+    virtual unique_ptr<Canvas> canvas(int h, int w, int y, int x) = 0;
+    virtual void repaint() = 0; // the next present() redraws the whole screen
+    virtual void present() = 0;
+    virtual int key() = 0;
+    virtual int wait_key() = 0;
+};
+
+class NcursesCanvas : public Canvas {
+public:
+    NcursesCanvas(int h, int w, int y, int x) : win(newwin(h, w, y, x)) {}
+    ~NcursesCanvas() override { delwin(win); }
+    int rows() const override { return getmaxy(win); }
+    int cols() const override { return getmaxx(win); }
+    void place(int h, int w, int y, int x) override {
+        wresize(win, h, w);
+        mvwin(win, y, x);
+    }
+    void blank() override { werase(win); }
+    void outline() override { box(win, 0, 0); }
+    void hrule(int y, int x, int n) override { mvwhline(win, y, x, ACS_HLINE, n); }
+    void cursor(int y, int x) override { wmove(win, y, x); }
+    void vprint(const char *fmt, va_list ap) override { vw_printw(win, fmt, ap); }
+    void attr(int a, bool on) override { if (on) wattron(win, a); else wattroff(win, a); }
+    void finish() override { wnoutrefresh(win); }
+    WINDOW *win;
+};
+
+// ncurses diffs each window against its idea of the screen and sends the
+// changes on doupdate().
+class NcursesRenderer : public Renderer {
+public:
+    // on the controlling terminal, or (for benchmarks) on the given streams
+    NcursesRenderer(FILE *out = nullptr, FILE *in = nullptr) {
+        if (out) screen = newterm(nullptr, out, in);
+        else initscr();
+        noecho();
+        cbreak();
+        curs_set(0);
+        keypad(stdscr, TRUE);
+        nodelay(stdscr, TRUE);
+    }
+    ~NcursesRenderer() override {
+        endwin();
+        if (screen) delscreen(screen);
+    }
+    const char *name() const override { return "ncurses"; }
+    int rows() const override { return getmaxy(stdscr); }
+    int cols() const override { return getmaxx(stdscr); }
+    unique_ptr<Canvas> canvas(int h, int w, int y, int x) override { return unique_ptr<Canvas>(new NcursesCanvas(h, w, y, x)); }
+    void repaint() override { clearok(curscr, TRUE); }
+    void present() override { doupdate(); }
+    int key() override { return getch(); }
+    int wait_key() override {
+        nodelay(stdscr, FALSE);
+        int ch = getch();
+        nodelay(stdscr, TRUE);
+        return ch;
+    }
+private:
+    SCREEN *screen = nullptr;
+};
+
+// Keeps the screen as a grid of cells and sends each frame as the difference
+// from the previous one, with a single write(). Cells hold one byte, so only
+// ASCII is drawn as is; box lines use the DEC line-drawing set like ncurses.
+class AnsiRenderer : public Renderer {
+public:
+    struct Cell {
+        char ch = ' ';
+        uint8_t attr = 0;
+        bool operator==(const Cell &o) const { return ch == o.ch && attr == o.attr; }
+        bool operator!=(const Cell &o) const { return !(*this == o); }
+    };
+    enum : uint8_t { CELL_BOLD = 1, CELL_REVERSE = 2, CELL_LINE = 4 };
+
+    // tty: take over the terminal in in_fd/out_fd (raw input, alternate
+    // screen); otherwise just write frames of the given size to out_fd
+    AnsiRenderer(int out_fd, int in_fd, bool tty, int h = 0, int w = 0) : out_fd(out_fd), in_fd(in_fd), tty(tty) {
+        struct winsize ws;
+        if (tty && ioctl(out_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+            h = ws.ws_row;
+            w = ws.ws_col;
+        }
+        nrows = h > 0 ? h : 24;
+        ncols = w > 0 ? w : 80;
+        back.assign((size_t)nrows * ncols, Cell());
+        front = back;
+        if (tty && tcgetattr(in_fd, &saved) == 0) {
+            struct termios raw = saved;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_iflag &= ~(IXON | ICRNL);
+            raw.c_cc[VMIN] = 0;
+            raw.c_cc[VTIME] = 0;
+            tcsetattr(in_fd, TCSAFLUSH, &raw);
+            restore = true;
+        }
+        if (tty) {
+            emit("\033[?1049h\033[?25l");
+            take_signals();
+        }
+    }
+    ~AnsiRenderer() override {
+        if (tty) {
+            emit(LEAVE);
+            active = nullptr;
+        }
+        if (restore) tcsetattr(in_fd, TCSAFLUSH, &saved);
+    }
+    const char *name() const override { return "ansi"; }
+    int rows() const override { return nrows; }
+    int cols() const override { return ncols; }
+    unique_ptr<Canvas> canvas(int h, int w, int y, int x) override;
+    void repaint() override { full = true; }
+
+    void present() override {
+        out.clear();
+        if (full) {
+            out += "\033[0m\033(B\033[H\033[2J";
+            fill(front.begin(), front.end(), Cell());
+            pen = 0;
+            cur_y = cur_x = 0;
+            full = false;
+        }
+        for (int y = 0; y < nrows; ++y) {
+            const Cell *b = &back[(size_t)y * ncols], *f = &front[(size_t)y * ncols];
+            for (int x = 0; x < ncols;) {
+                if (b[x] == f[x]) {
+                    // a short run of unchanged cells costs less to rewrite than
+                    // a cursor move past it
+                    int next = x + 1;
+                    while (next < ncols && next - x < GAP && b[next] == f[next]) ++next;
+                    if (cur_y != y || cur_x != x || next >= ncols || next - x >= GAP) {
+                        x = next;
+                        continue;
+                    }
+                } else if (cur_y != y || cur_x != x) {
+                    move_to(y, x);
+                }
+                put_cell(b[x]);
+                ++x;
+                cur_y = y;
+                // the cursor stays on the last column until the next character
+                cur_x = (x < ncols) ? x : -1;
+            }
+        }
+        front = back;
+        if (!out.empty()) emit(out);
+    }
+
+    // KEY_RESIZE once the screen has been resized to a new window size
+    int key() override {
+        if (winch) {
+            winch = 0;
+            if (take_size()) return KEY_RESIZE;
+        }
+        char buf[64];
+        ssize_t n;
+        while (tty && (n = read(in_fd, buf, sizeof(buf))) > 0) input.append(buf, (size_t)n);
+        return decode_key();
+    }
+    int wait_key() override {
+        int ch;
+        while ((ch = key()) == ERR) {
+            struct pollfd p = {in_fd, POLLIN, 0};
+            if (!tty || poll(&p, 1, -1) < 0) return ERR;
+        }
+        return ch;
+    }
+
+    Cell *at(int y, int x) { return (y >= 0 && y < nrows && x >= 0 && x < ncols) ? &back[(size_t)y * ncols + x] : nullptr; }
+
+private:
+    static const int GAP = 4;     // longest unchanged run worth rewriting
+    static constexpr const char *LEAVE = "\033[0m\033(B\033[?25h\033[?1049l";
+
+    // The terminal is put back on exit() and on the signals that end the
+    // process; the handler only uses write() and tcsetattr(), then re-raises.
+    // SIGWINCH just marks the size as stale for the next key().
+    void take_signals() {
+        active = this;
+        static bool installed = false;
+        if (installed) return;
+        installed = true;
+        atexit([]{ leave_screen(); });
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = [](int sig) {
+            leave_screen();
+            signal(sig, SIG_DFL);
+            raise(sig);
+        };
+        sigemptyset(&sa.sa_mask);
+        for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGQUIT}) sigaction(sig, &sa, nullptr);
+        sa.sa_handler = [](int) { winch = 1; };
+        sigaction(SIGWINCH, &sa, nullptr);
+    }
+    static void leave_screen() {
+        AnsiRenderer *r = active;
+        if (!r) return;
+        active = nullptr;
+        ssize_t n = write(r->out_fd, LEAVE, strlen(LEAVE));
+        (void)n;
+        if (r->restore) tcsetattr(r->in_fd, TCSAFLUSH, &r->saved);
+    }
+    // false if the size did not change
+    bool take_size() {
+        struct winsize ws;
+        if (ioctl(out_fd, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0 || ws.ws_col == 0) return false;
+        if (ws.ws_row == nrows && ws.ws_col == ncols) return false;
+        nrows = ws.ws_row;
+        ncols = ws.ws_col;
+        back.assign((size_t)nrows * ncols, Cell());
+        front = back;
+        full = true;
+        return true;
+    }
+    static inline AnsiRenderer *volatile active = nullptr;
+    static inline volatile sig_atomic_t winch = 0;
+
+    // the shortest of an absolute move, a column move or a move forward
+    void move_to(int y, int x) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "\033[%d;%dH", y + 1, x + 1);
+        if (y == cur_y) {
+            char alt[16];
+            int m = (cur_x >= 0 && x > cur_x) ? snprintf(alt, sizeof(alt), "\033[%dC", x - cur_x)
+                                              : snprintf(alt, sizeof(alt), "\033[%dG", x + 1);
+            if (m < n) {
+                memcpy(buf, alt, (size_t)m);
+                n = m;
+            }
+        }
+        out.append(buf, (size_t)n);
+        cur_y = y;
+        cur_x = x;
+    }
+
+    void put_cell(const Cell &c) {
+        uint8_t sgr = c.attr & (CELL_BOLD | CELL_REVERSE);
+        if (sgr != (pen & (CELL_BOLD | CELL_REVERSE))) {
+            out += "\033[0";
+            if (sgr & CELL_BOLD) out += ";1";
+            if (sgr & CELL_REVERSE) out += ";7";
+            out += 'm';
+        }
+        if ((c.attr & CELL_LINE) != (pen & CELL_LINE)) out += (c.attr & CELL_LINE) ? "\033(0" : "\033(B";
+        pen = c.attr;
+        out += c.ch;
+    }
+
+    void emit(const string &s) {
+        const char *p = s.data();
+        size_t len = s.size();
+        while (len > 0) {
+            ssize_t n = write(out_fd, p, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            p += n;
+            len -= (size_t)n;
+        }
+    }
+
+    // arrows, Home and PageUp/PageDown in the CSI and SS3 forms terminals send
+    int decode_key() {
+        if (input.empty()) return ERR;
+        unsigned char c0 = (unsigned char)input[0];
+        size_t used = 1;
+        int ch = c0;
+        if (c0 == 27 && input.size() >= 3 && (input[1] == '[' || input[1] == 'O')) {
+            size_t end = 2;
+            while (end < input.size() && ((unsigned char)input[end] < 0x40 || (unsigned char)input[end] > 0x7e)) ++end;
+            if (end == input.size()) return ERR; // rest of the sequence not read yet
+            string params = input.substr(2, end - 2);
+            char fin = input[end];
+            used = end + 1;
+            ch = ERR;
+            if (fin == 'A') ch = KEY_UP;
+            else if (fin == 'B') ch = KEY_DOWN;
+            else if (fin == 'C') ch = KEY_RIGHT;
+            else if (fin == 'D') ch = KEY_LEFT;
+            else if (fin == 'H') ch = KEY_HOME;
+            else if (fin == '~' && (params == "1" || params == "7")) ch = KEY_HOME;
+            else if (fin == '~' && params == "5") ch = KEY_PPAGE;
+            else if (fin == '~' && params == "6") ch = KEY_NPAGE;
+        }
+        input.erase(0, used);
+        return ch == ERR ? decode_key() : ch;
+    }
+
+    int out_fd, in_fd;
+    bool tty;
+    bool restore = false;
+    struct termios saved;
+    int nrows = 0, ncols = 0;
+    vector<Cell> back, front;
+    bool full = true;
+    uint8_t pen = 0;
+    int cur_y = -1, cur_x = -1;
+    string out, input;
+};
+
+class AnsiCanvas : public Canvas {
+public:
+    AnsiCanvas(AnsiRenderer &r, int h, int w, int y, int x) : r(r) { place(h, w, y, x); }
+    int rows() const override { return h; }
+    int cols() const override { return w; }
+    void place(int nh, int nw, int y, int x) override {
+        h = nh;
+        w = nw;
+        y0 = y;
+        x0 = x;
+    }
+    void blank() override {
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+                if (AnsiRenderer::Cell *c = r.at(y0 + y, x0 + x)) *c = AnsiRenderer::Cell();
+    }
+    void outline() override {
+        for (int x = 1; x < w - 1; ++x) {
+            line(0, x, 'q');
+            line(h - 1, x, 'q');
+        }
+        for (int y = 1; y < h - 1; ++y) {
+            line(y, 0, 'x');
+            line(y, w - 1, 'x');
+        }
+        line(0, 0, 'l');
+        line(0, w - 1, 'k');
+        line(h - 1, 0, 'm');
+        line(h - 1, w - 1, 'j');
+    }
+    void hrule(int y, int x, int n) override {
+        for (int i = 0; i < n && x + i < w; ++i) line(y, x + i, 'q');
+    }
+    void cursor(int y, int x) override {
+        cy = y;
+        cx = x;
+    }
+    void vprint(const char *fmt, va_list ap) override {
+        char buf[512];
+        va_list copy;
+        va_copy(copy, ap);
+        int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+        if (n < 0) {
+            va_end(copy);
+            return;
+        }
+        if ((size_t)n < sizeof(buf)) put(buf, (size_t)n);
+        else {
+            string big((size_t)n + 1, '\0');
+            vsnprintf(&big[0], big.size(), fmt, copy);
+            put(big.data(), (size_t)n);
+        }
+        va_end(copy);
+    }
+    void attr(int a, bool on) override {
+        uint8_t bit = (a == A_BOLD) ? AnsiRenderer::CELL_BOLD : (a == A_REVERSE) ? AnsiRenderer::CELL_REVERSE : 0;
+        pen = on ? (pen | bit) : (pen & ~bit);
+    }
+    void finish() override {}
+
+private:
+    // clipped at the right edge instead of wrapping
+    void put(const char *s, size_t n) {
+        if (cy < 0 || cy >= h) return;
+        for (size_t i = 0; i < n && cx < w; ++i, ++cx) {
+            unsigned char c = (unsigned char)s[i];
+            AnsiRenderer::Cell *cell = r.at(y0 + cy, x0 + cx);
+            if (cell) *cell = AnsiRenderer::Cell{(c >= 0x20 && c < 0x7f) ? (char)c : '?', pen};
+        }
+    }
+    void line(int y, int x, char glyph) {
+        if (y < 0 || y >= h || x < 0 || x >= w) return;
+        if (AnsiRenderer::Cell *c = r.at(y0 + y, x0 + x)) *c = AnsiRenderer::Cell{glyph, AnsiRenderer::CELL_LINE};
+    }
+
+    AnsiRenderer &r;
+    int h = 0, w = 0, y0 = 0, x0 = 0;
+    int cy = 0, cx = 0;
+    uint8_t pen = 0;
+};
+
+unique_ptr<Canvas> AnsiRenderer::canvas(int h, int w, int y, int x) { return unique_ptr<Canvas>(new AnsiCanvas(*this, h, w, y, x)); }
+
+void draw_header(Canvas &win, unsigned long long mem_total_kb, unsigned long long mem_available_kb, double total_cpu_percent, int refresh_sec, SortMode sort_mode, const char *backend, const string &notice) {
+    win.blank();
+    win.outline();
+    int w = win.cols();
+    win.print(0, 2, " SysMon ");
+    win.cursor(1, 2);
+    if (total_cpu_percent < 0) win.append("CPU: %7s", "--");
+    else win.append("CPU: %6.2f%%", total_cpu_percent);
+    if (mem_total_kb) {
+        unsigned long long used = mem_total_kb - mem_available_kb;
+        double mempct = 100.0 * (double)used / (double)mem_total_kb;
+        win.append(" | Mem: %lluMB (%.2f%%)", mem_total_kb/1024, mempct);
+    }
+    win.append(" | Refresh: %ds | Sort: %s", refresh_sec,
+               (sort_mode==SORT_CPU?"CPU":(sort_mode==SORT_MEM?"MEM":"PID")));
+    win.append(" | Backend: %s", backend);
+    if (!notice.empty()) {
+        win.attr(A_BOLD, true);
+        win.append(" | %s", notice.c_str());
+        win.attr(A_BOLD, false);
+    }
+    string keys = " q quit | s sort | k kill | r refresh | v kernel | f filesystems | n sockets | h cores | c socket column | a CPU columns | z freeze | b baseline | d diff | / filter ";
+    win.print(2, max(1, w - (int)keys.size() - 2), "%.*s", max(0, w - 2), keys.c_str());
+    win.finish();
+}
+
+// on the bottom border of the process list
+void draw_scale_summary(Canvas &win, const ScaleStats &s) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), " %zu tasks, top %zu listed | all: CPU %.1f%%, RSS %s | %zu sampled: CPU p50/p99 %.2f/%.2f%%, RSS p50/p99 %s/%s | scan %.0f ms, %s held ",
+             s.tasks, s.listed, s.cpu_total_percent, human_kb(s.rss_total_kb).c_str(), s.sampled, s.cpu_p50, s.cpu_p99,
+             human_kb(s.rss_p50_kb).c_str(), human_kb(s.rss_p99_kb).c_str(), s.scan_ms, human_kb(s.bytes / 1024).c_str());
+    int room = win.cols() - 4;
+    if (room > 0) win.print(win.rows() - 1, 2, "%.*s", room, buf);
+    win.finish();
+}
+
+string per_cpu_rates(const char *label, const vector<double> &rates, int width) {
+    string out = label;
+    char buf[48];
+    for (size_t c = 0; c < rates.size(); ++c) {
+        snprintf(buf, sizeof(buf), " cpu%zu %.0f", c, rates[c]);
+        if ((int)(out.size() + strlen(buf)) > width) { out += " ..."; break; }
+        out += buf;
+    }
+    return out;
+}
+
+void draw_kernel_panel(Canvas &win, const KernelStats &ks, const string &age) {
+    win.blank();
+    win.outline();
+    int w = win.cols() - 2;
+    win.print(1, 1, "Load: %.2f %.2f %.2f | Tasks: %llu running, %llu blocked, %llu total",
+              ks.load[0], ks.load[1], ks.load[2], ks.procs_running, ks.procs_blocked, ks.tasks_total);
+    if (ks.vm_rate.size() == 4) {
+        win.print(2, 1, "Paging/s: pgfault %.0f | pgmajfault %.0f | pswpin %.0f | pswpout %.0f",
+                  ks.vm_rate[0], ks.vm_rate[1], ks.vm_rate[2], ks.vm_rate[3]);
+    } else {
+        win.print(2, 1, "Paging/s: sampling...");
+    }
+    win.print(3, 1, "%.*s", w, per_cpu_rates("IRQ/s:", ks.irq_rate, w).c_str());
+    win.print(4, 1, "%.*s", w, per_cpu_rates("SoftIRQ/s:", ks.softirq_cpu_rate, w).c_str());
+    string types = "SoftIRQ/s by type:";
+    char buf[48];
+    for (size_t i = 0; i < ks.softirq_type_rate.size() && i < ks.softirqs.keys.size(); ++i) {
+        string key = ks.softirqs.keys[i];
+        key.pop_back();
+        snprintf(buf, sizeof(buf), " %s %.0f", key.c_str(), ks.softirq_type_rate[i]);
+        types += buf;
+    }
+    win.print(5, 1, "%.*s", w, types.c_str());
+    win.print(0, 2, " Kernel (updated %s) ", age.c_str());
+    win.finish();
+}
+
+void draw_fs_panel(Canvas &win, const vector<MountEntry> &mounts, FsProber &prober, const string &age) {
+    win.blank();
+    win.outline();
+    int rows = win.rows();
+    set<string> stalled;
+    map<string, FsUsage> usage = prober.snapshot(stalled);
+    struct Row { const MountEntry *m; const FsUsage *u; double pct; };
+    vector<Row> list;
+    for (auto &m : mounts) {
+        auto it = usage.find(m.mountpoint);
+        const FsUsage *u = (it != usage.end()) ? &it->second : nullptr;
+        double pct = -1.0;
+        if (u && u->ok && u->used_kb + u->avail_kb > 0) pct = 100.0 * (double)u->used_kb / (double)(u->used_kb + u->avail_kb);
+        list.push_back({&m, u, pct});
+    }
+    // fullest first, since that is what needs attention
+    stable_sort(list.begin(), list.end(), [](const Row &a, const Row &b) { return a.pct > b.pct; });
+    win.print(1, 1, "%-24s %-8s %9s %9s %9s %6s %10s %6s", "MOUNT", "TYPE", "SIZE", "USED", "AVAIL", "USE%", "INODES", "IUSE%");
+    for (int i = 0; i < (int)list.size() && i + 2 < rows - 1; ++i) {
+        const Row &r = list[i];
+        string mp = r.m->mountpoint;
+        if (mp.size() > 24) mp = "..." + mp.substr(mp.size() - 21);
+        if (!r.u || !r.u->ok) {
+            const char *state = stalled.count(r.m->mountpoint) ? "(not responding)" : (r.u ? "(statvfs failed)" : "(pending)");
+            win.print(i + 2, 1, "%-24s %-8.8s %s", mp.c_str(), r.m->fstype.c_str(), state);
+            continue;
+        }
+        double ipct = r.u->inodes ? 100.0 * (double)r.u->inodes_used / (double)r.u->inodes : 0.0;
+        win.print(i + 2, 1, "%-24s %-8.8s %9s %9s %9s %5.1f%% %10llu %5.1f%%%s", mp.c_str(), r.m->fstype.c_str(),
+                  human_kb(r.u->total_kb).c_str(), human_kb(r.u->used_kb).c_str(), human_kb(r.u->avail_kb).c_str(),
+                  r.pct, r.u->inodes, ipct, stalled.count(r.m->mountpoint) ? " (stalled)" : "");
+    }
+    win.print(0, 2, " Filesystems (%zu, updated %s) ", mounts.size(), age.c_str());
+    win.finish();
+}
+
+string tcp_state_summary(const SockCounts &c) {
+    string out;
+    char buf[48];
+    for (int st = 1; st < TCP_STATE_COUNT; ++st) {
+        if (!c.tcp_by_state[st]) continue;
+        snprintf(buf, sizeof(buf), " %s %d", tcp_state_name(st), c.tcp_by_state[st]);
+        out += buf;
+    }
+    return out.empty() ? string(" none") : out;
+}
+
+void draw_net_panel(Canvas &win, const SocketTable &st, SockCountCache &cache, const ProcInfo *sel, const string &age) {
+    win.blank();
+    win.outline();
+    int w = win.cols() - 2;
+    win.print(0, 2, " Sockets (updated %s) ", age.c_str());
+    win.print(1, 1, "Host: %d TCP, %d UDP, %d UNIX", st.host.tcp, st.host.udp, st.host.unix_socks);
+    win.print(2, 1, "%.*s", w, ("TCP:" + tcp_state_summary(st.host)).c_str());
+    if (sel) {
+        const SockCounts &c = cache.get(st, *sel);
+        win.print(3, 1, "PID %d (%s): %d TCP, %d UDP, %d UNIX", sel->pid, sel->name, c.tcp, c.udp, c.unix_socks);
+        win.print(4, 1, "%.*s", w, ("TCP:" + tcp_state_summary(c)).c_str());
+    }
+    win.finish();
+}
+
+// Which processes sit on which core, from the last CPU each one ran on as of
+// the process sample. Busy is the CPU% of the processes last seen on a core in
+// percent of that core; pinned ones may run on that core only. With more cores
+// than lines each core is one cell, shaded by how busy it is.
+void draw_cores_panel(Canvas &win, const vector<ProcInfo> &procs, bool cpu_valid, int ncpus, const string &age) {
+    struct Core {
+        double busy = 0;
+        int active = 0, pinned = 0;
+        int top[2] = {-1, -1}; // the two busiest processes
+    };
+    int n = ncpus;
+    for (auto &p : procs) n = max(n, p.last_cpu + 1);
+    vector<Core> cores(n);
+    for (size_t i = 0; i < procs.size(); ++i) {
+        const ProcInfo &p = procs[i];
+        if (p.last_cpu < 0) continue;
+        Core &c = cores[p.last_cpu];
+        if (p.ncpus_allowed == 1 && ncpus > 1) c.pinned++;
+        if (!cpu_valid || p.cpu_percent <= 0) continue;
+        // process CPU% is a share of all CPUs
+        c.busy += p.cpu_percent * ncpus;
+        c.active++;
+        if (c.top[0] < 0 || p.cpu_percent > procs[c.top[0]].cpu_percent) {
+            c.top[1] = c.top[0];
+            c.top[0] = (int)i;
+        } else if (c.top[1] < 0 || p.cpu_percent > procs[c.top[1]].cpu_percent) {
+            c.top[1] = (int)i;
+        }
+    }
+    win.blank();
+    win.outline();
+    win.print(0, 2, " Cores (updated %s) ", age.c_str());
+    int w = win.cols() - 2, lines = win.rows() - 2;
+    char buf[256];
+    if (n <= lines) {
+        for (int c = 0; c < n; ++c) {
+            const Core &k = cores[c];
+            int fill = (int)min(10.0, k.busy / 10.0 + 0.5);
+            int len = snprintf(buf, sizeof(buf), "cpu%-3d [%-10s] ", c, string((size_t)fill, '#').c_str());
+            if (cpu_valid) len += snprintf(buf + len, sizeof(buf) - len, "%5.1f%%", min(k.busy, 999.9));
+            else len += snprintf(buf + len, sizeof(buf) - len, "%6s", "--");
+            len += snprintf(buf + len, sizeof(buf) - len, " %4d active %3d pinned ", k.active, k.pinned);
+            for (int t : k.top) {
+                if (t < 0) continue;
+                len += snprintf(buf + len, sizeof(buf) - len, " %s %.1f%%", procs[t].name, procs[t].cpu_percent * ncpus);
+            }
+            if (k.pinned) win.attr(A_BOLD, true);
+            win.print(1 + c, 1, "%.*s", w, buf);
+            if (k.pinned) win.attr(A_BOLD, false);
+        }
+        win.finish();
+        return;
+    }
+    // idle, then tens of percent, then full
+    static const char shades[] = ".123456789#";
+    int per_line = max(8, (w - 6) / 9 * 8);
+    int grid = min(lines - 1, (n + per_line - 1) / per_line);
+    for (int row = 0; row < grid; ++row) {
+        win.print(1 + row, 1, "%4d ", row * per_line);
+        for (int c = row * per_line; c < min(n, (row + 1) * per_line); ++c) {
+            if (c > row * per_line && c % 8 == 0) win.append(" ");
+            int shade = cpu_valid ? (int)min(10.0, cores[c].busy / 10.0 + 0.5) : 0;
+            if (cores[c].pinned) win.attr(A_BOLD, true);
+            win.append("%c", shades[shade]);
+            if (cores[c].pinned) win.attr(A_BOLD, false);
+        }
+    }
+    // the busiest cores with who is on them
+    vector<int> busiest(n);
+    for (int c = 0; c < n; ++c) busiest[c] = c;
+    partial_sort(busiest.begin(), busiest.begin() + min(n, 4), busiest.end(), [&](int a, int b) { return cores[a].busy > cores[b].busy; });
+    int len = snprintf(buf, sizeof(buf), ". idle, 1-9 tens of %%, # full, bold: has pinned tasks | busiest:");
+    for (int i = 0; i < min(n, 4) && cores[busiest[i]].busy > 0; ++i) {
+        const Core &k = cores[busiest[i]];
+        len += snprintf(buf + len, sizeof(buf) - len, " cpu%d %.0f%% %s", busiest[i], k.busy, k.top[0] >= 0 ? procs[k.top[0]].name : "");
+        if (len >= (int)sizeof(buf)) break;
+    }
+    win.print(1 + grid, 1, "%.*s", w, buf);
+    win.finish();
+}
+
+// Scrolling the command column stops once the longest command line on
+// screen ends at its right edge.
+int clamp_hscroll(int hscroll, size_t longest, int cmd_w) {
+    return max(0, min(hscroll, (int)longest - max(cmd_w, 0)));
+}
+
+void draw_processes(Canvas &win, const vector<ProcInfo>& procs, const vector<CpuHistory> *history, const UserNames &users, unsigned long long mem_total_kb, const vector<uint32_t>& order, bool cpu_valid, int selected, int page_offset, long long boot_time, CmdlineCache &cmdlines, int &hscroll, bool cpu_cols, int ncpus, const SocketTable *sockets, SockCountCache &sock_cache) {
+    win.blank();
+    win.outline();
+    int rows = win.rows(), cols = win.cols();
+    time_t now = time(nullptr);
+    int cmd_x = 62 + (cpu_cols ? 14 : 0) + (sockets ? 12 : 0);
+    int cmd_w = cols - 1 - cmd_x;
+    int maxlines = rows - 3;
+    size_t longest = 0;
+    for (int i = 0; i < maxlines && page_offset + i < (int)order.size(); ++i)
+        longest = max(longest, cmdlines.get(procs[order[page_offset + i]]).size());
+    hscroll = clamp_hscroll(hscroll, longest, cmd_w);
+    win.print(0, 1, "%7s %-10s %6s %8s %8s %7s %-8s ", "PID", "USER", "%CPU", "MEM(%)", "RSS", "AGE", "CPU HIST");
+    if (cpu_cols) win.append("%3s %-9s ", "CPU", "AFFINITY");
+    if (sockets) win.append("%11s ", "EST/LSN/ALL");
+    win.append("COMMAND");
+    if (hscroll > 0) win.append(" [+%d]", hscroll);
+    if (history && history->size() != procs.size()) history = nullptr;
+    win.hrule(1, 1, cols - 2);
+    for (int i = 0; i < maxlines; ++i) {
+        int idx = page_offset + i;
+        if (idx >= (int)order.size()) break;
+        const ProcInfo &p = procs[order[idx]];
+        int y = i + 2;
+        if (idx == selected) {
+            win.attr(A_REVERSE, true);
+        }
+        win.print(y, 1, "%7d %-10.10s ", p.pid, user_name(users, p.uid));
+        if (cpu_valid) win.append("%6.2f ", p.cpu_percent);
+        else win.append("%6s ", "--");
+        double mem_percent = mem_total_kb > 0 ? 100.0 * p.mem_kb / (double)mem_total_kb : 0.0;
+        win.append("%8.2f %8s %7s ", mem_percent, human_kb(p.mem_kb).c_str(), format_age(process_age(p, boot_time, now)).c_str());
+        win.append("%-8s ", history ? sparkline((*history)[order[idx]], 8).c_str() : "");
+        if (cpu_cols) {
+            if (p.last_cpu >= 0) win.append("%3d ", p.last_cpu);
+            else win.append("%3s ", "-");
+            win.append("%-9.9s ", format_affinity(p, ncpus).c_str());
+        }
+        if (sockets) {
+            const SockCounts &sc = sock_cache.get(*sockets, p);
+            win.append("%3d/%3d/%3d ", sc.tcp_by_state[TCP_ESTABLISHED_ST], sc.tcp_by_state[TCP_LISTEN_ST], sc.total());
+        }
+        if (cmd_w > 0) {
+            const string &cmd = cmdlines.get(p);
+            string shown = (hscroll < (int)cmd.size()) ? cmd.substr(hscroll, cmd_w) : string();
+            win.print(y, cmd_x, "%-*s", cmd_w, shown.c_str());
+        }
+        if (idx == selected) {
+            win.attr(A_REVERSE, false);
+        }
+    }
+    win.finish();
+}
+
+// The process list as changes since a baseline; the totals go on the bottom
+// border.
+void draw_compare(Canvas &win, const Comparison &c, const UserNames &users, const vector<uint32_t> &order, int selected, int page_offset, CmdlineCache &cmdlines, int &hscroll) {
+    win.blank();
+    win.outline();
+    int rows = win.rows(), cols = win.cols();
+    int cmd_x = 65;
+    int cmd_w = cols - 1 - cmd_x;
+    size_t longest = 0;
+    for (int i = 0; i < rows - 3 && page_offset + i < (int)order.size(); ++i)
+        longest = max(longest, cmdlines.get(c.proc(c.rows[order[page_offset + i]])).size());
+    hscroll = clamp_hscroll(hscroll, longest, cmd_w);
+    win.print(0, 1, "%7s %-10s %-4s %9s %9s %9s %9s ", "PID", "USER", "", "RSS THEN", "RSS NOW", "RSS +/-", "CPU SEC");
+    win.append("COMMAND");
+    if (hscroll > 0) win.append(" [+%d]", hscroll);
+    win.hrule(1, 1, cols - 2);
+    for (int i = 0; i < rows - 3; ++i) {
+        int idx = page_offset + i;
+        if (idx >= (int)order.size()) break;
+        const ProcDelta &d = c.rows[order[idx]];
+        const ProcInfo &p = c.proc(d);
+        int y = i + 2;
+        if (idx == selected) win.attr(A_REVERSE, true);
+        win.print(y, 1, "%7d %-10.10s %-4s ", p.pid, user_name(users, p.uid), d.before < 0 ? "new" : (d.after < 0 ? "gone" : ""));
+        win.append("%9s ", d.before >= 0 ? human_kb((*c.before)[d.before].mem_kb).c_str() : "-");
+        win.append("%9s ", d.after >= 0 ? human_kb((*c.after)[d.after].mem_kb).c_str() : "-");
+        win.append("%9s %9.2f ", signed_kb(d.rss_delta_kb).c_str(), d.cpu_sec);
+        if (cmd_w > 0) {
+            const string &cmd = cmdlines.get(p);
+            string shown = (hscroll < (int)cmd.size()) ? cmd.substr(hscroll, cmd_w) : string();
+            win.print(y, cmd_x, "%-*s", cmd_w, shown.c_str());
+        }
+        if (idx == selected) win.attr(A_REVERSE, false);
+    }
+    char buf[160];
+    snprintf(buf, sizeof(buf), " since baseline (%s): %zu new, %zu gone, RSS %s, CPU %.1f s ",
+             format_age((long long)(c.after_time - c.before_time)).c_str(), c.added, c.gone, signed_kb(c.rss_delta_kb).c_str(), c.cpu_sec);
+    if (cols > 6) win.print(rows - 1, 2, "%.*s", cols - 4, buf);
+    win.finish();
+}
+
+// orders indices into procs, which is shared and stays sorted by ProcKey;
+// with a mask (one bit per process) only the selected ones are listed
+void sort_order(const vector<ProcInfo>& procs, vector<uint32_t>& order, SortMode mode, const vector<uint64_t> *mask = nullptr) {
+    order.clear();
+    if (mask) {
+        for (size_t w = 0; w < mask->size(); ++w) {
+            for (uint64_t bits = (*mask)[w]; bits; bits &= bits - 1) order.push_back((uint32_t)(w * 64 + __builtin_ctzll(bits)));
+        }
+    } else {
+        order.resize(procs.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = (uint32_t)i;
+    }
+    if (mode == SORT_CPU) {
+        sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+            const ProcInfo &a = procs[x], &b = procs[y];
+            if (a.cpu_percent == b.cpu_percent) return a.pid < b.pid;
+            return a.cpu_percent > b.cpu_percent;
+        });
+    } else if (mode == SORT_MEM) {
+        sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+            const ProcInfo &a = procs[x], &b = procs[y];
+            if (a.mem_kb == b.mem_kb) return a.pid < b.pid;
+            return a.mem_kb > b.mem_kb;
+        });
+    } else {
+        sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+            return procs[x].pid < procs[y].pid;
+        });
+    }
+}
+
+// Signals the process a listed row stands for. The list may be old (frozen,
+// or just a period behind), so the pid is pinned with a pidfd and its start
+// time checked before signalling; a reused pid fails with ESRCH.
+int signal_process(const ProcKey &key, int sig) {
+    int pidfd = (int)syscall(SYS_pidfd_open, key.pid, 0);
+    if (pidfd < 0 && errno != ENOSYS) return -1;
+    string content, comm;
+    ProcTimes pt;
+    unsigned long long rss_kb = 0, starttime = 0;
+    bool same = read_file("/proc/" + to_string(key.pid) + "/stat", content) &&
+                parse_proc_stat(content, pt, rss_kb, comm, starttime) &&
+                (key.starttime == 0 || starttime == key.starttime);
+    int r = -1;
+    if (!same) errno = ESRCH;
+    else if (pidfd >= 0) r = (int)syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0);
+    else r = kill(key.pid, sig);
+    if (pidfd >= 0) {
+        int e = errno;
+        close(pidfd);
+        errno = e;
+    }
+    return r;
+}
+
+bool confirm_kill(Renderer &term, const ProcKey &key) {
+    int pid = key.pid;
+    int rows = term.rows(), cols = term.cols();
+    string msg = "Send SIGTERM or SIGKILL to PID " + to_string(pid) + "? (t=TERM / k=KILL / c=cancel)";
+    unique_ptr<Canvas> dlg = term.canvas(5, min((int)msg.size()+4, cols-4), (rows-5)/2, (cols - (int)msg.size()-4)/2);
+    dlg->blank();
+    dlg->outline();
+    dlg->print(2, 2, "%s", msg.c_str());
+    dlg->finish();
+    term.present();
+    int ch = term.wait_key();
+    bool do_kill = false;
+    int sig = 0;
+    if (ch == 't' || ch == 'T') { do_kill = true; sig = SIGTERM; }
+    else if (ch == 'k' || ch == 'K') { do_kill = true; sig = SIGKILL; }
+    if (do_kill) {
+        if (signal_process(key, sig) == 0) {
+            
+            unique_ptr<Canvas> ok = term.canvas(3, 40, (rows-3)/2, (cols-40)/2);
+            ok->blank();
+            ok->outline();
+            ok->print(1, 2, "Signal %d sent to PID %d", sig, pid);
+            ok->finish();
+            term.present();
+            std::this_thread::sleep_for(std::chrono::milliseconds(700));
+            return true;
+        } else {
+            unique_ptr<Canvas> err = term.canvas(5, 60, (rows-5)/2, max(1,(cols-60)/2));
+            err->blank();
+            err->outline();
+            err->print(1, 2, "Failed to send signal %d to PID %d: %s", sig, pid, strerror(errno));
+            err->print(3, 2, "Press any key...");
+            err->finish();
+            term.present();
+            term.wait_key();
+            return false;
+        }
+    }
+    return false;
+}
+
+// A one-line text field in a dialog. Returns false on Esc; error is shown
+// under the field.
+bool prompt_line(Renderer &term, const string &title, const string &help, string &text, const string &error) {
+    int rows = term.rows(), cols = term.cols();
+    int w = max(20, cols - 8);
+    unique_ptr<Canvas> dlg = term.canvas(6, w, (rows - 6) / 2, (cols - w) / 2);
+    for (;;) {
+        dlg->blank();
+        dlg->outline();
+        dlg->print(0, 2, " %s ", title.c_str());
+        int field = w - 4;
+        // the end of a long line stays in view
+        size_t from = text.size() + 1 > (size_t)field ? text.size() + 1 - field : 0;
+        dlg->print(2, 2, "%s_", text.c_str() + from);
+        if (!error.empty()) {
+            dlg->attr(A_BOLD, true);
+            dlg->print(3, 2, "%.*s", field, error.c_str());
+            dlg->attr(A_BOLD, false);
+        }
+        dlg->print(4, 2, "%.*s", field, help.c_str());
+        dlg->finish();
+        term.present();
+        int ch = term.wait_key();
+        if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) return true;
+        if (ch == 27 || ch == ERR) return false;
+        if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+            if (!text.empty()) text.pop_back();
+        } else if (ch == 21) { // ^U
+            text.clear();
+        } else if (ch >= 32 && ch < 127) {
+            text += (char)ch;
+        }
+    }
+}
+
+// Hashed timer wheel: slots of tick_ms each; a timer further out than one turn
+// of the wheel carries the number of extra turns it still has to wait.
+class TimerWheel {
+public:
+    TimerWheel(int tick_ms, size_t nslots) : tick(tick_ms), slots(nslots) {}
+
+    void start(steady_clock::time_point now) { next_tick = now + milliseconds(tick); }
+
+    // id is opaque to the wheel and handed back by advance()
+    void schedule(uint64_t id, int delay_ms) {
+        long ticks = max(1, (delay_ms + tick - 1) / tick);
+        size_t slot = (cur + (size_t)ticks) % slots.size();
+        long rounds = (ticks - 1) / (long)slots.size();
+        slots[slot].push_back({id, rounds});
+    }
+
+    // moves the wheel up to now and returns the timers that expired
+    void advance(steady_clock::time_point now, vector<uint64_t> &due) {
+        while (now >= next_tick) {
+            cur = (cur + 1) % slots.size();
+            vector<Entry> &bucket = slots[cur];
+            for (size_t i = 0; i < bucket.size(); ) {
+                if (bucket[i].rounds > 0) { bucket[i].rounds--; ++i; continue; }
+                due.push_back(bucket[i].id);
+                bucket[i] = bucket.back();
+                bucket.pop_back();
+            }
+            next_tick += milliseconds(tick);
+        }
+    }
+
+    int tick_ms() const { return tick; }
+    steady_clock::time_point next() const { return next_tick; }
+
+private:
+    struct Entry { uint64_t id; long rounds; };
+    int tick;
+    size_t cur = 0;
+    vector<vector<Entry>> slots;
+    steady_clock::time_point next_tick;
+};
+
+// What the UI needs to know about a collector to judge how fresh its data is.
+struct CollectorStatus {
+    string name;
+    int period_ms = 1000;
+    bool enabled = true;
+    bool ever_run = false;
+    steady_clock::time_point updated;
+
+    double age_sec(steady_clock::time_point now) const {
+        if (!ever_run) return -1.0;
+        return duration<double>(now - updated).count();
+    }
+    // a datum is stale once it missed two of its periods
+    bool stale(steady_clock::time_point now) const {
+        double age = age_sec(now);
+        return age < 0 || age * 1000.0 > 2.0 * period_ms;
+    }
+};
+
+// Runs each collector at its own period. When several fall due in the same
+// tick they run in priority order (lower first), and each records when it
+// last updated its part of the shared state so the UI can show staleness.
+class CollectorScheduler {
+public:
+    struct Task {
+        CollectorStatus status;
+        int priority = 0;
+        function<void()> run;
+        uint32_t gen = 0; // timers armed under an older generation are ignored
+    };
+
+    CollectorScheduler() : wheel(50, 128) { wheel.start(steady_clock::now()); }
+
+    int add(const string &name, int period_ms, int priority, function<void()> run, bool enabled = true) {
+        Task t;
+        t.status.name = name;
+        t.status.period_ms = max(wheel.tick_ms(), period_ms);
+        t.status.enabled = enabled;
+        t.priority = priority;
+        t.run = std::move(run);
+        tasks.push_back(std::move(t));
+        int id = (int)tasks.size() - 1;
+        arm(id, 0);
+        return id;
+    }
+
+    void run_due(steady_clock::time_point now) {
+        fired.clear();
+        wheel.advance(now, fired);
+        due.clear();
+        for (uint64_t key : fired) {
+            int id = (int)(key & 0xffffffffu);
+            if ((uint32_t)(key >> 32) == tasks[id].gen) due.push_back(id);
+        }
+        sort(due.begin(), due.end(), [&](int a, int b) { return tasks[a].priority < tasks[b].priority; });
+        for (int id : due) {
+            if (tasks[id].status.enabled) run_task(id);
+            arm(id, tasks[id].status.period_ms);
+        }
+    }
+
+    // next run of a collector in delay_ms instead of its period; later runs
+    // follow the period again
+    void reschedule(int id, int delay_ms) {
+        tasks[id].gen++;
+        arm(id, delay_ms);
+    }
+
+    // runs a collector now, e.g. when its panel is opened or on 'r'
+    void trigger(int id) { if (tasks[id].status.enabled) run_task(id); }
+    void trigger_all() {
+        vector<int> order;
+        for (size_t i = 0; i < tasks.size(); ++i) order.push_back((int)i);
+        sort(order.begin(), order.end(), [&](int a, int b) { return tasks[a].priority < tasks[b].priority; });
+        for (int id : order) trigger(id);
+    }
+
+    void set_enabled(int id, bool on) { tasks[id].status.enabled = on; }
+    bool set_period(const string &name, int ms) {
+        for (auto &t : tasks) if (t.status.name == name) { t.status.period_ms = max(wheel.tick_ms(), ms); return true; }
+        return false;
+    }
+    const Task& task(int id) const { return tasks[id]; }
+    size_t size() const { return tasks.size(); }
+    // bumped by every collector run
+    uint64_t runs() const { return run_count; }
+
+    steady_clock::time_point next_tick() const { return wheel.next(); }
+
+private:
+    void arm(int id, int delay_ms) {
+        wheel.schedule(((uint64_t)tasks[id].gen << 32) | (uint32_t)id, delay_ms);
+    }
+
+    void run_task(int id) {
+        tasks[id].run();
+        tasks[id].status.updated = steady_clock::now();
+        tasks[id].status.ever_run = true;
+        run_count++;
+    }
+
+    vector<Task> tasks;
+    TimerWheel wheel;
+    vector<uint64_t> fired;
+    vector<int> due;
+    uint64_t run_count = 0;
+};
+
+string format_staleness(double age) {
+    if (age < 0) return "never";
+    char buf[32];
+    if (age < 10) snprintf(buf, sizeof(buf), "%.1fs ago", age);
+    else snprintf(buf, sizeof(buf), "%.0fs ago", age);
+    return string(buf);
+}
+
+// Epoch-based publication of immutable versions. The single writer swaps in a
+// new version and retires the old one, tagged with the epoch it was retired
+// in. A reader pins the current epoch in its slot before loading the pointer
+// and clears it when done. A retired version is freed once every pinned epoch
+// is newer than its tag. Neither side waits for the other: a slow reader only
+// delays reclamation.
+template <typename T>
+class EpochPublisher {
+public:
+    static const int MAX_READERS = 16;
+
+    EpochPublisher() {
+        for (int i = 0; i < MAX_READERS; ++i) { pins[i].store(IDLE); used[i].store(false); }
+    }
+    ~EpochPublisher() {
+        delete current.load();
+        for (auto &r : retired) delete r.obj;
+    }
+
+    // -1 when all slots are taken
+    int register_reader() {
+        for (int i = 0; i < MAX_READERS; ++i) {
+            bool expected = false;
+            if (used[i].compare_exchange_strong(expected, true)) return i;
+        }
+        return -1;
+    }
+    void unregister_reader(int slot) {
+        pins[slot].store(IDLE);
+        used[slot].store(false);
+    }
+
+    class ReadGuard {
+    public:
+        ReadGuard(EpochPublisher &pub, int slot) : pub(pub), slot(slot) {
+            pub.pins[slot].store(pub.epoch.load());
+            obj = pub.current.load();
+        }
+        ~ReadGuard() { pub.pins[slot].store(IDLE); }
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        const T* get() const { return obj; }
+        const T* operator->() const { return obj; }
+    private:
+        EpochPublisher &pub;
+        int slot;
+        const T *obj;
+    };
+
+    // the returned guard keeps the version alive; do not nest guards on one slot
+    ReadGuard read(int slot) { return ReadGuard(*this, slot); }
+
+    // writer thread only
+    void publish(const T *next) {
+        const T *old = current.exchange(next);
+        uint64_t e = epoch.fetch_add(1);
+        if (old) retired.push_back({old, e});
+        reclaim();
+    }
+
+    size_t retired_count() const { return retired.size(); }
+
+private:
+    static const uint64_t IDLE = ~0ull;
+    struct Retired { const T *obj; uint64_t epoch; };
+
+    void reclaim() {
+        uint64_t oldest = IDLE;
+        for (int i = 0; i < MAX_READERS; ++i) oldest = min(oldest, pins[i].load());
+        size_t keep = 0;
+        for (auto &r : retired) {
+            if (r.epoch < oldest) delete r.obj;
+            else retired[keep++] = r;
+        }
+        retired.resize(keep);
+    }
+
+    atomic<const T*> current{nullptr};
+    atomic<uint64_t> epoch{1};
+    atomic<uint64_t> pins[MAX_READERS];
+    atomic<bool> used[MAX_READERS];
+    vector<Retired> retired; // writer only
+};
+
+// How the sampler thread yields to the rest of the host. Threads it starts
+// later (fs prober, procfs-parallel pool, io_uring workers) inherit all of it.
+struct Isolation {
+    bool sched_idle = false;
+    int nice = 0;           // applied when non-zero
+    string cpus;            // e.g. "0,2-3"
+    int ioprio_class = IOPRIO_CLASS_NONE;
+    int ioprio_level = 0;
+    string cgroup;          // created under the cpu controller's hierarchy
+    int cpu_quota_pct = 0;  // percent of one CPU, 0 = no quota
+};
+
+bool parse_cpu_list(const string &list, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    stringstream ss(list);
+    string item;
+    bool any = false;
+    while (getline(ss, item, ',')) {
+        if (item.empty()) return false;
+        size_t dash = item.find('-');
+        char *end;
+        unsigned long lo = strtoul(item.c_str(), &end, 10), hi = lo;
+        if (end == item.c_str()) return false;
+        if (dash != string::npos) {
+            hi = strtoul(item.c_str() + dash + 1, &end, 10);
+            if (*end || hi < lo) return false;
+        } else if (*end) return false;
+        if (hi >= CPU_SETSIZE) return false;
+        for (unsigned long c = lo; c <= hi; ++c) CPU_SET(c, &set);
+        any = true;
+    }
+    return any;
+}
+
+// "idle", or "be:N" with N from 0 (highest) to 7
+bool parse_ioprio(const string &spec, Isolation &iso) {
+    if (spec == "idle") { iso.ioprio_class = IOPRIO_CLASS_IDLE; iso.ioprio_level = 0; return true; }
+    if (spec.rfind("be:", 0) == 0 && spec.size() == 4 && spec[3] >= '0' && spec[3] <= '7') {
+        iso.ioprio_class = IOPRIO_CLASS_BE;
+        iso.ioprio_level = spec[3] - '0';
+        return true;
+    }
+    return false;
+}
+
+// Where the sampler goes when --cgroup is given. On a v1 cpu hierarchy only
+// the sampler thread joins it. cgroup v2 keeps the threads of a process in
+// one domain, so there the process moves into the cgroup and the quota goes
+// on a threaded child that only the sampler thread joins. Either way the UI
+// thread stays outside the quota.
+struct CgroupPlacement {
+    string dir;
+    string thread_dir;    // v2: threaded child holding the sampler thread
+    string home;          // v2: cgroup the process left, to go back to on exit
+    bool v2 = false;
+    bool created = false; // removed again on exit if sysmon made it
+    bool thread_created = false;
+};
+
+// mount point of the v1 hierarchy carrying the cpu controller, else of cgroup2
+bool find_cgroup_root(string &root, bool &v2) {
+    ifstream f("/proc/self/mountinfo");
+    string line, v2_root;
+    while (getline(f, line)) {
+        istringstream ls(line);
+        string id, parent, devno, mroot, mountpoint, tok, fstype, source, opts;
+        ls >> id >> parent >> devno >> mroot >> mountpoint;
+        while (ls >> tok && tok != "-") {}
+        ls >> fstype >> source >> opts;
+        if (fstype == "cgroup2" && v2_root.empty()) v2_root = unescape_mount_field(mountpoint);
+        if (fstype != "cgroup") continue;
+        stringstream os(opts);
+        while (getline(os, tok, ',')) {
+            if (tok == "cpu") { root = unescape_mount_field(mountpoint); v2 = false; return true; }
+        }
+    }
+    if (v2_root.empty()) return false;
+    root = v2_root;
+    v2 = true;
+    return true;
+}
+
+// this process's cgroup v2 path, "/" for the root
+string current_cgroup_v2() {
+    ifstream f("/proc/self/cgroup");
+    string line;
+    while (getline(f, line)) {
+        if (line.rfind("0::", 0) == 0) return line.substr(3);
+    }
+    return string();
+}
+
+// On failure cg still names whatever was created, for release_cgroup().
+bool prepare_cgroup(const Isolation &iso, CgroupPlacement &cg, string &why) {
+    string root;
+    if (!find_cgroup_root(root, cg.v2)) { why = "no cgroup hierarchy with the cpu controller is mounted"; return false; }
+    cg.dir = root + "/" + iso.cgroup;
+    if (mkdir(cg.dir.c_str(), 0755) == 0) cg.created = true;
+    else if (errno != EEXIST) { why = "mkdir " + cg.dir + ": " + strerror(errno); return false; }
+    if (cg.v2) {
+        // this turns cg.dir into a threaded domain: the process can live in it
+        // while its threads are spread over the threaded children
+        cg.thread_dir = cg.dir + "/sampler";
+        if (mkdir(cg.thread_dir.c_str(), 0755) == 0) cg.thread_created = true;
+        else if (errno != EEXIST) { why = "mkdir " + cg.thread_dir + ": " + strerror(errno); return false; }
+        if (!write_file(cg.thread_dir + "/cgroup.type", "threaded")) {
+            why = "making " + cg.thread_dir + " threaded: " + strerror(errno);
+            return false;
+        }
+    }
+    if (iso.cpu_quota_pct > 0) {
+        const long period_us = 100000;
+        string quota = to_string(period_us * iso.cpu_quota_pct / 100);
+        bool ok;
+        if (cg.v2) {
+            // the controller has to be enabled for children of each level first
+            write_file(root + "/cgroup.subtree_control", "+cpu");
+            write_file(cg.dir + "/cgroup.subtree_control", "+cpu");
+            ok = write_file(cg.thread_dir + "/cpu.max", quota + " " + to_string(period_us));
+        } else {
+            ok = write_file(cg.dir + "/cpu.cfs_period_us", to_string(period_us)) &&
+                 write_file(cg.dir + "/cpu.cfs_quota_us", quota);
+        }
+        if (!ok) { why = "setting the cpu quota in " + (cg.v2 ? cg.thread_dir : cg.dir) + ": " + strerror(errno); return false; }
+    }
+    if (cg.v2) {
+        string home = current_cgroup_v2();
+        if (!write_file(cg.dir + "/cgroup.procs", to_string(getpid()))) {
+            why = "joining " + cg.dir + ": " + strerror(errno);
+            return false;
+        }
+        if (!home.empty()) cg.home = root + home;
+    }
+    return true;
+}
+
+// Undoes prepare_cgroup once the sampler has stopped: the process goes back
+// where it came from and the cgroups sysmon made are removed.
+void release_cgroup(const CgroupPlacement &cg) {
+    if (!cg.home.empty()) write_file(cg.home + "/cgroup.procs", to_string(getpid()));
+    if (cg.thread_created) rmdir(cg.thread_dir.c_str());
+    if (cg.created) rmdir(cg.dir.c_str());
+}
+
+// runs on the sampler thread; returns what could not be applied
+vector<string> apply_isolation(const Isolation &iso, const CgroupPlacement &cg) {
+    vector<string> failed;
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    if (!cg.dir.empty() && !cg.v2 && !write_file(cg.dir + "/tasks", to_string(tid)))
+        failed.push_back("joining " + cg.dir + ": " + strerror(errno));
+    if (!cg.thread_dir.empty() && !write_file(cg.thread_dir + "/cgroup.threads", to_string(tid)))
+        failed.push_back("joining " + cg.thread_dir + ": " + strerror(errno));
+    if (!iso.cpus.empty()) {
+        cpu_set_t set;
+        parse_cpu_list(iso.cpus, set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) failed.push_back("CPU affinity " + iso.cpus + ": " + strerror(errno));
+    }
+    if (iso.sched_idle) {
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        if (sched_setscheduler(0, SCHED_IDLE, &sp) != 0) failed.push_back(string("SCHED_IDLE: ") + strerror(errno));
+    }
+    if (iso.nice && setpriority(PRIO_PROCESS, (id_t)tid, iso.nice) != 0)
+        failed.push_back("nice " + to_string(iso.nice) + ": " + strerror(errno));
+    if (iso.ioprio_class != IOPRIO_CLASS_NONE &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(iso.ioprio_class, iso.ioprio_level)) != 0)
+        failed.push_back(string("ioprio_set: ") + strerror(errno));
+    return failed;
+}
+
+// What survives a restart: the last process list with its CPU history, the
+// uid -> name map and the command lines seen so far. Only valid for the boot
+// it was written in.
+struct SavedState {
+    uint64_t saved_at = 0;     // wall clock seconds
+    uint64_t total_cpu = 0;    // /proc/stat total when the process list was taken
+    vector<ProcInfo> procs;    // sorted by ProcKey
+    vector<CpuHistory> history; // parallel to procs
+    map<uid_t, string> users;
+    vector<pair<ProcKey, string>> cmdlines;
+};
+
+// On-disk layout, native endian: header, then the record arrays, then one
+// string table that every name points into. Equal strings are stored once.
+struct StateHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    char boot_id[40];
+    uint64_t saved_at;
+    uint64_t total_cpu;
+    uint32_t nprocs, nusers, ncmdlines, strings_len;
+};
+struct StateProc {
+    int32_t pid;
+    uint32_t uid;
+    uint64_t starttime, total_time;
+    uint32_t rss_kb;
+    char name[16];
+    CpuHistory history;
+    uint8_t pad[2];
+};
+struct StateUser { uint32_t uid, off, len; };
+struct StateCmdline { int32_t pid; uint32_t off, len; uint32_t pad; uint64_t starttime; };
+
+static const char STATE_MAGIC[8] = {'S', 'Y', 'S', 'M', 'O', 'N', 'S', 'T'};
+static const uint32_t STATE_VERSION = 2;
+
+string read_boot_id() {
+    string id;
+    if (!read_file("/proc/sys/kernel/random/boot_id", id)) return string();
+    while (!id.empty() && (id.back() == '\n' || id.back() == ' ')) id.pop_back();
+    return id;
+}
+
+string default_state_path() {
+    const char *xdg = getenv("XDG_STATE_HOME");
+    if (xdg && *xdg) return string(xdg) + "/sysmon/state";
+    const char *home = getenv("HOME");
+    if (home && *home) return string(home) + "/.local/state/sysmon/state";
+    return string();
+}
+
+// Written to a temporary file and renamed, so a crash mid-write leaves the
+// previous state in place.
+bool save_state(const string &path, const SavedState &st, string &why) {
+    string strings;
+    unordered_map<string, uint32_t> interned;
+    auto intern = [&](const string &v, uint32_t &off, uint32_t &len) {
+        auto it = interned.find(v);
+        if (it == interned.end()) {
+            it = interned.emplace(v, (uint32_t)strings.size()).first;
+            strings += v;
+        }
+        off = it->second;
+        len = (uint32_t)v.size();
+    };
+    vector<StateProc> procs(st.procs.size());
+    for (size_t i = 0; i < st.procs.size(); ++i) {
+        const ProcInfo &p = st.procs[i];
+        StateProc &r = procs[i]; // value-initialized, so pad bytes are zero
+        r.pid = p.pid;
+        r.uid = p.uid;
+        r.starttime = p.starttime;
+        r.total_time = p.total_time;
+        r.rss_kb = p.mem_kb;
+        memcpy(r.name, p.name, sizeof(r.name));
+        if (i < st.history.size()) r.history = st.history[i];
+    }
+    vector<StateUser> users;
+    for (auto &u : st.users) {
+        StateUser r = {(uint32_t)u.first, 0, 0};
+        intern(u.second, r.off, r.len);
+        users.push_back(r);
+    }
+    vector<StateCmdline> cmds;
+    for (auto &c : st.cmdlines) {
+        StateCmdline r;
+        memset(&r, 0, sizeof(r));
+        r.pid = c.first.pid;
+        r.starttime = c.first.starttime;
+        intern(c.second, r.off, r.len);
+        cmds.push_back(r);
+    }
+
+    StateHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+    h.version = STATE_VERSION;
+    h.header_size = sizeof(h);
+    string boot = read_boot_id();
+    strncpy(h.boot_id, boot.c_str(), sizeof(h.boot_id) - 1);
+    h.saved_at = st.saved_at;
+    h.total_cpu = st.total_cpu;
+    h.nprocs = (uint32_t)procs.size();
+    h.nusers = (uint32_t)users.size();
+    h.ncmdlines = (uint32_t)cmds.size();
+    h.strings_len = (uint32_t)strings.size();
+
+    size_t slash = path.rfind('/');
+    if (slash != string::npos && slash > 0) {
+        // mkdir -p of the parent
+        for (size_t at = path.find('/', 1); at != string::npos && at <= slash; at = path.find('/', at + 1))
+            mkdir(path.substr(0, at).c_str(), 0700);
+    }
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) { why = "open " + tmp + ": " + strerror(errno); return false; }
+    bool ok = true;
+    auto put = [&](const void *data, size_t len) {
+        const char *p = (const char*)data;
+        while (ok && len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { ok = false; break; }
+            p += n;
+            len -= (size_t)n;
+        }
+    };
+    put(&h, sizeof(h));
+    put(procs.data(), procs.size() * sizeof(StateProc));
+    put(users.data(), users.size() * sizeof(StateUser));
+    put(cmds.data(), cmds.size() * sizeof(StateCmdline));
+    put(strings.data(), strings.size());
+    if (!ok) why = "write " + tmp + ": " + strerror(errno);
+    if (close(fd) != 0 && ok) { ok = false; why = "close " + tmp + ": " + strerror(errno); }
+    if (ok && rename(tmp.c_str(), path.c_str()) != 0) { ok = false; why = "rename " + tmp + ": " + strerror(errno); }
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
+
+// Maps the file and copies out what is needed; every offset is bounds checked
+// against the mapping before use.
+bool load_state(const string &path, SavedState &st, string &why) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { why = (errno == ENOENT) ? string() : "open " + path + ": " + strerror(errno); return false; }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(StateHeader)) { close(fd); why = "truncated state file"; return false; }
+    size_t size = (size_t)sb.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { why = string("mmap: ") + strerror(errno); return false; }
+    const char *base = (const char*)map;
+    StateHeader h;
+    memcpy(&h, base, sizeof(h));
+    bool ok = false;
+    string boot = read_boot_id();
+    size_t need = sizeof(StateHeader) + (size_t)h.nprocs * sizeof(StateProc) + (size_t)h.nusers * sizeof(StateUser)
+                + (size_t)h.ncmdlines * sizeof(StateCmdline) + h.strings_len;
+    if (memcmp(h.magic, STATE_MAGIC, sizeof(h.magic)) != 0 || h.version != STATE_VERSION || h.header_size != sizeof(h)) why = "not a sysmon state file of this version";
+    else if (boot.empty() || strncmp(h.boot_id, boot.c_str(), sizeof(h.boot_id)) != 0) why = "state is from a previous boot";
+    else if (size < need) why = "truncated state file";
+    else ok = true;
+    if (ok) {
+        const char *p = base + sizeof(StateHeader);
+        const char *strings = base + need - h.strings_len;
+        auto str = [&](uint32_t off, uint32_t len) {
+            if ((uint64_t)off + len > h.strings_len) return string();
+            return string(strings + off, len);
+        };
+        st.saved_at = h.saved_at;
+        st.total_cpu = h.total_cpu;
+        st.procs.resize(h.nprocs);
+        st.history.resize(h.nprocs);
+        for (uint32_t i = 0; i < h.nprocs; ++i, p += sizeof(StateProc)) {
+            StateProc r;
+            memcpy(&r, p, sizeof(r));
+            ProcInfo &pi = st.procs[i];
+            pi.pid = r.pid;
+            pi.uid = r.uid;
+            pi.starttime = r.starttime;
+            pi.total_time = r.total_time;
+            pi.mem_kb = r.rss_kb;
+            set_comm(pi, r.name, strnlen(r.name, sizeof(r.name)));
+            st.history[i] = r.history;
+            if (st.history[i].len > CpuHistory::LEN || st.history[i].head >= CpuHistory::LEN) st.history[i] = CpuHistory();
+        }
+        for (uint32_t i = 0; i < h.nusers; ++i, p += sizeof(StateUser)) {
+            StateUser r;
+            memcpy(&r, p, sizeof(r));
+            st.users[(uid_t)r.uid] = str(r.off, r.len);
+        }
+        for (uint32_t i = 0; i < h.ncmdlines; ++i, p += sizeof(StateCmdline)) {
+            StateCmdline r;
+            memcpy(&r, p, sizeof(r));
+            st.cmdlines.push_back({ProcKey{r.pid, r.starttime}, str(r.off, r.len)});
+        }
+        // the list has to be ProcKey-sorted for the merge passes
+        for (size_t i = 1; i < st.procs.size(); ++i) {
+            if (!(proc_key(st.procs[i-1]) < proc_key(st.procs[i]))) { why = "state process list is not sorted"; ok = false; break; }
+        }
+    }
+    munmap(map, size);
+    return ok;
+}
+
+// CRC32C (Castagnoli, as in iSCSI and ext4). On x86-64 CPUs with SSE4.2 the
+// crc32 instruction takes 8 bytes at a time; elsewhere slicing-by-8 tables
+// take 8 bytes per step.
+uint32_t crc32c_soft(uint32_t crc, const char *p, size_t n) {
+    static const auto table = [] {
+        array<array<uint32_t, 256>, 8> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82f63b78u & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        return t;
+    }();
+    crc = ~crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+              table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+    }
+    while (n--) crc = (crc >> 8) ^ table[0][(crc ^ (uint8_t)*p++) & 0xff];
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const char *p, size_t n) {
+    uint64_t c = ~crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (n--) c32 = _mm_crc32_u8(c32, (uint8_t)*p++);
+    return ~c32;
+}
+bool crc32c_hardware() { return __builtin_cpu_supports("sse4.2"); }
+#else
+uint32_t crc32c_sse42(uint32_t crc, const char *p, size_t n) { return crc32c_soft(crc, p, n); }
+bool crc32c_hardware() { return false; }
+#endif
+
+// crc continues an earlier call over the bytes before p
+uint32_t crc32c(const char *p, size_t n, uint32_t crc = 0) {
+    static const bool hw = crc32c_hardware();
+    return hw ? crc32c_sse42(crc, p, n) : crc32c_soft(crc, p, n);
+}
+
+// A recording is a header and then one frame after another: a RecordFrame,
+// then a RecordSample and its RecordProc array, appended as the sampler takes
+// them. The frame's length and CRC32C let a reader tell where the last
+// complete sample ends after a crash. Next to it, PATH.10s, PATH.1m and so on hold rollup tiers: per period,
+// one RecordSample followed by a RollupProc per process seen in it. Samples
+// older than a tier keeps are dropped from the front of its file: first_sample
+// moves past them and their blocks are punched out. Every file is fdatasync'd
+// on a timer, not after every frame (see Recorder). Native endian, like the
+// state file.
+struct RecordHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    char boot_id[40];
+    uint64_t clk_tck;
+    uint32_t tier_ms;       // 0 for raw samples, else the rollup period
+    uint32_t pad;
+    uint64_t first_sample;  // file offset of the oldest sample kept
+};
+struct RecordFrame {
+    uint32_t length; // of the RecordSample and rows that follow
+    uint32_t crc;    // CRC32C of those
+};
+struct RecordSample {
+    uint64_t time_ms;       // wall clock; the start of the period for rollups
+    uint64_t total_cpu;     // /proc/stat total when the processes were read
+    uint64_t mem_total_kb;
+    uint32_t nprocs;
+    uint32_t proc_size;     // sizeof(RecordProc) or sizeof(RollupProc)
+};
+struct RecordProc {
+    int32_t pid;
+    uint32_t uid;
+    uint64_t starttime, total_time;
+    uint32_t rss_kb;
+    float cpu_percent;
+    char name[16];
+    int16_t last_cpu;
+    uint16_t pad[3];
+};
+static_assert(sizeof(RecordProc) == 56, "RecordProc layout");
+// one process over one rollup period, from the samples it was in
+struct RollupProc {
+    int32_t pid;
+    uint32_t uid;
+    uint64_t starttime, total_time; // total_time as of the last sample
+    float cpu_min, cpu_avg, cpu_max;
+    uint32_t rss_min_kb, rss_avg_kb, rss_max_kb;
+    uint32_t samples;
+    char name[16];
+    int16_t last_cpu;
+    uint16_t pad;
+};
+static_assert(sizeof(RollupProc) == 72, "RollupProc layout");
+
+static const char RECORD_MAGIC[8] = {'S', 'Y', 'S', 'M', 'O', 'N', 'R', 'C'};
+static const uint32_t RECORD_VERSION = 3;
+
+// One file of a recording and how long its samples are kept (0: for good).
+// The first tier holds the raw samples; each later one rolls up the one
+// before it over a period that is a multiple of that one's.
+struct RecordTier {
+    uint32_t period_ms;
+    uint64_t keep_ms;
+};
+
+// 1500 -> "1500ms", 10000 -> "10s", 60000 -> "1m"
+string period_label(uint64_t ms) {
+    static const pair<uint64_t, const char*> units[] = {{86400000, "d"}, {3600000, "h"}, {60000, "m"}, {1000, "s"}};
+    for (auto &u : units) if (ms >= u.first && ms % u.first == 0) return to_string(ms / u.first) + u.second;
+    return to_string(ms) + "ms";
+}
+
+string tier_path(const string &path, uint32_t period_ms) { return period_ms ? path + "." + period_label(period_ms) : path; }
+
+// a number of seconds, or with ms/s/m/h/d
+bool parse_period(const string &s, uint64_t &ms) {
+    char *end = nullptr;
+    double v = strtod(s.c_str(), &end);
+    if (end == s.c_str() || v < 0) return false;
+    string unit = end;
+    double scale = unit.empty() || unit == "s" ? 1000 : unit == "ms" ? 1 : unit == "m" ? 60000 : unit == "h" ? 3600000 : unit == "d" ? 86400000 : -1;
+    if (scale < 0) return false;
+    ms = (uint64_t)llround(v * scale);
+    return true;
+}
+
+// raw:KEEP,PERIOD:KEEP,... e.g. the default raw:1h,10s:1d,1m:30d
+bool parse_record_tiers(const string &spec, vector<RecordTier> &tiers, string &why) {
+    tiers.clear();
+    size_t at = 0;
+    while (at <= spec.size()) {
+        size_t comma = spec.find(',', at);
+        if (comma == string::npos) comma = spec.size();
+        string item = spec.substr(at, comma - at);
+        at = comma + 1;
+        size_t colon = item.find(':');
+        uint64_t period = 0, keep = 0;
+        if (colon == string::npos) { why = "'" + item + "' is not PERIOD:KEEP"; return false; }
+        string p = item.substr(0, colon);
+        if (tiers.empty() != (p == "raw")) { why = "the first tier and only that one is raw"; return false; }
+        if (p != "raw" && (!parse_period(p, period) || period == 0 || period > UINT32_MAX)) { why = "bad period '" + p + "'"; return false; }
+        if (!parse_period(item.substr(colon + 1), keep)) { why = "bad retention '" + item.substr(colon + 1) + "'"; return false; }
+        if (tiers.size() > 1 && period <= tiers.back().period_ms) {
+            why = period_label(period) + " is not longer than " + period_label(tiers.back().period_ms);
+            return false;
+        }
+        if (tiers.size() > 1 && period % tiers.back().period_ms != 0) {
+            why = period_label(period) + " is not a multiple of " + period_label(tiers.back().period_ms);
+            return false;
+        }
+        tiers.push_back({(uint32_t)period, keep});
+    }
+    return true;
+}
+
+// Maps a recording file and indexes its samples from first_sample on. The
+// scan stops at the first frame that is cut short or fails its CRC. If no
+// complete frame follows anywhere after it, that is the torn tail of a crash;
+// otherwise the file is damaged. Frames start on 8-byte boundaries, so the
+// search for one only looks there.
+class RecordingReader {
+public:
+    ~RecordingReader() { if (base) munmap((void*)base, len); }
+
+    bool open(const string &path, string &why) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { why = "open " + path + ": " + strerror(errno); return false; }
+        struct stat sb;
+        if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(RecordHeader)) { close(fd); why = "not a sysmon recording"; return false; }
+        len = (size_t)sb.st_size;
+        void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) { base = nullptr; why = string("mmap: ") + strerror(errno); return false; }
+        base = (const char*)map;
+        memcpy(&hdr, base, sizeof(hdr));
+        if (memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != RECORD_VERSION || hdr.header_size != sizeof(hdr)) {
+            why = "not a sysmon recording of this version";
+            return false;
+        }
+        size_t at = max<size_t>(sizeof(RecordHeader), min<size_t>(hdr.first_sample, len)), end;
+        while ((end = frame_end(at)) != 0) {
+            index.push_back(at + sizeof(RecordFrame));
+            at = end;
+        }
+        valid_bytes = at;
+        for (size_t k = at + 8; k < len && !damaged; k += 8) damaged = frame_end(k) != 0;
+        return true;
+    }
+
+    const RecordHeader &header() const { return hdr; }
+    size_t size() const { return index.size(); }
+    // the end of a complete frame at offset at, or 0
+    size_t frame_end(size_t at) const {
+        RecordFrame fr;
+        RecordSample rs;
+        if (at + sizeof(fr) + sizeof(rs) > len) return 0;
+        memcpy(&fr, base + at, sizeof(fr));
+        memcpy(&rs, base + at + sizeof(fr), sizeof(rs));
+        uint32_t proc_size = hdr.tier_ms ? sizeof(RollupProc) : sizeof(RecordProc);
+        if (rs.proc_size != proc_size || fr.length != sizeof(rs) + (uint64_t)rs.nprocs * proc_size) return 0;
+        if (at + sizeof(fr) + fr.length > len || crc32c(base + at + sizeof(fr), fr.length) != fr.crc) return 0;
+        return at + sizeof(fr) + fr.length;
+    }
+    // where the frame of sample i starts
+    size_t offset(size_t i) const { return index[i] - sizeof(RecordFrame); }
+    RecordSample sample(size_t i) const {
+        RecordSample rs;
+        memcpy(&rs, base + index[i], sizeof(rs));
+        return rs;
+    }
+    // the processes of sample i, sorted by ProcKey as they were recorded; a
+    // rollup gives each process's average CPU% and RSS
+    shared_ptr<const vector<ProcInfo>> procs(size_t i) const {
+        RecordSample rs = sample(i);
+        auto out = make_shared<vector<ProcInfo>>(rs.nprocs);
+        const char *p = base + index[i] + sizeof(RecordSample);
+        for (uint32_t k = 0; k < rs.nprocs; ++k, p += rs.proc_size) {
+            ProcInfo &pi = (*out)[k];
+            if (hdr.tier_ms) {
+                RollupProc r;
+                memcpy(&r, p, sizeof(r));
+                pi.pid = r.pid;
+                pi.uid = r.uid;
+                pi.starttime = r.starttime;
+                pi.total_time = r.total_time;
+                pi.mem_kb = r.rss_avg_kb;
+                pi.cpu_percent = r.cpu_avg;
+                pi.last_cpu = r.last_cpu;
+                set_comm(pi, r.name, strnlen(r.name, sizeof(r.name)));
+                continue;
+            }
+            RecordProc r;
+            memcpy(&r, p, sizeof(r));
+            pi.pid = r.pid;
+            pi.uid = r.uid;
+            pi.starttime = r.starttime;
+            pi.total_time = r.total_time;
+            pi.mem_kb = r.rss_kb;
+            pi.cpu_percent = r.cpu_percent;
+            pi.last_cpu = r.last_cpu;
+            set_comm(pi, r.name, strnlen(r.name, sizeof(r.name)));
+        }
+        return out;
+    }
+    // the rows of rollup sample i, in the same order as procs(i)
+    const RollupProc *rollups(size_t i) const { return (const RollupProc*)(base + index[i] + sizeof(RecordSample)); }
+
+    size_t valid_bytes = 0; // up to the end of the last complete sample
+    bool damaged = false;   // more than a torn tail follows valid_bytes
+    size_t file_size() const { return len; }
+
+private:
+    const char *base = nullptr;
+    size_t len = 0;
+    RecordHeader hdr;
+    vector<size_t> index; // file offset of each sample, past its frame
+};
+
+// One file of a recording, open for appending. Keeps the time and offset of
+// every sample it holds so that retention can find where to cut.
+class RecordFile {
+public:
+    ~RecordFile() { if (fd >= 0) close(fd); }
+
+    // Continues an existing file of this boot, after cutting off a torn tail,
+    // or starts a new one. A file damaged before its tail is left alone.
+    bool open(const string &path, const string &boot, const RecordTier &t, string &why) {
+        name = path;
+        tier = t;
+        struct stat sb;
+        if (stat(path.c_str(), &sb) == 0 && sb.st_size > 0) {
+            RecordingReader r;
+            if (!r.open(path, why)) { why = path + ": " + why; return false; }
+            if (strncmp(r.header().boot_id, boot.c_str(), sizeof(r.header().boot_id)) != 0) {
+                why = path + " was recorded during an earlier boot";
+                return false;
+            }
+            if (r.header().tier_ms != t.period_ms) { why = path + " holds a different tier"; return false; }
+            if (r.damaged) { why = path + " is damaged at offset " + to_string(r.valid_bytes) + ", after " + to_string(r.size()) + " samples"; return false; }
+            fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd < 0 || ftruncate(fd, (off_t)r.valid_bytes) != 0) { why = "open " + path + ": " + strerror(errno); return false; }
+            torn_bytes = r.file_size() - r.valid_bytes;
+            for (size_t i = 0; i < r.size(); ++i) kept.push_back({r.sample(i).time_ms, r.offset(i)});
+            end = r.valid_bytes;
+            first = kept.empty() ? end : kept.front().second;
+            punched = sizeof(RecordHeader);
+            return true;
+        }
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) { why = "open " + path + ": " + strerror(errno); return false; }
+        RecordHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+        h.version = RECORD_VERSION;
+        h.header_size = sizeof(h);
+        strncpy(h.boot_id, boot.c_str(), sizeof(h.boot_id) - 1);
+        h.clk_tck = (uint64_t)sysconf(_SC_CLK_TCK);
+        h.tier_ms = t.period_ms;
+        h.first_sample = sizeof(h);
+        end = first = punched = sizeof(h);
+        return write_at(0, (const char*)&h, sizeof(h), why);
+    }
+
+    // frame: a RecordFrame, filled in here, then the sample. One write per
+    // sample, so a sample is only ever torn at the very end.
+    bool append(uint64_t time_ms, string &frame, string &why) {
+        RecordFrame fr;
+        fr.length = (uint32_t)(frame.size() - sizeof(fr));
+        fr.crc = crc32c(frame.data() + sizeof(fr), fr.length);
+        memcpy(&frame[0], &fr, sizeof(fr));
+        if (!write_at(end, frame.data(), frame.size(), why)) return false;
+        kept.push_back({time_ms, end});
+        end += frame.size();
+        trim(time_ms);
+        dirty = true;
+        return true;
+    }
+
+    // fdatasync if anything was written since the last one
+    bool sync(string &why) {
+        if (!dirty.exchange(false)) return true;
+        syncs++;
+        if (fdatasync(fd) == 0) return true;
+        why = "sync " + name + ": " + strerror(errno);
+        return false;
+    }
+
+    string name;
+    RecordTier tier;
+    string warning;        // retention could not free space
+    size_t torn_bytes = 0; // cut off the end when the file was opened
+    atomic<size_t> syncs{0};
+
+private:
+    // Drops samples older than the tier keeps, a batch at a time. The new
+    // header is synced before the hole is punched, so neither a reader nor a
+    // reopen after a crash starts at a sample that is already gone.
+    void trim(uint64_t now_ms) {
+        if (!tier.keep_ms || now_ms < last_trim + min<uint64_t>(60000, tier.keep_ms / 16)) return;
+        last_trim = now_ms;
+        size_t drop = 0;
+        while (drop + 1 < kept.size() && kept[drop].first + tier.keep_ms < now_ms) drop++;
+        if (!drop) return;
+        first = kept[drop].second;
+        kept.erase(kept.begin(), kept.begin() + drop);
+        string why;
+        if (!write_at(offsetof(RecordHeader, first_sample), (const char*)&first, sizeof(first), why)) { warning = why; return; }
+        if (fdatasync(fd) != 0) {
+            warning = "sync " + name + ": " + strerror(errno);
+            return;
+        }
+        const uint64_t block = 4096;
+        uint64_t from = (punched + block - 1) / block * block, to = first / block * block;
+        if (to <= from || !warning.empty()) return;
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)from, (off_t)(to - from)) != 0) {
+            warning = string("cannot free old samples of ") + name + ": " + strerror(errno);
+            return;
+        }
+        punched = to;
+    }
+
+    bool write_at(uint64_t off, const char *p, size_t left, string &why) {
+        while (left > 0) {
+            ssize_t n = pwrite(fd, p, left, (off_t)off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { why = string("write ") + name + ": " + strerror(errno); return false; }
+            p += n;
+            off += (uint64_t)n;
+            left -= (size_t)n;
+        }
+        return true;
+    }
+
+    int fd = -1;
+    atomic<bool> dirty{false};
+    uint64_t end = 0, first = 0, punched = 0, last_trim = 0;
+    deque<pair<uint64_t, uint64_t>> kept; // (time, offset) of every sample in the file
+};
+
+// The rollup of one tier being built: every process seen in the current
+// period, sorted by ProcKey like the samples it is merged with.
+struct RollupAccumulator {
+    struct Row {
+        RollupProc r;
+        double cpu_sum, rss_sum; // weighted by samples
+    };
+    uint64_t period = UINT64_MAX; // time_ms / period_ms of the rows
+    uint64_t total_cpu = 0, mem_total_kb = 0;
+    vector<Row> rows, merged;
+
+    // merges in one sample of the tier below, already as rollup rows
+    void add(const RollupProc *in, size_t n) {
+        merged.clear();
+        merged.reserve(rows.size() + n);
+        size_t i = 0, j = 0;
+        auto key = [](const RollupProc &r) { return ProcKey{r.pid, r.starttime}; };
+        while (i < rows.size() || j < n) {
+            if (j >= n || (i < rows.size() && key(rows[i].r) < key(in[j]))) { merged.push_back(rows[i++]); continue; }
+            const RollupProc &x = in[j++];
+            if (i >= rows.size() || key(x) < key(rows[i].r)) {
+                merged.push_back({x, (double)x.cpu_avg * x.samples, (double)x.rss_avg_kb * x.samples});
+                continue;
+            }
+            Row row = rows[i++];
+            RollupProc &r = row.r;
+            r.uid = x.uid;
+            r.total_time = x.total_time;
+            r.cpu_min = min(r.cpu_min, x.cpu_min);
+            r.cpu_max = max(r.cpu_max, x.cpu_max);
+            r.rss_min_kb = min(r.rss_min_kb, x.rss_min_kb);
+            r.rss_max_kb = max(r.rss_max_kb, x.rss_max_kb);
+            r.samples += x.samples;
+            memcpy(r.name, x.name, sizeof(r.name));
+            r.last_cpu = x.last_cpu;
+            row.cpu_sum += (double)x.cpu_avg * x.samples;
+            row.rss_sum += (double)x.rss_avg_kb * x.samples;
+            merged.push_back(row);
+        }
+        rows.swap(merged);
+    }
+
+    // the finished period as a frame for RecordFile::append()
+    void encode(uint32_t period_ms, string &buf) {
+        RecordSample rs;
+        memset(&rs, 0, sizeof(rs));
+        rs.time_ms = period * period_ms;
+        rs.total_cpu = total_cpu;
+        rs.mem_total_kb = mem_total_kb;
+        rs.nprocs = (uint32_t)rows.size();
+        rs.proc_size = sizeof(RollupProc);
+        buf.resize(sizeof(RecordFrame) + sizeof(rs) + rows.size() * sizeof(RollupProc));
+        memcpy(&buf[sizeof(RecordFrame)], &rs, sizeof(rs));
+        char *p = &buf[sizeof(RecordFrame) + sizeof(rs)];
+        for (Row &row : rows) {
+            row.r.cpu_avg = (float)(row.cpu_sum / row.r.samples);
+            row.r.rss_avg_kb = (uint32_t)llround(row.rss_sum / row.r.samples);
+            memcpy(p, &row.r, sizeof(RollupProc));
+            p += sizeof(RollupProc);
+        }
+    }
+};
+
+// Appends every process sample to a recording and keeps its rollup tiers up
+// to date as samples arrive: each finished period of one tier is written and
+// merged into the next. Existing files of the same boot are continued; one
+// from an earlier boot is refused, since (pid, starttime) only identifies a
+// process within a boot. Durability is group committed: a thread of its own
+// fdatasyncs every file written to once per sync period, so the sampler never
+// waits for the disk and a crash loses at most that period. A period of 0
+// syncs after every sample instead.
+class Recorder {
+public:
+    ~Recorder() { close(); }
+
+    bool open(const string &path, const vector<RecordTier> &tiers, uint64_t sync_ms, string &why) {
+        string boot = read_boot_id();
+        files.clear();
+        for (auto &t : tiers) {
+            files.emplace_back(new RecordFile());
+            if (!files.back()->open(tier_path(path, t.period_ms), boot, t, why)) return false;
+        }
+        acc.assign(files.size() - 1, RollupAccumulator());
+        sync_ms_ = sync_ms;
+        if (sync_ms) syncer = thread([this] { sync_loop(); });
+        return true;
+    }
+
+    // sampler thread; after a failed write the recording stops and error says why
+    void append(uint64_t time_ms, uint64_t total_cpu, uint64_t mem_total_kb, const vector<ProcInfo> &procs) {
+        if (files.empty() || !error.empty()) return;
+        RecordSample rs;
+        memset(&rs, 0, sizeof(rs));
+        rs.time_ms = time_ms;
+        rs.total_cpu = total_cpu;
+        rs.mem_total_kb = mem_total_kb;
+        rs.nprocs = (uint32_t)procs.size();
+        rs.proc_size = sizeof(RecordProc);
+        buf.resize(sizeof(RecordFrame) + sizeof(rs) + procs.size() * sizeof(RecordProc));
+        memcpy(&buf[sizeof(RecordFrame)], &rs, sizeof(rs));
+        char *p = &buf[sizeof(RecordFrame) + sizeof(rs)];
+        single.resize(acc.empty() ? 0 : procs.size());
+        for (size_t i = 0; i < procs.size(); ++i) {
+            const ProcInfo &pi = procs[i];
+            RecordProc r;
+            memset(&r, 0, sizeof(r));
+            r.pid = pi.pid;
+            r.uid = pi.uid;
+            r.starttime = pi.starttime;
+            r.total_time = pi.total_time;
+            r.rss_kb = pi.mem_kb;
+            r.cpu_percent = pi.cpu_percent;
+            memcpy(r.name, pi.name, sizeof(r.name));
+            r.last_cpu = pi.last_cpu;
+            memcpy(p, &r, sizeof(r));
+            p += sizeof(r);
+            if (acc.empty()) continue;
+            // the same process as a rollup of one sample
+            RollupProc &u = single[i];
+            memset(&u, 0, sizeof(u));
+            u.pid = r.pid;
+            u.uid = r.uid;
+            u.starttime = r.starttime;
+            u.total_time = r.total_time;
+            u.cpu_min = u.cpu_avg = u.cpu_max = r.cpu_percent;
+            u.rss_min_kb = u.rss_avg_kb = u.rss_max_kb = r.rss_kb;
+            u.samples = 1;
+            memcpy(u.name, r.name, sizeof(u.name));
+            u.last_cpu = r.last_cpu;
+        }
+        if (!files[0]->append(time_ms, buf, error)) return;
+        samples++;
+        roll_up(0, time_ms, total_cpu, mem_total_kb, single.data(), single.size());
+        if (!sync_ms_) sync_all();
+    }
+
+    // writes out the periods in progress, finest first so that each reaches
+    // the next tier, and syncs; the sampler must be stopped
+    void close() {
+        for (size_t k = 0; k < acc.size(); ++k) finish_period(k);
+        if (syncer.joinable()) {
+            {
+                lock_guard<mutex> lk(sync_mu);
+                sync_stop = true;
+            }
+            sync_cv.notify_all();
+            syncer.join();
+        }
+        sync_all();
+    }
+
+    // what retention or syncing could not do, for the exit message
+    string warnings() {
+        string w;
+        for (auto &f : files) if (!f->warning.empty()) w += (w.empty() ? "" : "; ") + f->warning;
+        lock_guard<mutex> lk(sync_mu);
+        if (!sync_error.empty()) w += (w.empty() ? "" : "; ") + sync_error;
+        return w;
+    }
+
+    // torn tails cut off the files when they were opened
+    vector<string> recovered() const {
+        vector<string> r;
+        for (auto &f : files) if (f->torn_bytes) r.push_back(f->name + ": cut off a torn tail of " + to_string(f->torn_bytes) + " bytes");
+        return r;
+    }
+
+    size_t syncs() const { return sync_count; }
+
+    string error;
+    size_t samples = 0;
+
+private:
+    // Merges a sample (or a finished period) of tier k into tier k + 1, first
+    // writing out that tier's period if the sample starts a new one.
+    void roll_up(size_t k, uint64_t time_ms, uint64_t total_cpu, uint64_t mem_total_kb, const RollupProc *rows, size_t n) {
+        if (k >= acc.size() || !error.empty()) return;
+        RollupAccumulator &a = acc[k];
+        uint32_t period_ms = files[k + 1]->tier.period_ms;
+        uint64_t period = time_ms / period_ms;
+        if (period != a.period) {
+            finish_period(k);
+            a.period = period;
+        }
+        a.total_cpu = total_cpu;
+        a.mem_total_kb = mem_total_kb;
+        a.add(rows, n);
+    }
+
+    void finish_period(size_t k) {
+        RollupAccumulator &a = acc[k];
+        if (a.rows.empty() || !error.empty()) return;
+        RecordTier t = files[k + 1]->tier;
+        a.encode(t.period_ms, rollup_buf);
+        a.rows.clear();
+        if (!files[k + 1]->append(a.period * t.period_ms, rollup_buf, error)) return;
+        // the encoded rows (averages filled in) go on to the next tier
+        vector<RollupProc> rows((const RollupProc*)(rollup_buf.data() + sizeof(RecordFrame) + sizeof(RecordSample)),
+                                (const RollupProc*)(rollup_buf.data() + rollup_buf.size()));
+        roll_up(k + 1, a.period * t.period_ms, a.total_cpu, a.mem_total_kb, rows.data(), rows.size());
+    }
+
+    void sync_loop() {
+        unique_lock<mutex> lk(sync_mu);
+        while (!sync_stop) {
+            sync_cv.wait_for(lk, milliseconds(sync_ms_), [&] { return sync_stop; });
+            lk.unlock();
+            sync_all();
+            lk.lock();
+        }
+    }
+
+    void sync_all() {
+        for (auto &f : files) {
+            string why;
+            size_t before = f->syncs;
+            if (!f->sync(why)) {
+                lock_guard<mutex> lk(sync_mu);
+                sync_error = why;
+            }
+            sync_count += f->syncs - before;
+        }
+    }
+
+    vector<unique_ptr<RecordFile>> files; // raw samples, then rollups, finest first
+    vector<RollupAccumulator> acc;        // acc[k] builds files[k + 1]
+    uint64_t sync_ms_ = 0;
+    thread syncer;
+    mutex sync_mu;
+    condition_variable sync_cv;
+    bool sync_stop = false;
+    string sync_error;
+    atomic<size_t> sync_count{0};
+    string buf, rollup_buf;               // reused for every sample
+    vector<RollupProc> single;
+};
+
+// wall clock milliseconds since the epoch
+uint64_t wall_ms() { return (uint64_t)duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count(); }
+
+// Everything the sampler knew at one point in time. A frame never changes
+// once published; parts no collector touched since the previous frame are
+// shared with it rather than copied.
+struct Frame {
+    uint64_t seq = 0;
+    uint64_t procs_seq = 0; // bumped when the process list changed
+    uint64_t procs_time_ms = 0; // wall clock when procs was read
+    shared_ptr<const vector<ProcInfo>> procs; // sorted by ProcKey
+    shared_ptr<const vector<CpuHistory>> history; // parallel to procs when set
+    shared_ptr<const LazyColumns> columns; // procs as columns, unless procs is partial
+    shared_ptr<const UserNames> users; // names for every uid in procs
+    bool procs_cpu_valid = false; // false until two process samples exist
+    size_t scan_done = 0, scan_total = 0; // scan_total > 0 while procs is partial; SIZE_MAX if unknown
+    const char *backend = "";
+    double total_cpu_percent = -1.0; // negative until two /proc/stat samples exist
+    unsigned long long mem_total_kb = 0, mem_available_kb = 0;
+    shared_ptr<const KernelStats> kernel;
+    shared_ptr<const vector<MountEntry>> mounts;
+    shared_ptr<const SocketTable> sockets;
+    shared_ptr<const ScaleStats> scale; // scale mode: procs is only the top K
+    vector<CollectorStatus> collectors; // indexed by CollectorId
+};
+
+enum CollectorId { COLLECT_CPU, COLLECT_MEM, COLLECT_PROCS, COLLECT_KERNEL, COLLECT_FS, COLLECT_SOCKETS };
+
+// Runs the collectors on its own thread and publishes a Frame after every
+// round in which one of them produced data. Requests from the UI are queued
+// with post() and run on the sampler thread between rounds.
+class Sampler {
+public:
+    EpochPublisher<Frame> frames;
+
+    // after the first sample, the CPU collectors come back this soon to have a
+    // baseline for percentages instead of waiting a full period
+    static const int BASELINE_MS = 250;
+
+    Sampler(CollectorBackend *backend, unsigned wanted, int refresh_sec, FsProber &prober)
+        : backend(backend), wanted(wanted), prober(prober) {
+        if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) != 0) wake_pipe[0] = wake_pipe[1] = -1;
+        sched.add("cpu", 500, 0, [this]{ sample_cpu(); });
+        sched.add("mem", 500, 1, [this]{ read_meminfo(mem_total_kb, mem_free_kb, mem_available_kb); });
+        sched.add("procs", refresh_sec * 1000, 2, [this]{ sample_procs(); });
+        sched.add("kernel", 1000, 3, [this]{
+            kstats.sample();
+            kernel = make_shared<const KernelStats>(kstats);
+        }, false);
+        sched.add("fs", 5000, 4, [this]{
+            mount_table.refresh();
+            this->prober.schedule(mount_table.mounts);
+            mounts = make_shared<const vector<MountEntry>>(mount_table.mounts);
+        }, false);
+        sched.add("sockets", 30000, 5, [this]{
+            auto t = make_shared<SocketTable>();
+            t->rebuild();
+            t->generation = ++sockets_gen;
+            sockets = t;
+        }, false);
+    }
+    ~Sampler() {
+        stop();
+        if (wake_pipe[0] >= 0) { close(wake_pipe[0]); close(wake_pipe[1]); }
+        for (auto &p : extra_wake) { close(p.first); close(p.second); }
+    }
+
+    // readable after each published frame; readers poll it and drain it
+    int wake_fd() const { return wake_pipe[0]; }
+    // another such fd, for a second reader such as an exporter (before start())
+    int add_wake_fd() {
+        int p[2];
+        if (pipe2(p, O_NONBLOCK | O_CLOEXEC) != 0) return -1;
+        extra_wake.push_back({p[0], p[1]});
+        return p[0];
+    }
+
+    // before start() only
+    bool set_period(const string &name, int ms) { return sched.set_period(name, ms); }
+    void use_scale(ScaleCollector *s) { scale = s; }
+    void use_recorder(Recorder *r) { recorder = r; }
+    // where to find another backend if the chosen one fails
+    void use_registry(BackendRegistry *r) { registry = r; }
+    // after stop() only; empty unless the backend had to be replaced
+    const string& backend_warning() const { return backend_failed; }
+
+    // Seeds the sampler from a saved state (before start()). The saved list is
+    // the baseline of the first scan, so CPU% and history are there at once;
+    // a list older than WARM_BASELINE_SEC only carries the history over.
+    static const int WARM_BASELINE_SEC = 600;
+    void preload(SavedState &st) {
+        users.preload(st.users);
+        procs = make_shared<const vector<ProcInfo>>(std::move(st.procs));
+        procs_time_ms = st.saved_at * 1000;
+        history = make_shared<const vector<CpuHistory>>(std::move(st.history));
+        procs_prev_total_cpu = st.total_cpu;
+        baseline_usable = (uint64_t)time(nullptr) - st.saved_at <= (uint64_t)WARM_BASELINE_SEC;
+    }
+
+    // after stop() only
+    SavedState export_state() const {
+        SavedState st;
+        st.saved_at = (uint64_t)time(nullptr);
+        st.total_cpu = procs_prev_total_cpu;
+        if (procs) st.procs = *procs;
+        if (history && procs && history->size() == procs->size()) st.history = *history;
+        st.users = users.names;
+        return st;
+    }
+
+    // the isolation settings are applied on the sampler thread before its first
+    // round; returns the ones that failed
+    vector<string> start(const Isolation &iso, const CgroupPlacement &cg) {
+        promise<vector<string>> applied;
+        future<vector<string>> result = applied.get_future();
+        worker = thread([this, &iso, &cg, &applied]{
+            applied.set_value(apply_isolation(iso, cg));
+            loop();
+        });
+        return result.get();
+    }
+    void stop() {
+        {
+            lock_guard<mutex> lk(mtx);
+            quit = true;
+        }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    void post(function<void()> fn) {
+        {
+            lock_guard<mutex> lk(mtx);
+            commands.push_back(std::move(fn));
+        }
+        cv.notify_all();
+    }
+    // turns a collector on or off; switching it on takes a sample right away
+    void set_enabled(int id, bool on) {
+        post([this, id, on]{
+            bool was = sched.task(id).status.enabled;
+            sched.set_enabled(id, on);
+            if (on && !was) sched.trigger(id);
+        });
+    }
+    void trigger(int id) { post([this, id]{ sched.trigger(id); }); }
+    // in scale mode the sampler picks the top K, so it needs the UI's order
+    void set_sort(SortMode mode) {
+        post([this, mode]{
+            scale_sort = mode;
+            if (!scale || !scale->scanned()) return;
+            list_scale_top();
+            publish();
+        });
+    }
+    void trigger_all() { post([this]{ sched.trigger_all(); }); }
+
+private:
+    // Gets a first frame out as fast as possible: host numbers right away,
+    // then the process list as the backend streams it in.
+    void startup() {
+        sched.trigger(COLLECT_CPU);
+        sched.trigger(COLLECT_MEM);
+        publish();
+        if (scale) {
+            scale->progress = [this](size_t done) {
+                if (!partial) partial = make_shared<const vector<ProcInfo>>();
+                scan_done = done;
+                scan_total = SIZE_MAX;
+                publish();
+            };
+            sched.trigger(COLLECT_PROCS);
+            scale->progress = nullptr;
+            partial.reset();
+            scan_done = scan_total = 0;
+            sched.reschedule(COLLECT_CPU, BASELINE_MS);
+            sched.reschedule(COLLECT_PROCS, BASELINE_MS);
+            return;
+        }
+        backend->progress = [this](const vector<ProcInfo> &part, size_t done, size_t total) {
+            users.resolve(part);
+            partial = make_shared<const vector<ProcInfo>>(part);
+            procs_time_ms = wall_ms();
+            scan_done = done;
+            scan_total = total;
+            procs_seq++;
+            publish();
+        };
+        sched.trigger(COLLECT_PROCS);
+        backend->progress = nullptr;
+        partial.reset();
+        scan_done = scan_total = 0;
+        sched.reschedule(COLLECT_CPU, BASELINE_MS);
+        sched.reschedule(COLLECT_PROCS, BASELINE_MS);
+    }
+
+    void loop() {
+        startup();
+        uint64_t published_runs = 0;
+        unique_lock<mutex> lk(mtx);
+        while (!quit) {
+            vector<function<void()>> todo;
+            todo.swap(commands);
+            lk.unlock();
+            for (auto &fn : todo) fn();
+            sched.run_due(steady_clock::now());
+            if (sched.runs() != published_runs) {
+                published_runs = sched.runs();
+                publish();
+            }
+            lk.lock();
+            cv.wait_until(lk, sched.next_tick(), [&]{ return quit || !commands.empty(); });
+        }
+    }
+
+    void publish() {
+        Frame *f = new Frame;
+        f->seq = ++frame_seq;
+        f->procs_seq = procs_seq;
+        f->procs = scan_total ? partial : procs;
+        f->procs_time_ms = procs_time_ms;
+        if (!scan_total) f->history = history;
+        if (!scan_total && columns_of != procs) {
+            columns = procs ? make_shared<const LazyColumns>(procs) : nullptr;
+            columns_of = procs;
+        }
+        if (!scan_total) f->columns = columns;
+        f->users = users.shared;
+        f->procs_cpu_valid = procs_cpu_valid && !scan_total;
+        f->scan_done = scan_done;
+        f->scan_total = scan_total;
+        f->backend = scale ? scale->name() : backend->name();
+        f->total_cpu_percent = total_cpu_percent;
+        f->mem_total_kb = mem_total_kb;
+        f->mem_available_kb = mem_available_kb;
+        f->kernel = kernel;
+        f->mounts = mounts;
+        f->sockets = sockets;
+        f->scale = scale_stats;
+        for (size_t i = 0; i < sched.size(); ++i) f->collectors.push_back(sched.task((int)i).status);
+        frames.publish(f);
+        if (wake_pipe[1] >= 0 && write(wake_pipe[1], "", 1) < 0) {} // full pipe: reader is already due
+        for (auto &p : extra_wake) if (write(p.second, "", 1) < 0) {}
+    }
+
+    void sample_cpu() {
+        if (!read_total_cpu(cur_cpu_fields)) return;
+        if (old_cpu_fields.empty()) {
+            old_cpu_fields = cur_cpu_fields;
+            return;
+        }
+        unsigned long long old_total = total_cpu_time(old_cpu_fields), cur_total = total_cpu_time(cur_cpu_fields);
+        unsigned long long old_idle = 0, cur_idle = 0;
+        if (old_cpu_fields.size() >= 4) old_idle = old_cpu_fields[3] + (old_cpu_fields.size() > 4 ? old_cpu_fields[4] : 0);
+        if (cur_cpu_fields.size() >= 4) cur_idle = cur_cpu_fields[3] + (cur_cpu_fields.size() > 4 ? cur_cpu_fields[4] : 0);
+        unsigned long long idle_delta = (cur_idle - old_idle);
+        unsigned long long total_delta = (cur_total - old_total);
+        if (total_delta == 0) return;
+        total_cpu_percent = 100.0 * (1.0 - ((double)idle_delta / (double)total_delta));
+        old_cpu_fields = cur_cpu_fields;
+    }
+
+    void sample_procs() {
+        vector<unsigned long long> fields;
+        read_total_cpu(fields);
+        unsigned long long total = total_cpu_time(fields);
+        if (scale) {
+            if (!scale->scan(total - procs_prev_total_cpu)) return;
+            procs_cpu_valid = procs_prev_total_cpu != 0;
+            procs_prev_total_cpu = total;
+            history.reset();
+            list_scale_top();
+            return;
+        }
+        ProcSnapshot snap;
+        if (!backend->collect(snap, wanted)) {
+            snap = ProcSnapshot();
+            if (!replace_backend() || !backend->collect(snap, wanted)) return;
+        }
+        uint64_t now_ms = wall_ms();
+        users.resolve(snap.procs);
+        static const vector<ProcInfo> none;
+        // the previous published list doubles as the baseline for CPU deltas
+        update_cpu_percent(procs ? *procs : none, snap.procs, procs_prev_total_cpu, total);
+        procs_cpu_valid = (procs != nullptr) && baseline_usable;
+        baseline_usable = true;
+        static const vector<CpuHistory> no_history;
+        auto h = make_shared<vector<CpuHistory>>();
+        update_history(procs ? *procs : none, history ? *history : no_history, snap.procs, *h, procs_cpu_valid);
+        history = h;
+        // the process collector keeps its own /proc/stat total so process CPU% is
+        // measured over exactly the interval between two process samples
+        procs_prev_total_cpu = total;
+        procs = make_shared<const vector<ProcInfo>>(std::move(snap.procs));
+        procs_time_ms = now_ms;
+        procs_seq++;
+        // like every other consumer, skip scans whose CPU% is not an interval
+        // (the first one, or a warm start from a stale state), so the rollups
+        // never average a since-boot figure in
+        if (recorder && procs_cpu_valid) recorder->append(now_ms, total, mem_total_kb, *procs);
+    }
+
+    // Switches to the cheapest other backend, or procfs-sync, after a failed
+    // collect(). Only the first failure is kept for the exit message.
+    bool replace_backend() {
+        CollectorBackend *next = registry ? registry->choose(wanted, backend) : nullptr;
+        if (!next && registry) next = registry->find("procfs-sync");
+        if (next == backend) next = nullptr;
+        if (backend_failed.empty()) {
+            string why = backend->unavailable_reason();
+            backend_failed = string("backend '") + backend->name() + "' failed" + (why.empty() ? "" : " (" + why + ")");
+            backend_failed += next ? string(", switched to ") + next->name() : string(", no other backend");
+        }
+        if (!next) return false;
+        next->progress = backend->progress;
+        backend->progress = nullptr;
+        backend = next;
+        return true;
+    }
+
+    void list_scale_top() {
+        auto v = make_shared<const vector<ProcInfo>>(scale->top(scale_sort, wanted));
+        users.resolve(*v);
+        procs = v;
+        procs_time_ms = wall_ms();
+        scale_stats = make_shared<const ScaleStats>(scale->stats());
+        procs_seq++;
+    }
+
+    CollectorBackend *backend;
+    BackendRegistry *registry = nullptr;
+    string backend_failed;
+    ScaleCollector *scale = nullptr;
+    Recorder *recorder = nullptr;
+    SortMode scale_sort = SORT_CPU;
+    shared_ptr<const ScaleStats> scale_stats;
+    unsigned wanted;
+    FsProber &prober;
+    CollectorScheduler sched;
+
+    thread worker;
+    mutex mtx;
+    condition_variable cv;
+    vector<function<void()>> commands;
+    bool quit = false;
+    int wake_pipe[2] = {-1, -1};
+    vector<pair<int, int>> extra_wake;
+
+    // collector state, touched only on the sampler thread
+    vector<unsigned long long> old_cpu_fields, cur_cpu_fields;
+    unsigned long long procs_prev_total_cpu = 0;
+    unsigned long long mem_total_kb = 0, mem_free_kb = 0, mem_available_kb = 0;
+    double total_cpu_percent = -1.0;
+    bool procs_cpu_valid = false;
+    bool baseline_usable = true;
+    UserCache users;
+    KernelStats kstats;
+    MountTable mount_table;
+    uint64_t sockets_gen = 0;
+    uint64_t frame_seq = 0, procs_seq = 0;
+
+    shared_ptr<const vector<ProcInfo>> procs;
+    uint64_t procs_time_ms = 0; // when procs, or partial while set, was read
+    shared_ptr<const vector<CpuHistory>> history;
+    shared_ptr<const vector<ProcInfo>> partial; // first scan, while it streams in
+    shared_ptr<const LazyColumns> columns;
+    shared_ptr<const vector<ProcInfo>> columns_of; // the list columns was built from
+    size_t scan_done = 0, scan_total = 0;
+    shared_ptr<const KernelStats> kernel;
+    shared_ptr<const vector<MountEntry>> mounts;
+    shared_ptr<const SocketTable> sockets;
+};
+
+struct Options {
+    int refresh_sec = 2;
+    string backend = "auto";
+    string proc_root;
+    bool list_backends = false;
+    bool check_backends = false;
+    int bench_backends = 0;
+    vector<pair<string, int>> periods;
+    Isolation isolation;
+    string state_path = default_state_path(); // empty: no state file
+    size_t scale_k = 0; // scale mode when > 0: list only the top K tasks
+    bool check_scale = false;
+    string renderer = "ncurses";
+    int bench_render = 0;
+    string record_path;
+    vector<RecordTier> record_tiers = {{0, 3600000}, {10000, 86400000}, {60000, 30ULL * 86400000}};
+    uint64_t record_sync_ms = 5000; // 0: sync the recording after every sample
+    uint64_t resolution_ms = 0; // reading a recording: the coarsest tier wanted
+    string compare_path, compare_from, compare_to;
+    string filter;
+    SortMode sort_mode = SORT_CPU;
+    int batch = 0; // > 0: print this many process tables to stdout, no UI
+    string http; // [ADDR:]PORT: serve the process list over HTTP, no UI
+    string otlp_url;
+    size_t otlp_top = 20;
+    int otlp_interval = 10;
+    bool check_otlp = false;
+    bool check_record = false;
+    int bench_query = 0;
+    bool check_query = false;
+    string arrow_path; // write samples as an Arrow stream here, no UI
+    string recording_path; // with arrow_path: take the samples from this recording
+};
+
+void print_usage(const char *prog) {
+    cerr << "usage: " << prog << " [refresh_sec] [options]\n"
+         << "  --backend=NAME       process collector backend (default: auto)\n"
+         << "  --proc-root=DIR      add a 'fixture' backend reading a /proc-like tree\n"
+         << "  --list-backends      print backends with their fields and cost, then exit\n"
+         << "  --check-backends     run the backend conformance check, then exit\n"
+         << "  --bench-backends[=N] time N samples with every available backend, then exit\n"
+         << "  --period=NAME:MS     refresh period of one collector (cpu, mem, procs, kernel, fs, sockets)\n"
+         << "  --sampler-idle       run the sampler under SCHED_IDLE\n"
+         << "  --sampler-nice=N     nice level of the sampler threads\n"
+         << "  --sampler-cpus=LIST  pin the sampler threads to these CPUs (e.g. 0,2-3)\n"
+         << "  --sampler-ioprio=P   I/O priority of the sampler: idle or be:0..7\n"
+         << "  --cgroup=NAME        move the sampler into this cgroup (created if missing)\n"
+         << "  --cpu-quota=PCT      CPU quota of that cgroup in percent of one CPU\n"
+         << "  --state=PATH         state file kept across runs (default: ~/.local/state/sysmon/state)\n"
+         << "  --no-state           neither read nor write a state file\n"
+         << "  --scale[=K]          stream /proc and list only the top K tasks (default 500)\n"
+         << "  --check-scale        compare scale mode with a full scan of --proc-root, then exit\n"
+         << "  --renderer=NAME      ncurses (default) or ansi\n"
+         << "  --bench-render[=N]   time N frames with each renderer at 200x60 and 400x120, then exit\n"
+         << "  --record=PATH        append every process sample to a recording\n"
+         << "  --record-tiers=LIST  how long to keep raw samples and which rollups to keep (default raw:1h,10s:1d,1m:30d)\n"
+         << "  --record-sync=PERIOD fdatasync the recording once per PERIOD (default 5s; 0 after every sample)\n"
+         << "  --check-record       test the recording format's checksums, crash recovery and syncing, then exit\n"
+         << "  --compare=PATH       print what changed between two samples of a recording, then exit\n"
+         << "  --from=WHEN --to=WHEN  samples to compare: #N (negative counts from the end) or HH:MM[:SS]\n"
+         << "  --resolution=PERIOD  read the coarsest rollup tier of at most PERIOD (e.g. 10s, 1m)\n"
+         << "  --filter=EXPR        list only processes matching EXPR, e.g. 'cpu > 5 and user != root'\n"
+         << "  --sort=KEY           initial sort order: cpu (default), mem or pid\n"
+         << "  --batch[=N]          print N process tables (default 1) to stdout instead of the UI\n"
+         << "  --http=[ADDR:]PORT   serve /procs (JSON) and /stream (SSE) instead of the UI (default address 127.0.0.1)\n"
+         << "  --otlp=URL           export metrics to an OTLP/HTTP collector (e.g. http://localhost:4318)\n"
+         << "  --otlp-top=N         processes exported per sample, by CPU (default 20)\n"
+         << "  --otlp-interval=SEC  seconds between export batches (default 10)\n"
+         << "  --check-otlp         run the exporter against a stub collector, then exit\n"
+         << "  --arrow=OUT          write --batch samples (default 1) as an Arrow IPC stream to OUT (- for stdout)\n"
+         << "  --recording=PATH     with --arrow: write the samples of a recording instead (--from/--to pick them)\n"
+         << "  --bench-query[=N]    time N evaluations of some filters over 100,000 processes, then exit\n"
+         << "  --check-query        check the filter regex engine against known matches, then exit\n";
+}
+
+bool parse_args(int argc, char** argv, Options &opt) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a.rfind("--backend=", 0) == 0) opt.backend = a.substr(10);
+        else if (a.rfind("--proc-root=", 0) == 0) opt.proc_root = a.substr(12);
+        else if (a == "--list-backends") opt.list_backends = true;
+        else if (a == "--check-backends") opt.check_backends = true;
+        else if (a == "--bench-backends") opt.bench_backends = 20;
+        else if (a.rfind("--bench-backends=", 0) == 0) opt.bench_backends = max(1, atoi(a.c_str() + 17));
+        else if (a.rfind("--period=", 0) == 0 && a.find(':') != string::npos) {
+            size_t colon = a.find(':');
+            opt.periods.push_back({a.substr(9, colon - 9), atoi(a.c_str() + colon + 1)});
+        }
+        else if (a == "--sampler-idle") opt.isolation.sched_idle = true;
+        else if (a.rfind("--sampler-nice=", 0) == 0) opt.isolation.nice = max(-20, min(19, atoi(a.c_str() + 15)));
+        else if (a.rfind("--sampler-cpus=", 0) == 0) {
+            cpu_set_t set;
+            opt.isolation.cpus = a.substr(15);
+            if (!parse_cpu_list(opt.isolation.cpus, set)) { cerr << "bad CPU list '" << opt.isolation.cpus << "'\n"; return false; }
+        }
+        else if (a.rfind("--sampler-ioprio=", 0) == 0) {
+            if (!parse_ioprio(a.substr(17), opt.isolation)) { cerr << "bad I/O priority '" << a.substr(17) << "'; use idle or be:0..7\n"; return false; }
+        }
+        else if (a.rfind("--state=", 0) == 0) opt.state_path = a.substr(8);
+        else if (a == "--no-state") opt.state_path.clear();
+        else if (a == "--scale") opt.scale_k = 500;
+        else if (a.rfind("--scale=", 0) == 0) opt.scale_k = (size_t)max(1, atoi(a.c_str() + 8));
+        else if (a == "--check-scale") opt.check_scale = true;
+        else if (a.rfind("--renderer=", 0) == 0) {
+            opt.renderer = a.substr(11);
+            if (opt.renderer != "ncurses" && opt.renderer != "ansi") { cerr << "unknown renderer '" << opt.renderer << "'\n"; return false; }
+        }
+        else if (a == "--bench-render") opt.bench_render = 200;
+        else if (a.rfind("--bench-render=", 0) == 0) opt.bench_render = max(1, atoi(a.c_str() + 15));
+        else if (a.rfind("--record=", 0) == 0) opt.record_path = a.substr(9);
+        else if (a.rfind("--record-tiers=", 0) == 0) {
+            string why;
+            if (!parse_record_tiers(a.substr(15), opt.record_tiers, why)) { cerr << "bad --record-tiers: " << why << "\n"; return false; }
+        }
+        else if (a.rfind("--record-sync=", 0) == 0) {
+            if (!parse_period(a.substr(14), opt.record_sync_ms)) { cerr << "bad sync period '" << a.substr(14) << "'\n"; return false; }
+        }
+        else if (a.rfind("--resolution=", 0) == 0) {
+            if (!parse_period(a.substr(13), opt.resolution_ms)) { cerr << "bad resolution '" << a.substr(13) << "'\n"; return false; }
+        }
+        else if (a.rfind("--compare=", 0) == 0) opt.compare_path = a.substr(10);
+        else if (a.rfind("--from=", 0) == 0) opt.compare_from = a.substr(7);
+        else if (a.rfind("--to=", 0) == 0) opt.compare_to = a.substr(5);
+        else if (a.rfind("--filter=", 0) == 0) opt.filter = a.substr(9);
+        else if (a.rfind("--sort=", 0) == 0) {
+            string k = a.substr(7);
+            if (k == "cpu") opt.sort_mode = SORT_CPU;
+            else if (k == "mem") opt.sort_mode = SORT_MEM;
+            else if (k == "pid") opt.sort_mode = SORT_PID;
+            else { cerr << "unknown sort key '" << k << "'; use cpu, mem or pid\n"; return false; }
+        }
+        else if (a == "--batch") opt.batch = 1;
+        else if (a.rfind("--batch=", 0) == 0) opt.batch = max(1, atoi(a.c_str() + 8));
+        else if (a.rfind("--http=", 0) == 0) opt.http = a.substr(7);
+        else if (a.rfind("--otlp=", 0) == 0) opt.otlp_url = a.substr(7);
+        else if (a.rfind("--otlp-top=", 0) == 0) opt.otlp_top = (size_t)max(1, atoi(a.c_str() + 11));
+        else if (a.rfind("--otlp-interval=", 0) == 0) opt.otlp_interval = max(1, atoi(a.c_str() + 16));
+        else if (a == "--check-otlp") opt.check_otlp = true;
+        else if (a == "--check-record") opt.check_record = true;
+        else if (a.rfind("--arrow=", 0) == 0) opt.arrow_path = a.substr(8);
+        else if (a.rfind("--recording=", 0) == 0) opt.recording_path = a.substr(12);
+        else if (a == "--bench-query") opt.bench_query = 1000;
+        else if (a.rfind("--bench-query=", 0) == 0) opt.bench_query = max(1, atoi(a.c_str() + 14));
+        else if (a == "--check-query") opt.check_query = true;
+        else if (a.rfind("--cgroup=", 0) == 0) opt.isolation.cgroup = a.substr(9);
+        else if (a.rfind("--cpu-quota=", 0) == 0) {
+            opt.isolation.cpu_quota_pct = atoi(a.c_str() + 12);
+            if (opt.isolation.cpu_quota_pct <= 0) { cerr << "bad CPU quota '" << a.substr(12) << "'\n"; return false; }
+            if (opt.isolation.cgroup.empty()) opt.isolation.cgroup = "sysmon";
+        }
+        else if (!a.empty() && isdigit((unsigned char)a[0])) {
+            try { opt.refresh_sec = stoi(a); if (opt.refresh_sec < 1) opt.refresh_sec = 1; } catch(...) { opt.refresh_sec = 2; }
+        }
+        else { print_usage(argv[0]); return false; }
+    }
+    if (!opt.recording_path.empty() && opt.arrow_path.empty()) { cerr << "--recording needs --arrow\n"; return false; }
+    if (!opt.arrow_path.empty() && !opt.batch) opt.batch = 1;
+    return true;
+}
+
+void list_backends(BackendRegistry &reg) {
+    CollectorBackend *chosen = reg.choose(FIELDS_DEFAULT);
+    for (auto &b : reg.backends) {
+        printf("%-16s %-10s cost %6.2f us/task  fields %s%s\n", b->name(), b->available() ? "available" : "missing",
+               b->cost(FIELDS_DEFAULT), field_names(b->fields()).c_str(), b.get() == chosen ? "  [auto]" : "");
+        if (!b->available() && !b->unavailable_reason().empty()) printf("%-16s   (%s)\n", "", b->unavailable_reason().c_str());
+    }
+}
+
+int bench_backends(BackendRegistry &reg, int iterations) {
+    for (auto &b : reg.backends) {
+        if (!b->available()) continue;
+        ProcSnapshot snap;
+        b->collect(snap, FIELDS_DEFAULT); // warm caches and lazily created pools
+        struct rusage ru0, ru1;
+        getrusage(RUSAGE_SELF, &ru0);
+        auto t0 = steady_clock::now();
+        for (int i = 0; i < iterations; ++i) b->collect(snap, FIELDS_DEFAULT);
+        double ms = duration<double, milli>(steady_clock::now() - t0).count() / iterations;
+        getrusage(RUSAGE_SELF, &ru1);
+        double csw = (double)((ru1.ru_nvcsw - ru0.ru_nvcsw) + (ru1.ru_nivcsw - ru0.ru_nivcsw)) / iterations;
+        printf("%-16s %8zu procs  %9.3f ms/sample  %7.2f us/proc  %8.0f ctxsw/sample\n", b->name(), snap.procs.size(), ms,
+               snap.procs.empty() ? 0.0 : ms * 1000.0 / (double)snap.procs.size(), csw);
+    }
+    return 0;
+}
+
+// Conformance check every backend must pass. Each backend's sample is
+// bracketed by two procfs-sync reference samples; for processes present in
+// all three, the backend's values must lie between the references.
+bool check_backend(CollectorBackend &b, CollectorBackend &ref, string &why) {
+    ProcSnapshot a, mid, c;
+    unsigned wanted = b.fields() & FIELDS_DEFAULT;
+    if (!ref.collect(a, FIELDS_DEFAULT) || !b.collect(mid, wanted) || !ref.collect(c, FIELDS_DEFAULT)) {
+        why = "collect() failed";
+        return false;
+    }
+    if (mid.procs.empty()) { why = "empty snapshot"; return false; }
+    if ((mid.fields & ~b.fields()) != 0) { why = "snapshot claims undeclared fields"; return false; }
+    for (size_t i = 1; i < mid.procs.size(); ++i) {
+        if (!(proc_key(mid.procs[i-1]) < proc_key(mid.procs[i]))) { why = "snapshot not sorted by (pid, starttime)"; return false; }
+    }
+    size_t both = 0, found = 0, bad_times = 0, bad_uid = 0, bad_comm = 0, bad_rss = 0, bad_cpu = 0, bad_affinity = 0;
+    int ncpus = max(1, (int)sysconf(_SC_NPROCESSORS_CONF));
+    size_t ia = 0, im = 0;
+    for (auto &pc : c.procs) {
+        ProcKey k = proc_key(pc);
+        while (ia < a.procs.size() && proc_key(a.procs[ia]) < k) ++ia;
+        if (ia >= a.procs.size() || !(proc_key(a.procs[ia]) == k)) continue;
+        const ProcInfo &pa = a.procs[ia];
+        both++;
+        while (im < mid.procs.size() && proc_key(mid.procs[im]) < k) ++im;
+        if (im >= mid.procs.size() || !(proc_key(mid.procs[im]) == k)) continue;
+        const ProcInfo &pm = mid.procs[im];
+        found++;
+        // one tick of slack: procfs rounds utime and stime to ticks separately
+        if ((wanted & FIELD_TIMES) && (pm.total_time + 1 < pa.total_time || pm.total_time > pc.total_time + 1)) bad_times++;
+        if ((wanted & FIELD_UID) && pm.uid != pa.uid) bad_uid++;
+        // procfs extends kernel thread names past TASK_COMM_LEN and appends the
+        // workqueue to kworker names; the raw comm is a prefix of those
+        size_t mlen = strlen(pm.name);
+        bool comm_prefix = mlen > 0 && strncmp(pa.name, pm.name, mlen) == 0;
+        if ((wanted & FIELD_COMM) && strcmp(pm.name, pa.name) != 0 && strcmp(pm.name, pc.name) != 0 && !comm_prefix) bad_comm++;
+        uint32_t lo = min(pa.mem_kb, pc.mem_kb), hi = max(pa.mem_kb, pc.mem_kb);
+        if ((wanted & FIELD_RSS) && (pm.mem_kb + 1024 < lo / 2 || pm.mem_kb > hi * 2 + 1024)) bad_rss++;
+        // a fixture may leave processor out; the live CPU moves too often to compare
+        if ((wanted & FIELD_LAST_CPU) && pa.last_cpu >= 0 && (pm.last_cpu < 0 || (pa.last_cpu < ncpus && pm.last_cpu >= ncpus))) bad_cpu++;
+        bool aff_same = pm.ncpus_allowed == pa.ncpus_allowed && pm.cpus_allowed == pa.cpus_allowed;
+        bool aff_same_after = pm.ncpus_allowed == pc.ncpus_allowed && pm.cpus_allowed == pc.cpus_allowed;
+        if ((wanted & FIELD_AFFINITY) && !aff_same && !aff_same_after) bad_affinity++;
+    }
+    ostringstream os;
+    os << found << "/" << both << " stable processes matched";
+    if (bad_times) os << ", " << bad_times << " times outside bracket";
+    if (bad_uid) os << ", " << bad_uid << " uid mismatches";
+    if (bad_comm) os << ", " << bad_comm << " comm mismatches";
+    if (bad_rss) os << ", " << bad_rss << " rss outliers";
+    if (bad_cpu) os << ", " << bad_cpu << " bad last CPUs";
+    if (bad_affinity) os << ", " << bad_affinity << " affinity mismatches";
+    why = os.str();
+    // processes that exist before and after the sample must not be missed
+    return both > 0 && found * 100 >= both * 95 && !bad_times && !bad_uid && !bad_comm && !bad_rss && !bad_cpu && !bad_affinity;
+}
+
+int check_backends(BackendRegistry &reg, const string &proc_root) {
+    int failures = 0;
+    for (auto &b : reg.backends) {
+        if (!b->available()) {
+            string why = b->unavailable_reason();
+            printf("SKIP %-16s %s\n", b->name(), why.empty() ? "not available on this host" : why.c_str());
+            continue;
+        }
+        bool fixture = string(b->name()) == "fixture";
+        ProcfsSyncBackend ref(fixture ? proc_root : string("/proc"));
+        string why;
+        bool ok = check_backend(*b, ref, why);
+        printf("%s %-16s %s\n", ok ? "PASS" : "FAIL", b->name(), why.c_str());
+        if (!ok) failures++;
+    }
+    return failures ? 1 : 0;
+}
+
+// Draws the same synthetic frames through both renderers into a file: the
+// header and a list of 2000 processes where a tenth change CPU% and the order
+// shifts every frame. Reports thread CPU time and bytes written per frame.
+int bench_render(int frames) {
+    const int NPROCS = 2000;
+    printf("%-8s %8s %12s %10s %12s\n", "renderer", "size", "first frame", "us/frame", "bytes/frame");
+    for (auto size : {make_pair(60, 200), make_pair(120, 400)}) {
+        for (int which = 0; which < 2; ++which) {
+            FILE *out = tmpfile();
+            FILE *in = fopen("/dev/null", "r");
+            if (!out || !in) { perror("tmpfile"); return 1; }
+            unique_ptr<Renderer> term;
+            if (which == 0) {
+                // ncurses takes the size from the environment when out is not a tty
+                setenv("LINES", to_string(size.first).c_str(), 1);
+                setenv("COLUMNS", to_string(size.second).c_str(), 1);
+                if (!getenv("TERM")) setenv("TERM", "xterm", 1);
+                term.reset(new NcursesRenderer(out, in));
+            } else {
+                term.reset(new AnsiRenderer(fileno(out), -1, false, size.first, size.second));
+            }
+            int rows = term->rows(), cols = term->cols();
+            unique_ptr<Canvas> header = term->canvas(3, cols, 0, 0);
+            unique_ptr<Canvas> body = term->canvas(rows - 3, cols, 3, 0);
+
+            minstd_rand rng(7);
+            vector<ProcInfo> procs(NPROCS);
+            vector<CpuHistory> history(NPROCS);
+            UserNames users = {{0, "root"}, {1000, "builder"}};
+            CmdlineCache cmdlines;
+            SockCountCache sock_cache;
+            int hscroll = 0;
+            for (int i = 0; i < NPROCS; ++i) {
+                ProcInfo &p = procs[i];
+                p.pid = 100 + i * 3;
+                p.starttime = 1000 + i;
+                p.uid = (i % 5) ? 1000 : 0;
+                p.mem_kb = rng() % 500000;
+                set_comm(p, "worker-" + to_string(i % 40));
+                cmdlines.preload(proc_key(p), "/usr/bin/worker --id " + to_string(i) + " --pool " + to_string(i % 40) + " " + string(i % 7 * 12, 'x'));
+            }
+            vector<uint32_t> order;
+            double first_us = 0, us = 0;
+            long long first_bytes = 0, bytes = 0;
+            for (int f = 0; f <= frames; ++f) {
+                for (int i = 0; i < NPROCS / 10; ++i) procs[rng() % NPROCS].cpu_percent = (float)(rng() % 5000) / 100.0f;
+                for (int i = 0; i < NPROCS; ++i) history[i].push(procs[i].cpu_percent);
+                sort_order(procs, order, SORT_CPU);
+                fflush(out);
+                struct stat st0, st1;
+                fstat(fileno(out), &st0);
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+                draw_header(*header, 6000000, 2500000, 20.0 + f % 10, 2, SORT_CPU, "bench", "");
+                draw_processes(*body, procs, &history, users, 6000000, order, true, f % 20, 0, 0, cmdlines, hscroll, false, 1, nullptr, sock_cache);
+                term->present();
+                fflush(out);
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+                fstat(fileno(out), &st1);
+                double t = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+                if (f == 0) { first_us = t; first_bytes = st1.st_size - st0.st_size; }
+                else { us += t; bytes += st1.st_size - st0.st_size; }
+            }
+            printf("%-8s %4dx%-3d %8lld B %10.1f %12.0f   (first frame %.0f us)\n", term->name(), cols, rows, first_bytes,
+                   us / frames, (double)bytes / frames, first_us);
+            header.reset();
+            body.reset();
+            term.reset();
+            fclose(out);
+            fclose(in);
+        }
+    }
+    return 0;
+}
+
+// Scale mode against a full procfs-sync scan of the same tree; both take two
+// scans with the same CPU interval. Meant for a static fixture, where the top
+// K must match exactly in every sort order.
+int check_scale(const string &root, size_t k) {
+    const unsigned long long delta = 1000;
+    auto rss_mb = []{
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_maxrss / 1024.0;
+    };
+    ScaleCollector sc(root, k);
+    auto t0 = steady_clock::now();
+    if (!sc.scan(0) || !sc.scan(delta)) { printf("FAIL scale   cannot read %s\n", root.c_str()); return 1; }
+    double scan_ms = sc.stats().scan_ms;
+    double total_ms = duration<double, milli>(steady_clock::now() - t0).count();
+    vector<vector<ProcInfo>> tops;
+    double top_ms = 0;
+    for (SortMode m : {SORT_CPU, SORT_MEM, SORT_PID}) {
+        auto t1 = steady_clock::now();
+        tops.push_back(sc.top(m, FIELDS_DEFAULT));
+        top_ms += duration<double, milli>(steady_clock::now() - t1).count();
+    }
+    const ScaleStats &st = sc.stats();
+    printf("scale  %9zu tasks  scan %8.1f ms (two: %.1f)  top-%zu %6.1f ms/order  held %6.1f MB  peak RSS %6.1f MB\n",
+           st.tasks, scan_ms, total_ms, k, top_ms / 3, st.bytes / 1048576.0, rss_mb());
+
+    ProcfsSyncBackend ref(root);
+    ProcSnapshot a, b;
+    t0 = steady_clock::now();
+    if (!ref.collect(a, FIELDS_DEFAULT) || !ref.collect(b, FIELDS_DEFAULT)) { printf("FAIL full   cannot read %s\n", root.c_str()); return 1; }
+    update_cpu_percent(a.procs, b.procs, 0, delta);
+    double full_ms = duration<double, milli>(steady_clock::now() - t0).count();
+    printf("full   %9zu tasks  two scans %8.1f ms  held %6.1f MB  peak RSS %6.1f MB\n",
+           b.procs.size(), full_ms, (a.procs.capacity() + b.procs.capacity()) * sizeof(ProcInfo) / 1048576.0, rss_mb());
+
+    int failures = 0;
+    const char *names[] = {"cpu", "mem", "pid"};
+    vector<uint32_t> order, sorder;
+    for (int m = 0; m < 3; ++m) {
+        sort_order(b.procs, order, (SortMode)m);
+        order.resize(min(order.size(), k));
+        sort_order(tops[m], sorder, (SortMode)m);
+        size_t bad = (order.size() == sorder.size()) ? 0 : 1;
+        for (size_t i = 0; !bad && i < order.size(); ++i) {
+            const ProcInfo &x = b.procs[order[i]], &y = tops[m][sorder[i]];
+            if (x.pid != y.pid || x.mem_kb != y.mem_kb || x.uid != y.uid || strcmp(x.name, y.name) != 0
+                || fabs(x.cpu_percent - y.cpu_percent) > 0.01) bad = i + 1;
+        }
+        if (bad) printf("FAIL top %zu by %s differs (at row %zu)\n", k, names[m], bad - 1);
+        else printf("PASS top %zu by %s\n", k, names[m]);
+        if (bad) failures++;
+    }
+    int samples = 0;
+    for (const ProcInfo &p : b.procs) if (p.mem_kb <= st.rss_p50_kb) samples++;
+    printf("sample %zu tasks: RSS p50 %s is the %.1fth percentile of the full scan\n", st.sampled,
+           human_kb(st.rss_p50_kb).c_str(), b.procs.empty() ? 0.0 : 100.0 * samples / b.procs.size());
+    return failures ? 1 : 0;
+}
+
+// a local time of day HH:MM[:SS] today as milliseconds since the epoch (the
+// end of that second), or 0 if when is not one
+uint64_t time_of_day_ms(const string &when) {
+    int hh = 0, mm = 0, ss = 0;
+    if (when.empty() || when[0] == '#' || sscanf(when.c_str(), "%d:%d:%d", &hh, &mm, &ss) < 2) return 0;
+    time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = hh;
+    tm.tm_min = mm;
+    tm.tm_sec = ss;
+    return (uint64_t)mktime(&tm) * 1000 + 999;
+}
+
+// #N (negative from the end) or a local time of day HH:MM[:SS] today, which
+// picks the last sample taken at or before it; -1 if there is none
+long pick_sample(const RecordingReader &r, const string &when, long fallback) {
+    long n = (long)r.size();
+    if (when.empty()) return fallback;
+    if (when[0] == '#') {
+        long i = atol(when.c_str() + 1);
+        if (i < 0) i += n;
+        return (i >= 0 && i < n) ? i : -1;
+    }
+    uint64_t at_ms = time_of_day_ms(when);
+    if (!at_ms) return -1;
+    long best = -1;
+    for (long i = 0; i < n && r.sample((size_t)i).time_ms <= at_ms; ++i) best = i;
+    return best;
+}
+
+// Which file of a recording to read: PATH itself or one of the rollup tiers
+// next to it. That is the coarsest tier whose period is within resolution_ms
+// and that still reaches back to from (when it is a time of day); failing
+// that, the finest tier that does, and failing that, the coarsest.
+// Only files named like tier_path(path, period), holding that period's
+// rollups and written in the same boot as PATH, count as its tiers.
+string pick_tier(const string &path, uint64_t resolution_ms, const string &from) {
+    struct Candidate { string path; uint32_t period_ms; uint64_t first_ms; };
+    vector<Candidate> tiers;
+    RecordingReader raw;
+    string why;
+    if (!raw.open(path, why)) return path; // for the caller to report
+    if (raw.size() > 0) tiers.push_back({path, 0, raw.sample(0).time_ms});
+    auto consider = [&](const string &p, uint64_t period_ms) {
+        RecordingReader r;
+        if (!r.open(p, why) || r.size() == 0 || r.header().tier_ms != period_ms) return;
+        if (strncmp(r.header().boot_id, raw.header().boot_id, sizeof(raw.header().boot_id)) != 0) return;
+        tiers.push_back({p, r.header().tier_ms, r.sample(0).time_ms});
+    };
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : path.substr(0, slash + 1), base = path.substr(slash == string::npos ? 0 : slash + 1);
+    if (DIR *d = opendir(dir.c_str())) {
+        while (struct dirent *e = readdir(d)) {
+            string name = e->d_name;
+            if (name.size() <= base.size() + 1 || name.compare(0, base.size() + 1, base + ".") != 0) continue;
+            string label = name.substr(base.size() + 1);
+            uint64_t period = 0;
+            if (!parse_period(label, period) || period == 0 || period > UINT32_MAX || period_label(period) != label) continue;
+            consider(tier_path(path, (uint32_t)period), period);
+        }
+        closedir(d);
+    }
+    if (tiers.empty()) return path; // for the caller to report
+    sort(tiers.begin(), tiers.end(), [](const Candidate &a, const Candidate &b) { return a.period_ms < b.period_ms; });
+    uint64_t start = time_of_day_ms(from);
+    auto reaches = [&](const Candidate &c) { return !start || c.first_ms <= start; };
+    const Candidate *pick = nullptr;
+    for (auto &c : tiers) if (c.period_ms <= resolution_ms && reaches(c)) pick = &c;
+    for (auto &c : tiers) if (!pick && reaches(c)) pick = &c;
+    if (!pick) pick = &tiers.back();
+    if (pick->period_ms) fprintf(stderr, "reading the %s rollups in %s\n", period_label(pick->period_ms).c_str(), pick->path.c_str());
+    return pick->path;
+}
+
+int compare_recording(const string &recording, const string &from, const string &to, uint64_t resolution_ms) {
+    string path = pick_tier(recording, resolution_ms, from);
+    RecordingReader rec;
+    string why;
+    if (!rec.open(path, why)) { fprintf(stderr, "%s\n", why.c_str()); return 1; }
+    if (rec.size() < 1) { fprintf(stderr, "%s has no samples\n", path.c_str()); return 1; }
+    long a = pick_sample(rec, from, 0), b = pick_sample(rec, to, (long)rec.size() - 1);
+    if (a < 0 || b < 0) { fprintf(stderr, "no sample at %s\n", (a < 0 ? from : to).c_str()); return 1; }
+    Comparison c;
+    c.before = rec.procs((size_t)a);
+    c.after = rec.procs((size_t)b);
+    c.before_time = rec.sample((size_t)a).time_ms / 1000;
+    c.after_time = rec.sample((size_t)b).time_ms / 1000;
+    compare_snapshots(c, (double)max<uint64_t>(1, rec.header().clk_tck));
+    UserCache users;
+    users.resolve(*c.before);
+    users.resolve(*c.after);
+
+    auto stamp = [](uint64_t secs) {
+        time_t t = (time_t)secs;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        char buf[32];
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+        return string(buf);
+    };
+    printf("#%ld %s (%zu processes) -> #%ld %s (%zu processes), %s apart\n", a, stamp(c.before_time).c_str(), c.before->size(),
+           b, stamp(c.after_time).c_str(), c.after->size(), format_age((long long)(c.after_time - c.before_time)).c_str());
+    printf("%zu new, %zu gone, RSS %s, CPU %.1f s\n", c.added, c.gone, signed_kb(c.rss_delta_kb).c_str(), c.cpu_sec);
+    const size_t TOP = 15;
+    auto section = [&](const char *title, SortMode mode, function<bool(const ProcDelta&)> keep) {
+        vector<uint32_t> order;
+        sort_deltas(c, order, mode);
+        size_t shown = 0;
+        for (uint32_t i : order) {
+            const ProcDelta &d = c.rows[i];
+            if (!keep(d)) continue;
+            if (shown++ == 0) printf("\n%s\n%7s %-10s %-4s %9s %9s %9s %9s  COMMAND\n", title, "PID", "USER", "", "RSS THEN", "RSS NOW", "RSS +/-", "CPU SEC");
+            if (shown > TOP) break;
+            const ProcInfo &p = c.proc(d);
+            printf("%7d %-10.10s %-4s %9s %9s %9s %9.2f  %s\n", p.pid, user_name(users.names, p.uid), d.before < 0 ? "new" : (d.after < 0 ? "gone" : ""),
+                   d.before >= 0 ? human_kb((*c.before)[d.before].mem_kb).c_str() : "-",
+                   d.after >= 0 ? human_kb((*c.after)[d.after].mem_kb).c_str() : "-",
+                   signed_kb(d.rss_delta_kb).c_str(), d.cpu_sec, p.name);
+        }
+    };
+    section("RSS growth", SORT_MEM, [](const ProcDelta &d) { return d.before >= 0 && d.after >= 0 && d.rss_delta_kb > 0; });
+    section("CPU time", SORT_CPU, [](const ProcDelta &d) { return d.cpu_sec > 0; });
+    section("New", SORT_MEM, [](const ProcDelta &d) { return d.before < 0; });
+    section("Gone", SORT_PID, [](const ProcDelta &d) { return d.after < 0; });
+    return 0;
+}
+
+// Self-test of the recording format: CRC32C against known values and across
+// implementations, recovery from a torn tail and refusal of a damaged file,
+// and how many fdatasync calls a burst of samples costs.
+int check_record() {
+    int failures = 0;
+    auto check = [&](bool ok, const string &what) {
+        printf("%s %s\n", ok ? "PASS" : "FAIL", what.c_str());
+        if (!ok) failures++;
+    };
+    check(crc32c("123456789", 9) == 0xe3069283 && crc32c_soft(0, "123456789", 9) == 0xe3069283, "CRC32C check value");
+    check(crc32c("56789", 5, crc32c("1234", 4)) == 0xe3069283, "CRC32C continued over two calls");
+    mt19937 rng(3);
+    string data(64 << 20, '\0');
+    for (auto &c : data) c = (char)rng();
+    bool same = true;
+    for (int i = 0; i < 2000 && same; ++i) {
+        size_t off = rng() % 64, n = rng() % 5000;
+        same = crc32c_sse42(0, data.data() + off, n) == crc32c_soft(0, data.data() + off, n);
+    }
+    check(same, "CRC32C: SSE4.2 and table versions agree on 2000 unaligned buffers");
+    auto rate = [&](uint32_t (*fn)(uint32_t, const char*, size_t)) {
+        auto t0 = steady_clock::now();
+        volatile uint32_t sink = fn(0, data.data(), data.size());
+        (void)sink;
+        return data.size() / 1e9 / duration<double>(steady_clock::now() - t0).count();
+    };
+    printf("CRC32C %s: %.1f GB/s, tables %.1f GB/s\n", crc32c_hardware() ? "SSE4.2" : "(no SSE4.2)", rate(crc32c_sse42), rate(crc32c_soft));
+
+    char dir_template[] = "/tmp/sysmon-check-XXXXXX";
+    if (!mkdtemp(dir_template)) { printf("FAIL mkdtemp: %s\n", strerror(errno)); return 1; }
+    string dir = dir_template, path = dir + "/rec";
+    vector<ProcInfo> procs(300);
+    for (size_t i = 0; i < procs.size(); ++i) {
+        procs[i].pid = 100 + (int)i;
+        procs[i].starttime = 7000 + i;
+        procs[i].mem_kb = 1000 + (uint32_t)i;
+        set_comm(procs[i], "proc" + to_string(i % 20));
+    }
+    vector<RecordTier> raw_only = {{0, 0}};
+    auto record = [&](int samples, uint64_t sync_ms, size_t *syncs = nullptr) {
+        Recorder r;
+        string why;
+        if (!r.open(path, raw_only, sync_ms, why)) { printf("cannot record: %s\n", why.c_str()); return -1.0; }
+        auto t0 = steady_clock::now();
+        for (int i = 0; i < samples; ++i) {
+            for (auto &p : procs) p.total_time += 1;
+            r.append(1000000 + (uint64_t)i * 1000, 0, 1 << 20, procs);
+        }
+        double us = duration<double, micro>(steady_clock::now() - t0).count() / samples;
+        r.close();
+        if (syncs) *syncs = r.syncs();
+        return r.error.empty() ? us : -1.0;
+    };
+    auto count = [&](bool *damaged = nullptr) {
+        RecordingReader r;
+        string why;
+        if (!r.open(path, why)) return (size_t)-1;
+        if (damaged) *damaged = r.damaged;
+        return r.size();
+    };
+    auto file_size = [&]() {
+        struct stat sb;
+        return stat(path.c_str(), &sb) == 0 ? (off_t)sb.st_size : (off_t)-1;
+    };
+
+    size_t syncs = 0;
+    double us = record(200, 0, &syncs);
+    check(us >= 0 && count() == 200, "200 samples written and read back");
+    printf("sync after every sample: %zu fdatasync calls, %.0f us per sample\n", syncs, us);
+    unlink(path.c_str());
+    us = record(200, 1000, &syncs);
+    check(us >= 0 && count() == 200 && syncs <= 3, "group commit: 200 samples in at most 3 fdatasync calls");
+    printf("sync once a second: %zu fdatasync calls, %.0f us per sample\n", syncs, us);
+
+    // a crash halfway through the last write
+    off_t full = file_size(), frame = (off_t)(sizeof(RecordFrame) + sizeof(RecordSample) + procs.size() * sizeof(RecordProc));
+    check(truncate(path.c_str(), full - frame / 2) == 0 && count() == 199, "torn last frame: the 199 complete samples read");
+    check(record(1, 1000) >= 0 && count() == 200 && file_size() == full, "torn last frame: cut off before appending");
+    // the file grew but the data never reached the disk
+    check(truncate(path.c_str(), full + 3 * frame) == 0 && count() == 200, "zero-filled tail: all 200 samples read");
+    check(record(1, 1000) >= 0 && count() == 201, "zero-filled tail: cut off before appending");
+    // a flipped bit inside sample 100
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        off_t at = (off_t)sizeof(RecordHeader) + 100 * frame + frame / 2;
+        char c = 0;
+        bool flipped = fd >= 0 && pread(fd, &c, 1, at) == 1 && (c ^= 4, pwrite(fd, &c, 1, at) == 1);
+        if (fd >= 0) close(fd);
+        bool damaged = false;
+        check(flipped && count(&damaged) == 100 && damaged, "damaged frame: the 100 samples before it read, file marked damaged");
+        off_t before = file_size();
+        check(record(1, 1000) < 0 && file_size() == before, "damaged frame: recording refuses to append");
+    }
+    unlink(path.c_str());
+    rmdir(dir.c_str());
+    return failures ? 1 : 0;
+}
+
+// Filters 100,000 synthetic processes (400 distinct names, 9 users) with a
+// few queries; reports the time per evaluation, column building aside.
+int bench_query(int iterations) {
+    const size_t N = 100000;
+    mt19937 rng(7);
+    vector<ProcInfo> procs(N);
+    static const char *stems[] = {"python3", "postgres", "nginx", "java", "kworker/", "bash", "sshd", "node"};
+    UserNames users;
+    users[0] = "root";
+    for (uint32_t u = 1000; u < 1008; ++u) users[u] = "user" + to_string(u - 1000);
+    for (size_t i = 0; i < N; ++i) {
+        ProcInfo &p = procs[i];
+        p.pid = (int)i + 1;
+        p.starttime = 1000 + rng() % 10000000;
+        p.total_time = rng() % 100000;
+        p.cpu_percent = (rng() % 10 == 0) ? (float)(rng() % 10000) / 100.0f : 0.0f;
+        p.mem_kb = rng() % 500000;
+        p.uid = (rng() % 3 == 0) ? 0 : 1000 + rng() % 8;
+        p.last_cpu = (int16_t)(rng() % 64);
+        set_comm(p, string(stems[rng() % 8]) + to_string(rng() % 50));
+    }
+    auto t0 = steady_clock::now();
+    shared_ptr<const ProcColumns> cols = build_columns(procs);
+    double build_ms = duration<double, milli>(steady_clock::now() - t0).count();
+    printf("%zu rows, %zu names, %zu users: columns built in %.2f ms\n", N, cols->names.size(), cols->uids.size(), build_ms);
+    QueryContext ctx;
+    ctx.users = &users;
+    ctx.mem_total_kb = 16ULL * 1024 * 1024;
+    ctx.now = time(nullptr);
+    ctx.boot_time = ctx.now - 200000;
+    static const char *queries[] = {
+        "cpu > 5 and user != \"root\" and name ~ \"^python\"",
+        "rss > 100M or core == 3",
+        "not (user == root) and age > 1h",
+        "name ~ \"^(java|node)[0-9]+$\" or mem > 2% and time > 10m",
+    };
+    vector<uint64_t> sel;
+    for (const char *text : queries) {
+        Query q;
+        string why;
+        if (!q.compile(text, why)) { printf("%s: %s\n", text, why.c_str()); return 1; }
+        q.select(*cols, ctx, sel); // builds the regex automaton's states
+        t0 = steady_clock::now();
+        for (int i = 0; i < iterations; ++i) q.select(*cols, ctx, sel);
+        double us = duration<double, micro>(steady_clock::now() - t0).count() / iterations;
+        size_t hits = 0;
+        for (uint64_t w : sel) hits += (size_t)__builtin_popcountll(w);
+        printf("%8.1f us  %6zu match  %s\n", us, hits, text);
+    }
+    return 0;
+}
+
+// Patterns with known answers, mostly around ^ and $ inside alternations,
+// where each anchor holds for its own branch only.
+int check_query() {
+    struct Case { const char *pattern, *text; bool match; };
+    static const Case cases[] = {
+        {"a|b$", "xa", true}, {"a|b$", "bx", false}, {"a|b$", "xb", true},
+        {"^a|b", "ax", true}, {"^a|b", "xa", false}, {"^a|b", "xb", true},
+        {"a$|^b", "ba", true}, {"a$|^b", "ab", false},
+        {"(a|^b)c", "xac", true}, {"(a|^b)c", "bc", true}, {"(a|^b)c", "xbc", false},
+        {"^python", "python3", true}, {"^python", "xpython", false},
+        {"^(java|node)[0-9]+$", "java12", true}, {"^(java|node)[0-9]+$", "java12x", false},
+        {"^$", "", true}, {"^$", "a", false}, {"x$", "", false}, {"a*$", "", true},
+        {"\\$", "a$", true}, {"\\$", "a", false}, {"[$^]", "^", true},
+        {"kworker/[0-9]+:", "kworker/3:1", true}, {"ssh|nginx", "sshd", true},
+    };
+    int failures = 0;
+    for (const Case &c : cases) {
+        Regex re;
+        string why;
+        bool got = re.compile(c.pattern, why) && re.match(c.text);
+        if (got != c.match) failures++;
+        printf("%s /%s/ on \"%s\": %s\n", got == c.match ? "PASS" : "FAIL", c.pattern, c.text, got ? "match" : "no match");
+    }
+    return failures ? 1 : 0;
+}
+
+// Prints a process table for each of the next samples that have CPU%
+// (filtered and sorted like the UI) and returns.
+int batch_output(Sampler &sampler, int reader, Query &query, SortMode sort_mode, int samples) {
+    long long boot_time = read_boot_time();
+    CmdlineCache cmdlines;
+    vector<uint64_t> sel;
+    vector<uint32_t> order;
+    uint64_t printed_seq = 0;
+    while (samples > 0) {
+        struct pollfd pfd = {sampler.wake_fd(), POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        char drain[64];
+        while (read(sampler.wake_fd(), drain, sizeof(drain)) > 0) {}
+        auto frame = sampler.frames.read(reader);
+        const Frame *f = frame.get();
+        if (!f || !f->procs || !f->columns || !f->procs_cpu_valid || f->procs_seq == printed_seq) continue;
+        printed_seq = f->procs_seq;
+        const vector<ProcInfo> &procs = *f->procs;
+        time_t now = time(nullptr);
+        if (!query.empty()) {
+            QueryContext ctx{f->users.get(), f->mem_total_kb, boot_time, now};
+            query.select(f->columns->get(), ctx, sel);
+        }
+        sort_order(procs, order, sort_mode, query.empty() ? nullptr : &sel);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s  CPU %.2f%%  Mem %lluMB of %lluMB  %zu of %zu processes\n", stamp, max(0.0, f->total_cpu_percent),
+               (f->mem_total_kb - f->mem_available_kb) / 1024, f->mem_total_kb / 1024, order.size(), procs.size());
+        printf("%7s %-10s %6s %8s %8s %7s COMMAND\n", "PID", "USER", "%CPU", "MEM(%)", "RSS", "AGE");
+        for (uint32_t i : order) {
+            const ProcInfo &p = procs[i];
+            double mem_percent = f->mem_total_kb > 0 ? 100.0 * p.mem_kb / (double)f->mem_total_kb : 0.0;
+            // one line per process, even for arguments with newlines in them
+            string cmd = cmdlines.get(p);
+            for (char &ch : cmd) if ((unsigned char)ch < 32) ch = ' ';
+            printf("%7d %-10.10s %6.2f %8.2f %8s %7s %s\n", p.pid, user_name(*f->users, p.uid), p.cpu_percent, mem_percent,
+                   human_kb(p.mem_kb).c_str(), format_age(process_age(p, boot_time, now)).c_str(), cmd.c_str());
+        }
+        if (--samples > 0) printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// The per-process columns of a rollup tier besides the averages, which go in
+// the usual cpu and rss_kb columns.
+struct RollupColumns {
+    vector<float> cpu_min, cpu_max;
+    vector<uint32_t> rss_min_kb, rss_max_kb, samples;
+
+    void clear() {
+        cpu_min.clear();
+        cpu_max.clear();
+        rss_min_kb.clear();
+        rss_max_kb.clear();
+        samples.clear();
+    }
+    void add(const RollupProc &r) {
+        cpu_min.push_back(r.cpu_min);
+        cpu_max.push_back(r.cpu_max);
+        rss_min_kb.push_back(r.rss_min_kb);
+        rss_max_kb.push_back(r.rss_max_kb);
+        samples.push_back(r.samples);
+    }
+};
+
+// FlatBuffers, just what the Arrow IPC messages below use. Like the real
+// builder it fills the buffer from the back, children before parents, so an
+// object is known by its distance from the end until finish() fixes the
+// layout. Tables are built between start() and end().
+class FlatBuilder {
+public:
+    void clear() {
+        used = 0;
+        minalign = 1;
+    }
+    template <typename T> void add(int id, T v) {
+        push(v);
+        fields.push_back({id, used});
+    }
+    void add_offset(int id, uint32_t obj) {
+        push_offset(obj);
+        fields.push_back({id, used});
+    }
+    void start() {
+        fields.clear();
+        table_start = used;
+    }
+    uint32_t end() {
+        push<int32_t>(0); // to the vtable, filled in below
+        uint32_t table = used;
+        int n = 0;
+        for (auto &f : fields) n = max(n, f.first + 1);
+        vector<uint16_t> vt(n + 2, 0);
+        vt[0] = (uint16_t)(2 * (n + 2));
+        vt[1] = (uint16_t)(table - table_start);
+        for (auto &f : fields) vt[2 + f.first] = (uint16_t)(table - f.second);
+        for (int i = n + 1; i >= 0; --i) push<uint16_t>(vt[i]);
+        int32_t to_vtable = (int32_t)(used - table);
+        memcpy(at(table), &to_vtable, 4);
+        return table;
+    }
+    uint32_t string_(const string &s) {
+        pre_align(s.size() + 1, 4);
+        memcpy(grow(s.size() + 1), s.c_str(), s.size() + 1);
+        push<uint32_t>((uint32_t)s.size());
+        return used;
+    }
+    // a vector of structs or scalars, laid out as they are in memory
+    uint32_t vector_(const void *p, size_t count, size_t elem_size, size_t align) {
+        pre_align(count * elem_size, 4);
+        pre_align(count * elem_size, align);
+        if (count) memcpy(grow(count * elem_size), p, count * elem_size);
+        push<uint32_t>((uint32_t)count);
+        return used;
+    }
+    uint32_t offsets(const vector<uint32_t> &objs) {
+        pre_align(4 * objs.size(), 4);
+        for (size_t i = objs.size(); i-- > 0;) push_offset(objs[i]);
+        push<uint32_t>((uint32_t)objs.size());
+        return used;
+    }
+    // the finished buffer, sized to a multiple of its largest alignment
+    pair<const char*, size_t> finish(uint32_t root) {
+        pre_align(4, max<size_t>(minalign, 8));
+        push_offset(root);
+        return {at(used), used};
+    }
+
+private:
+    char *at(uint32_t off) { return &buf[buf.size() - off]; }
+    char *grow(size_t n) {
+        if (used + n > buf.size()) {
+            string bigger(max(buf.size() * 2, used + n + 256), '\0');
+            memcpy(&bigger[bigger.size() - used], at(used), used);
+            buf.swap(bigger);
+        }
+        used += (uint32_t)n;
+        return at(used);
+    }
+    // pads so that len more bytes end on an a-byte boundary
+    void pre_align(size_t len, size_t a) {
+        minalign = max(minalign, a);
+        size_t pad = (a - (used + len) % a) % a;
+        if (pad) memset(grow(pad), 0, pad);
+    }
+    template <typename T> void push(T v) {
+        pre_align(sizeof(T), sizeof(T));
+        memcpy(grow(sizeof(T)), &v, sizeof(T));
+    }
+    void push_offset(uint32_t obj) {
+        pre_align(4, 4);
+        push<uint32_t>(used + 4 - obj);
+    }
+
+    string buf;
+    uint32_t used = 0;
+    size_t minalign = 1;
+    uint32_t table_start = 0;
+    vector<pair<int, uint32_t>> fields; // (id, position) of the open table's fields
+};
+
+// Writes process samples as an Apache Arrow IPC stream: a schema, then record
+// batches whose numeric buffers are ProcColumns vectors themselves, handed to
+// writev() without a copy. Names and users are dictionary columns with one
+// dictionary each for the whole stream. Values given to seed() go out in full
+// before the first batch; values first seen in a batch follow as a delta
+// dictionary batch. A batch's own indices are used as they are when its
+// dictionary matches the stream's, and translated otherwise. Rollups add
+// their minimum, maximum and sample count columns after the averages.
+class ArrowWriter {
+public:
+    ~ArrowWriter() { if (fd > STDERR_FILENO) close(fd); }
+
+    // "-" writes to stdout
+    bool open(const string &path, uint64_t clk_tck, bool rollups, string &why) {
+        fd = path == "-" ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) { why = "open " + path + ": " + strerror(errno); return false; }
+        columns = rollups ? COLUMNS + ROLLUP_COLUMNS : COLUMNS;
+        return write_schema(clk_tck, why);
+    }
+
+    void seed(const vector<string> &names, const vector<string> &users) {
+        for (auto &v : names) add_value(name_dict, v);
+        for (auto &v : users) add_value(user_dict, v);
+    }
+
+    // times: the sample time of each row, milliseconds since the epoch;
+    // rollup: the rest of each row when the stream holds rollups
+    bool write(const vector<int64_t> &times, const ProcColumns &c, const UserNames &users, const RollupColumns *rollup, string &why) {
+        size_t n = c.rows;
+        vector<string> user_names(c.uids.size());
+        for (size_t k = 0; k < c.uids.size(); ++k) user_names[k] = user_name(users, c.uids[k]);
+        const int32_t *name_idx = translate(name_dict, c.names, c.name, name_map, why);
+        const int32_t *user_idx = name_idx ? translate(user_dict, user_names, c.user, user_map, why) : nullptr;
+        if (!name_idx || !user_idx) return false;
+        if (!flush_dictionary(0, name_dict, why) || !flush_dictionary(1, user_dict, why)) return false;
+
+        body.clear();
+        add_buffer(times.data(), n * 8);
+        add_buffer(c.pid.data(), n * 4);
+        add_buffer(name_idx, n * 4);
+        add_buffer(user_idx, n * 4);
+        add_buffer(c.uid.data(), n * 4);
+        add_buffer(c.cpu.data(), n * 4);
+        add_buffer(c.rss_kb.data(), n * 4);
+        add_buffer(c.starttime.data(), n * 8);
+        add_buffer(c.total_time.data(), n * 8);
+        add_buffer(c.last_cpu.data(), n * 2);
+        if (columns > COLUMNS) {
+            add_buffer(rollup->cpu_min.data(), n * 4);
+            add_buffer(rollup->cpu_max.data(), n * 4);
+            add_buffer(rollup->rss_min_kb.data(), n * 4);
+            add_buffer(rollup->rss_max_kb.data(), n * 4);
+            add_buffer(rollup->samples.data(), n * 4);
+        }
+        if (!write_batch(MSG_RECORD_BATCH, 0, false, n, columns, why)) return false;
+        batches++;
+        rows += n;
+        return true;
+    }
+
+    // the end-of-stream marker
+    bool finish(string &why) {
+        uint32_t eos[2] = {0xffffffffu, 0};
+        iovec v = {eos, sizeof(eos)};
+        return write_all(&v, 1, why);
+    }
+
+    size_t batches = 0, rows = 0;
+    uint64_t bytes = 0;
+
+private:
+    enum { MSG_SCHEMA = 1, MSG_DICTIONARY_BATCH = 2, MSG_RECORD_BATCH = 3 };
+    enum { TYPE_INT = 2, TYPE_FLOAT = 3, TYPE_UTF8 = 5, TYPE_TIMESTAMP = 10 };
+    static const int COLUMNS = 10, ROLLUP_COLUMNS = 5;
+    struct BufferRef { const void *p; size_t len; };
+    struct FieldNode { int64_t length, null_count; };
+    // one entry per dictionary column: every value sent so far
+    struct Dictionary {
+        vector<string> values;
+        unordered_map<string, int32_t> ids;
+        size_t sent = 0;
+    };
+
+    bool write_schema(uint64_t clk_tck, string &why) {
+        struct Column { const char *name; int type; int bits; bool is_signed; int dict; };
+        static const Column all[COLUMNS + ROLLUP_COLUMNS] = {
+            {"time", TYPE_TIMESTAMP, 0, false, -1}, {"pid", TYPE_INT, 32, true, -1},
+            {"name", TYPE_UTF8, 0, false, 0}, {"user", TYPE_UTF8, 0, false, 1},
+            {"uid", TYPE_INT, 32, false, -1}, {"cpu", TYPE_FLOAT, 0, false, -1},
+            {"rss_kb", TYPE_INT, 32, false, -1}, {"starttime", TYPE_INT, 64, false, -1},
+            {"total_time", TYPE_INT, 64, false, -1}, {"last_cpu", TYPE_INT, 16, true, -1},
+            {"cpu_min", TYPE_FLOAT, 0, false, -1}, {"cpu_max", TYPE_FLOAT, 0, false, -1},
+            {"rss_min_kb", TYPE_INT, 32, false, -1}, {"rss_max_kb", TYPE_INT, 32, false, -1},
+            {"samples", TYPE_INT, 32, false, -1},
+        };
+        fb.clear();
+        auto int_type = [&](int bits, bool is_signed) {
+            fb.start();
+            fb.add<int32_t>(0, bits);
+            fb.add<uint8_t>(1, is_signed);
+            return fb.end();
+        };
+        vector<uint32_t> fields;
+        for (int i = 0; i < columns; ++i) {
+            const Column &col = all[i];
+            uint32_t name = fb.string_(col.name), type;
+            if (col.type == TYPE_INT) type = int_type(col.bits, col.is_signed);
+            else if (col.type == TYPE_FLOAT) {
+                fb.start();
+                fb.add<int16_t>(0, 1); // single precision
+                type = fb.end();
+            } else if (col.type == TYPE_TIMESTAMP) {
+                uint32_t tz = fb.string_("UTC");
+                fb.start();
+                fb.add<int16_t>(0, 1); // milliseconds
+                fb.add_offset(1, tz);
+                type = fb.end();
+            } else {
+                fb.start();
+                type = fb.end();
+            }
+            uint32_t dict = 0;
+            if (col.dict >= 0) {
+                uint32_t index_type = int_type(32, true);
+                fb.start();
+                fb.add<int64_t>(0, col.dict);
+                fb.add_offset(1, index_type);
+                dict = fb.end();
+            }
+            uint32_t children = fb.offsets({});
+            fb.start();
+            fb.add_offset(0, name);
+            fb.add<uint8_t>(1, 0); // not nullable
+            fb.add<uint8_t>(2, (uint8_t)col.type);
+            fb.add_offset(3, type);
+            if (dict) fb.add_offset(4, dict);
+            fb.add_offset(5, children);
+            fields.push_back(fb.end());
+        }
+        // starttime and total_time are in clock ticks
+        uint32_t key = fb.string_("clk_tck"), value = fb.string_(to_string(clk_tck));
+        fb.start();
+        fb.add_offset(0, key);
+        fb.add_offset(1, value);
+        uint32_t meta = fb.offsets({fb.end()});
+        uint32_t field_vec = fb.offsets(fields);
+        fb.start();
+        fb.add_offset(1, field_vec);
+        fb.add_offset(2, meta);
+        uint32_t schema = fb.end();
+        body.clear();
+        return write_message(MSG_SCHEMA, schema, why);
+    }
+
+    // Maps the sample's dictionary ids onto the stream's, adding new values.
+    // Returns the sample's own index column when the ids agree.
+    const int32_t *translate(Dictionary &d, const vector<string> &values, const vector<uint32_t> &idx, vector<int32_t> &out, string &why) {
+        vector<int32_t> &ids = scratch_ids;
+        ids.resize(values.size());
+        bool same = true;
+        for (size_t k = 0; k < values.size(); ++k) {
+            ids[k] = add_value(d, values[k]);
+            if (ids[k] < 0) { why = "too many distinct values"; return nullptr; }
+            same = same && ids[k] == (int32_t)k;
+        }
+        // indices are below 2^31, so the uint32 column reads as int32
+        if (same) return (const int32_t*)idx.data();
+        out.resize(idx.size());
+        for (size_t i = 0; i < idx.size(); ++i) out[i] = ids[idx[i]];
+        return out.data();
+    }
+
+    int32_t add_value(Dictionary &d, const string &v) {
+        auto it = d.ids.emplace(v, (int32_t)d.values.size());
+        if (it.second) {
+            if (d.values.size() >= (size_t)INT32_MAX) { d.ids.erase(it.first); return -1; }
+            d.values.push_back(v);
+        }
+        return it.first->second;
+    }
+
+    // sends the values added since the last dictionary batch
+    bool flush_dictionary(int id, Dictionary &d, string &why) {
+        if (d.sent == d.values.size()) return true;
+        size_t n = d.values.size() - d.sent;
+        dict_offsets.resize(n + 1);
+        dict_data.clear();
+        dict_offsets[0] = 0;
+        for (size_t k = 0; k < n; ++k) {
+            dict_data += d.values[d.sent + k];
+            dict_offsets[k + 1] = (int32_t)dict_data.size();
+        }
+        body.clear();
+        body.push_back({nullptr, 0}); // validity: no nulls
+        body.push_back({dict_offsets.data(), (n + 1) * 4});
+        body.push_back({dict_data.data(), dict_data.size()});
+        if (!write_batch(MSG_DICTIONARY_BATCH, id, d.sent > 0, n, 1, why)) return false;
+        d.sent = d.values.size();
+        return true;
+    }
+
+    // a validity bitmap (always empty, nothing is null) and a value buffer
+    void add_buffer(const void *p, size_t len) {
+        body.push_back({nullptr, 0});
+        body.push_back({p, len});
+    }
+
+    // a record batch of the buffers in body, or a dictionary batch wrapping one
+    bool write_batch(int msg, int64_t dict_id, bool delta, size_t n, int columns, string &why) {
+        vector<FieldNode> nodes(columns, FieldNode{(int64_t)n, 0});
+        vector<int64_t> spans; // offset, length pairs
+        int64_t at = 0;
+        for (auto &b : body) {
+            spans.push_back(at);
+            spans.push_back((int64_t)b.len);
+            at += (int64_t)((b.len + 7) & ~(size_t)7);
+        }
+        fb.clear();
+        uint32_t buffers = fb.vector_(spans.data(), spans.size() / 2, 16, 8);
+        uint32_t node_vec = fb.vector_(nodes.data(), nodes.size(), sizeof(FieldNode), 8);
+        fb.start();
+        fb.add<int64_t>(0, (int64_t)n);
+        fb.add_offset(1, node_vec);
+        fb.add_offset(2, buffers);
+        uint32_t header = fb.end();
+        if (msg == MSG_DICTIONARY_BATCH) {
+            fb.start();
+            fb.add<int64_t>(0, dict_id);
+            fb.add_offset(1, header);
+            fb.add<uint8_t>(2, delta);
+            header = fb.end();
+        }
+        return write_message(msg, header, why);
+    }
+
+    // the message header, then the buffers in body, each padded to 8 bytes
+    bool write_message(int msg, uint32_t header, string &why) {
+        uint64_t body_len = 0;
+        for (auto &b : body) body_len += (b.len + 7) & ~(size_t)7;
+        fb.start();
+        fb.add<int16_t>(0, 4); // metadata version V5
+        fb.add<uint8_t>(1, (uint8_t)msg);
+        fb.add_offset(2, header);
+        fb.add<int64_t>(3, (int64_t)body_len);
+        pair<const char*, size_t> meta = fb.finish(fb.end());
+        static const char zeros[8] = {0};
+        prefix[0] = 0xffffffffu;
+        prefix[1] = (uint32_t)meta.second;
+        iov.clear();
+        iov.push_back({prefix, sizeof(prefix)});
+        iov.push_back({(void*)meta.first, meta.second});
+        for (auto &b : body) {
+            if (b.len) iov.push_back({(void*)b.p, b.len});
+            if (b.len % 8) iov.push_back({(void*)zeros, 8 - b.len % 8});
+        }
+        return write_all(iov.data(), iov.size(), why);
+    }
+
+    bool write_all(iovec *v, size_t count, string &why) {
+        while (count > 0) {
+            ssize_t n = writev(fd, v, (int)min<size_t>(count, IOV_MAX));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) { why = string("write: ") + strerror(errno); return false; }
+            bytes += (uint64_t)n;
+            while (count > 0 && (size_t)n >= v->iov_len) {
+                n -= (ssize_t)v->iov_len;
+                ++v;
+                --count;
+            }
+            if (count > 0) {
+                v->iov_base = (char*)v->iov_base + n;
+                v->iov_len -= (size_t)n;
+            }
+        }
+        return true;
+    }
+
+    int fd = -1;
+    int columns = COLUMNS;
+    FlatBuilder fb;
+    Dictionary name_dict, user_dict;
+    vector<int32_t> name_map, user_map; // translated index columns
+    vector<int32_t> scratch_ids;
+    vector<BufferRef> body;
+    vector<iovec> iov;
+    uint32_t prefix[2];
+    vector<int32_t> dict_offsets;
+    string dict_data;
+};
+
+// Writes samples of a recording (the first to the last, or --from/--to) as an
+// Arrow stream. A first pass collects every name and user, so the stream
+// carries each dictionary once, as readers without delta support need;
+// samples are then gathered into record batches of at least 64K rows.
+int arrow_recording(const string &out, const string &recording, const string &from, const string &to, uint64_t resolution_ms, Query &query) {
+    string path = pick_tier(recording, resolution_ms, from);
+    RecordingReader rec;
+    string why;
+    if (!rec.open(path, why)) { fprintf(stderr, "%s\n", why.c_str()); return 1; }
+    if (rec.size() < 1) { fprintf(stderr, "%s has no samples\n", path.c_str()); return 1; }
+    long a = pick_sample(rec, from, 0), b = pick_sample(rec, to, (long)rec.size() - 1);
+    if (a < 0 || b < 0) { fprintf(stderr, "no sample at %s\n", (a < 0 ? from : to).c_str()); return 1; }
+    auto t0 = steady_clock::now();
+    ArrowWriter w;
+    bool rollups = rec.header().tier_ms > 0;
+    if (!w.open(out, rec.header().clk_tck, rollups, why)) { fprintf(stderr, "%s\n", why.c_str()); return 1; }
+    UserCache users;
+    {
+        vector<string> names, user_names;
+        set<string> seen_names;
+        set<uint32_t> seen_uids;
+        for (long i = a; i <= b; ++i) {
+            shared_ptr<const vector<ProcInfo>> procs = rec.procs((size_t)i);
+            users.resolve(*procs);
+            for (auto &p : *procs) {
+                if (seen_names.insert(p.name).second) names.push_back(p.name);
+                if (seen_uids.insert(p.uid).second) user_names.push_back(user_name(users.names, p.uid));
+            }
+        }
+        w.seed(names, user_names);
+    }
+    const size_t BATCH_ROWS = 65536;
+    long long boot_time = read_boot_time();
+    vector<ProcInfo> batch;
+    vector<int64_t> times;
+    RollupColumns extra;
+    bool ok = true;
+    auto flush = [&]() {
+        if (!batch.empty()) ok = w.write(times, *build_columns(batch), users.names, &extra, why);
+        batch.clear();
+        times.clear();
+        extra.clear();
+    };
+    for (long i = a; i <= b && ok; ++i) {
+        shared_ptr<const vector<ProcInfo>> procs = rec.procs((size_t)i);
+        RecordSample rs = rec.sample((size_t)i);
+        QueryContext ctx{&users.names, rs.mem_total_kb, boot_time, (time_t)(rs.time_ms / 1000)};
+        vector<uint64_t> sel;
+        if (!query.empty()) query.select(*build_columns(*procs), ctx, sel);
+        const RollupProc *rows = rollups ? rec.rollups((size_t)i) : nullptr;
+        for (size_t k = 0; k < procs->size(); ++k) {
+            if (!sel.empty() && !(sel[k / 64] >> (k % 64) & 1)) continue;
+            batch.push_back((*procs)[k]);
+            if (rows) extra.add(rows[k]);
+        }
+        times.resize(batch.size(), (int64_t)rs.time_ms);
+        if (batch.size() >= BATCH_ROWS) flush();
+    }
+    if (ok) flush();
+    if (ok) ok = w.finish(why);
+    if (!ok) { fprintf(stderr, "%s: %s\n", out.c_str(), why.c_str()); return 1; }
+    fprintf(stderr, "%s: %ld samples, %zu rows in %zu batches, %.1f MB in %.0f ms\n", path.c_str(), b - a + 1, w.rows, w.batches, w.bytes / 1048576.0,
+            duration<double, milli>(steady_clock::now() - t0).count());
+    return 0;
+}
+
+// Writes each of the next samples that have CPU% as an Arrow record batch.
+// Without a filter the frame's own columns are written; with one, the
+// matching rows are gathered into new columns.
+int arrow_output(Sampler &sampler, int reader, const string &out, Query &query, int samples) {
+    ArrowWriter w;
+    string why;
+    if (!w.open(out, (uint64_t)sysconf(_SC_CLK_TCK), false, why)) { fprintf(stderr, "%s\n", why.c_str()); return 1; }
+    long long boot_time = read_boot_time();
+    uint64_t written_seq = 0;
+    vector<uint64_t> sel;
+    vector<ProcInfo> kept;
+    vector<int64_t> times;
+    bool ok = true;
+    while (samples > 0 && ok) {
+        struct pollfd pfd = {sampler.wake_fd(), POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        char drain[64];
+        while (read(sampler.wake_fd(), drain, sizeof(drain)) > 0) {}
+        auto frame = sampler.frames.read(reader);
+        const Frame *f = frame.get();
+        if (!f || !f->procs || !f->columns || !f->procs_cpu_valid || f->procs_seq == written_seq) continue;
+        written_seq = f->procs_seq;
+        shared_ptr<const ProcColumns> cols = f->columns->shared();
+        if (!query.empty()) {
+            QueryContext ctx{f->users.get(), f->mem_total_kb, boot_time, time(nullptr)};
+            query.select(*cols, ctx, sel);
+            kept.clear();
+            for (size_t i = 0; i < f->procs->size(); ++i) if (sel[i / 64] >> (i % 64) & 1) kept.push_back((*f->procs)[i]);
+            cols = build_columns(kept);
+        }
+        times.assign(cols->rows, (int64_t)f->procs_time_ms);
+        ok = w.write(times, *cols, *f->users, nullptr, why);
+        samples--;
+    }
+    if (ok) ok = w.finish(why);
+    if (!ok) { fprintf(stderr, "%s: %s\n", out.c_str(), why.c_str()); return 1; }
+    return 0;
+}
+
+// Appends s as a JSON string. Bytes outside ASCII are escaped one by one, so
+// the output stays valid JSON whatever a process named itself.
+void json_string(string &out, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+        else if (c >= 32 && c < 127) out += (char)c;
+        else { out += "\\u00"; out += hex[c >> 4]; out += hex[c & 15]; }
+    }
+    out += '"';
+}
+
+// The listed processes of a frame as one JSON object.
+void procs_json(string &out, const Frame &f, const vector<uint32_t> &order, size_t limit, long long boot_time, time_t now) {
+    static const long hz = max(1L, sysconf(_SC_CLK_TCK));
+    const vector<ProcInfo> &procs = *f.procs;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"time\":%lld,\"cpu\":%.2f,\"mem_total_kb\":%llu,\"mem_available_kb\":%llu,\"processes\":%zu,\"matched\":%zu,\"procs\":[",
+             (long long)now, max(0.0, f.total_cpu_percent), f.mem_total_kb, f.mem_available_kb, procs.size(), order.size());
+    out += buf;
+    size_t n = min(limit, order.size());
+    for (size_t i = 0; i < n; ++i) {
+        const ProcInfo &p = procs[order[i]];
+        double mem = f.mem_total_kb ? 100.0 * p.mem_kb / (double)f.mem_total_kb : 0.0;
+        snprintf(buf, sizeof(buf), "%s{\"pid\":%d,\"name\":", i ? "," : "", p.pid);
+        out += buf;
+        json_string(out, p.name);
+        out += ",\"user\":";
+        json_string(out, user_name(*f.users, p.uid));
+        snprintf(buf, sizeof(buf), ",\"uid\":%lld,\"cpu\":%.2f,\"rss_kb\":%u,\"mem\":%.2f,\"start\":%lld,\"last_cpu\":%d}",
+                 p.uid == (uint32_t)-1 ? -1LL : (long long)p.uid, p.cpu_percent, p.mem_kb, mem,
+                 boot_time + (long long)(p.starttime / (uint64_t)hz), p.last_cpu);
+        out += buf;
+    }
+    out += "]}";
+}
+
+// A small HTTP/1.1 server on one epoll loop, for dashboards:
+//   GET /procs?filter=EXPR&sort=cpu|mem|pid&top=N  the last sample as JSON
+//   GET /stream?...                                 the same as Server-Sent
+//                                                   Events, one per sample
+// Sockets are non-blocking. Each distinct query is serialized once per
+// sample and the buffer is shared by every client asking for it. A stream
+// client that cannot keep up skips samples instead of queueing them.
+class HttpServer {
+public:
+    static const size_t MAX_CLIENTS = 256;
+    static const size_t MAX_REQUEST = 16384;
+
+    ~HttpServer() {
+        for (auto &c : clients) close(c.first);
+        if (listen_fd >= 0) close(listen_fd);
+        if (epfd >= 0) close(epfd);
+    }
+
+    // [ADDR:]PORT, on 127.0.0.1 unless an address is given
+    bool open(const string &spec, string &why) {
+        string addr = "127.0.0.1", port = spec;
+        size_t colon = spec.rfind(':');
+        if (colon != string::npos) {
+            addr = spec.substr(0, colon);
+            port = spec.substr(colon + 1);
+        }
+        struct sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((uint16_t)atoi(port.c_str()));
+        if (atoi(port.c_str()) <= 0 || atoi(port.c_str()) > 65535 || inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1) {
+            why = "expected [ADDR:]PORT";
+            return false;
+        }
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(listen_fd, 64) != 0) {
+            why = strerror(errno);
+            return false;
+        }
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) { why = strerror(errno); return false; }
+        watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+        return true;
+    }
+
+    // Serves until SIGINT or SIGTERM, which the caller has blocked in every
+    // thread. base_filter applies to every request on top of its own.
+    int run(Sampler &sampler, int reader, const string &base_filter) {
+        base = base_filter;
+        sigset_t stop_signals;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        int sigfd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (sigfd >= 0) watch(sigfd, EPOLLIN, EPOLL_CTL_ADD);
+        if (sampler.wake_fd() >= 0) watch(sampler.wake_fd(), EPOLLIN, EPOLL_CTL_ADD);
+        boot_time = read_boot_time();
+        bool running = true;
+        struct epoll_event events[64];
+        while (running) {
+            int n = epoll_wait(epfd, events, 64, 1000);
+            if (n < 0 && errno != EINTR) break;
+            bool woken = n == 0; // a missed wake-up costs at most a second
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == sigfd) running = false;
+                else if (fd == listen_fd) accept_clients();
+                else if (fd == sampler.wake_fd()) woken = true;
+                else if (clients.count(fd)) serve(fd, events[i].events);
+            }
+            if (woken) {
+                char drain[64];
+                while (read(sampler.wake_fd(), drain, sizeof(drain)) > 0) {}
+                auto frame = sampler.frames.read(reader);
+                const Frame *f = frame.get();
+                // only complete samples with CPU% are served
+                if (f && f->procs && f->columns && f->procs_cpu_valid && f->procs_seq != served_seq) {
+                    served_seq = f->procs_seq;
+                    current.reset(new Frame(*f));
+                    bodies.clear();
+                    events_cache.clear();
+                    push_stream_events();
+                }
+            }
+        }
+        if (sigfd >= 0) close(sigfd);
+        return 0;
+    }
+
+private:
+    struct Pending {
+        shared_ptr<const string> buf;
+        size_t sent = 0;
+        bool droppable = false; // a stream event a newer one may replace
+    };
+    struct Client {
+        string in;
+        deque<Pending> out;
+        uint32_t events = EPOLLIN | EPOLLRDHUP; // as registered with epoll
+        bool eof = false; // the peer shut down its side
+        bool close_after = false;
+        bool stream = false;
+        string key; // stream: normalized query it follows
+    };
+    // a parsed /procs or /stream query
+    struct View {
+        Query query;
+        SortMode sort = SORT_CPU;
+        size_t top = SIZE_MAX;
+        string key;
+    };
+
+    void watch(int fd, uint32_t events, int op) {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, op, fd, &ev);
+    }
+
+    void accept_clients() {
+        for (;;) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            if (clients.size() >= MAX_CLIENTS) { close(fd); continue; }
+            clients[fd] = Client();
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+        }
+    }
+
+    void drop(int fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        clients.erase(fd);
+    }
+
+    void serve(int fd, uint32_t events) {
+        Client &c = clients[fd];
+        if (events & (EPOLLERR | EPOLLHUP)) return drop(fd);
+        if (events & EPOLLIN) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                // a stream client has nothing more to say
+                if (!c.stream) c.in.append(buf, (size_t)n);
+            }
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                // the peer is done sending; answer what it asked, then close
+                c.eof = true;
+                c.close_after = true;
+                if (c.in.find("\r\n\r\n") == string::npos && c.out.empty()) return drop(fd);
+            }
+            size_t end;
+            while (!c.stream && (end = c.in.find("\r\n\r\n")) != string::npos) {
+                string request = c.in.substr(0, end);
+                c.in.erase(0, end + 4);
+                handle(c, request);
+            }
+            if (c.in.size() > MAX_REQUEST) {
+                c.in.clear();
+                c.close_after = true;
+                respond(c, 431, "text/plain", make_shared<const string>("request too large\n"));
+            }
+        }
+        flush(fd);
+    }
+
+    // Sends what is queued until the socket is full; then waits for EPOLLOUT.
+    void flush(int fd) {
+        Client &c = clients[fd];
+        while (!c.out.empty()) {
+            struct iovec iov[16];
+            int n = 0;
+            for (auto it = c.out.begin(); it != c.out.end() && n < 16; ++it, ++n) {
+                iov[n].iov_base = (void*)(it->buf->data() + it->sent);
+                iov[n].iov_len = it->buf->size() - it->sent;
+            }
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)n;
+            ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (sent < 0) return drop(fd);
+            size_t left = (size_t)sent;
+            while (left > 0 && !c.out.empty()) {
+                Pending &p = c.out.front();
+                size_t rest = p.buf->size() - p.sent;
+                if (left < rest) { p.sent += left; left = 0; }
+                else { left -= rest; c.out.pop_front(); }
+            }
+        }
+        if (c.out.empty() && c.close_after) return drop(fd);
+        // after EOF, level-triggered EPOLLIN and EPOLLRDHUP would fire on
+        // every wait until the reply is out, so only EPOLLOUT stays
+        uint32_t events = (c.eof ? 0u : (uint32_t)(EPOLLIN | EPOLLRDHUP)) | (c.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+        if (events != c.events) {
+            c.events = events;
+            watch(fd, events, EPOLL_CTL_MOD);
+        }
+    }
+
+    static string url_decode(const string &s) {
+        string out;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '+') out += ' ';
+            else if (s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2])) {
+                out += (char)stoi(s.substr(i + 1, 2), nullptr, 16);
+                i += 2;
+            } else out += s[i];
+        }
+        return out;
+    }
+
+    bool parse_view(const string &query_string, View &v, string &why) {
+        string filter, sort = "cpu", top;
+        size_t at = 0;
+        while (at <= query_string.size()) {
+            size_t amp = query_string.find('&', at);
+            if (amp == string::npos) amp = query_string.size();
+            string pair = query_string.substr(at, amp - at);
+            size_t eq = pair.find('=');
+            string k = url_decode(pair.substr(0, eq)), val = eq == string::npos ? string() : url_decode(pair.substr(eq + 1));
+            if (k == "filter") filter = val;
+            else if (k == "sort") sort = val;
+            else if (k == "top") top = val;
+            at = amp + 1;
+        }
+        if (sort == "cpu") v.sort = SORT_CPU;
+        else if (sort == "mem") v.sort = SORT_MEM;
+        else if (sort == "pid") v.sort = SORT_PID;
+        else { why = "sort must be cpu, mem or pid"; return false; }
+        if (!top.empty()) {
+            char *end = nullptr;
+            long n = strtol(top.c_str(), &end, 10);
+            if (*end || n < 0) { why = "top must be a number"; return false; }
+            v.top = (size_t)n;
+        }
+        // checked on its own first, so errors point into what was sent
+        if (!v.query.compile(filter, why)) return false;
+        string text = filter;
+        if (!base.empty()) text = filter.empty() ? base : "(" + base + ") and (" + filter + ")";
+        if (text != filter && !v.query.compile(text, why)) return false;
+        v.key = text + '\n' + sort + '\n' + to_string(v.top);
+        return true;
+    }
+
+    // the JSON of the current frame under a view, built once per sample
+    shared_ptr<const string> body_for(View &v) {
+        auto it = bodies.find(v.key);
+        if (it != bodies.end()) return it->second;
+        const vector<ProcInfo> &procs = *current->procs;
+        time_t now = time(nullptr);
+        if (!v.query.empty()) {
+            QueryContext ctx{current->users.get(), current->mem_total_kb, boot_time, now};
+            v.query.select(current->columns->get(), ctx, sel);
+        }
+        sort_order(procs, order, v.sort, v.query.empty() ? nullptr : &sel);
+        auto body = make_shared<string>();
+        body->reserve(128 + min(v.top, order.size()) * 128);
+        procs_json(*body, *current, order, v.top, boot_time, now);
+        bodies[v.key] = body;
+        return body;
+    }
+
+    shared_ptr<const string> event_for(View &v) {
+        auto it = events_cache.find(v.key);
+        if (it != events_cache.end()) return it->second;
+        shared_ptr<const string> body = body_for(v);
+        auto ev = make_shared<string>();
+        ev->reserve(body->size() + 40);
+        *ev += "id: " + to_string(served_seq) + "\ndata: ";
+        *ev += *body;
+        *ev += "\n\n";
+        events_cache[v.key] = ev;
+        return ev;
+    }
+
+    void respond(Client &c, int status, const char *type, shared_ptr<const string> body) {
+        const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found" :
+                             status == 405 ? "Method Not Allowed" : status == 431 ? "Request Header Fields Too Large" : "Service Unavailable";
+        char head[256];
+        snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nCache-Control: no-store\r\n%s%s\r\n",
+                 status, reason, type, body->size(), status == 503 ? "Retry-After: 1\r\n" : "", c.close_after ? "Connection: close\r\n" : "");
+        c.out.push_back(Pending{make_shared<const string>(head), 0, false});
+        c.out.push_back(Pending{std::move(body), 0, false});
+    }
+
+    void respond_error(Client &c, int status, const string &message) {
+        string body = "{\"error\":";
+        json_string(body, message.c_str());
+        body += "}\n";
+        respond(c, status, "application/json", make_shared<const string>(std::move(body)));
+    }
+
+    void handle(Client &c, const string &request) {
+        size_t sp1 = request.find(' '), sp2 = request.find(' ', sp1 + 1);
+        size_t eol = request.find("\r\n");
+        if (sp1 == string::npos || sp2 == string::npos || sp2 > eol) {
+            c.close_after = true;
+            return respond_error(c, 400, "malformed request");
+        }
+        string method = request.substr(0, sp1), target = request.substr(sp1 + 1, sp2 - sp1 - 1);
+        string version = request.substr(sp2 + 1, eol == string::npos ? string::npos : eol - sp2 - 1);
+        string headers = request.substr(eol == string::npos ? request.size() : eol);
+        for (auto &ch : headers) ch = (char)tolower((unsigned char)ch);
+        if (version != "HTTP/1.1" || headers.find("\r\nconnection: close") != string::npos) c.close_after = true;
+        if (method != "GET") return respond_error(c, 405, "only GET is supported");
+        size_t q = target.find('?');
+        string path = target.substr(0, q), query_string = q == string::npos ? string() : target.substr(q + 1);
+        if (path == "/") {
+            static const auto index = make_shared<const string>(
+                "GET /procs?filter=EXPR&sort=cpu|mem|pid&top=N   last sample as JSON\n"
+                "GET /stream?filter=EXPR&sort=cpu|mem|pid&top=N  one Server-Sent Event per sample\n");
+            return respond(c, 200, "text/plain", index);
+        }
+        if (path != "/procs" && path != "/stream") return respond_error(c, 404, "no such endpoint: " + path);
+        View v;
+        string why;
+        if (!parse_view(query_string, v, why)) return respond_error(c, 400, why);
+        if (path == "/procs") {
+            if (!current) return respond_error(c, 503, "no sample yet");
+            return respond(c, 200, "application/json", body_for(v));
+        }
+        static const auto stream_head = make_shared<const string>(
+            "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-store\r\nConnection: keep-alive\r\n\r\n");
+        c.stream = true;
+        c.close_after = false;
+        c.key = v.key;
+        c.in.clear();
+        c.out.push_back(Pending{stream_head, 0, false});
+        stream_views[v.key] = std::move(v);
+        if (current) c.out.push_back(Pending{event_for(stream_views[c.key]), 0, true});
+    }
+
+    void push_stream_events() {
+        // views no stream client follows any more are forgotten
+        set<string> live;
+        for (auto &c : clients) if (c.second.stream) live.insert(c.second.key);
+        for (auto it = stream_views.begin(); it != stream_views.end();) {
+            if (live.count(it->first)) ++it;
+            else it = stream_views.erase(it);
+        }
+        vector<int> fds;
+        for (auto &c : clients) if (c.second.stream) fds.push_back(c.first);
+        for (int fd : fds) {
+            Client &c = clients[fd];
+            // a sample not started yet is replaced by the newer one
+            while (!c.out.empty() && c.out.back().droppable && c.out.back().sent == 0) c.out.pop_back();
+            c.out.push_back(Pending{event_for(stream_views[c.key]), 0, true});
+            flush(fd);
+        }
+    }
+
+    int listen_fd = -1, epfd = -1;
+    string base;
+    long long boot_time = 0;
+    map<int, Client> clients;
+    map<string, View> stream_views;
+    unique_ptr<const Frame> current; // the sample being served
+    uint64_t served_seq = 0;
+    map<string, shared_ptr<const string>> bodies, events_cache; // for current, by view
+    vector<uint64_t> sel;
+    vector<uint32_t> order;
+};
+
+// Protocol buffers wire format, just what the OTLP messages below use.
+// Appends to a caller-owned string, so buffers are reused across calls.
+struct ProtoWriter {
+    string &out;
+    explicit ProtoWriter(string &out) : out(out) {}
+
+    void varint(uint64_t v) {
+        while (v >= 0x80) {
+            out += (char)(v | 0x80);
+            v >>= 7;
+        }
+        out += (char)v;
+    }
+    void tag(uint32_t field, int wire) { varint((uint64_t)field << 3 | (uint32_t)wire); }
+    void uint_field(uint32_t field, uint64_t v) { tag(field, 0); varint(v); }
+    void fixed64(uint32_t field, uint64_t v) {
+        tag(field, 1);
+        char b[8];
+        memcpy(b, &v, 8); // the wire format is little endian, like the hosts sysmon runs on
+        out.append(b, 8);
+    }
+    void double_field(uint32_t field, double v) {
+        uint64_t bits;
+        memcpy(&bits, &v, 8);
+        fixed64(field, bits);
+    }
+    // a string, bytes or an already encoded message
+    void bytes(uint32_t field, const char *p, size_t n) {
+        tag(field, 2);
+        varint(n);
+        out.append(p, n);
+    }
+    void bytes(uint32_t field, const string &s) { bytes(field, s.data(), s.size()); }
+};
+
+// Calls fn(field, wire type, value, data, length) for each field of one
+// message: value for varint and fixed fields, data/length for the others.
+// False if the message is malformed.
+bool proto_walk(const char *p, size_t n, const function<void(uint32_t, int, uint64_t, const char*, size_t)> &fn) {
+    const char *end = p + n;
+    auto varint = [&](uint64_t &v) {
+        v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t b = (uint8_t)*p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    };
+    while (p < end) {
+        uint64_t key, v = 0;
+        if (!varint(key)) return false;
+        int wire = (int)(key & 7);
+        if (wire == 0) {
+            if (!varint(v)) return false;
+            fn((uint32_t)(key >> 3), wire, v, nullptr, 0);
+        } else if (wire == 1 || wire == 5) {
+            size_t len = wire == 1 ? 8 : 4;
+            if ((size_t)(end - p) < len) return false;
+            memcpy(&v, p, len);
+            p += len;
+            fn((uint32_t)(key >> 3), wire, v, nullptr, 0);
+        } else if (wire == 2) {
+            if (!varint(v) || v > (uint64_t)(end - p)) return false;
+            fn((uint32_t)(key >> 3), wire, 0, p, (size_t)v);
+            p += v;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Client side of HTTP/1.1 POST over a kept-alive connection, for exporters on
+// their own thread: calls block, bounded by a timeout.
+class HttpPoster {
+public:
+    ~HttpPoster() { disconnect(); }
+
+    // http://HOST[:PORT][/PATH]; default_path when no path is given
+    bool set_url(const string &url, const string &default_path, uint16_t default_port, string &why) {
+        if (url.rfind("http://", 0) != 0) { why = "only http:// URLs are supported"; return false; }
+        string rest = url.substr(7);
+        size_t slash = rest.find('/');
+        path = slash == string::npos ? default_path : rest.substr(slash);
+        string hostport = rest.substr(0, slash);
+        port = to_string(default_port);
+        host = hostport;
+        size_t colon = hostport.rfind(':');
+        if (colon != string::npos && hostport.find(']', colon) == string::npos) {
+            host = hostport.substr(0, colon);
+            port = hostport.substr(colon + 1);
+        }
+        if (host.size() > 2 && host[0] == '[') host = host.substr(1, host.size() - 2);
+        if (host.empty()) { why = "no host in " + url; return false; }
+        host_header = hostport;
+        return true;
+    }
+
+    // status code of the reply, or -1 with why set if there was none
+    int post(const char *type, const string &body, string &why) {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            bool reused = fd >= 0;
+            if (fd < 0 && !connect_to(why)) return -1;
+            int status = exchange(type, body, why);
+            if (status >= 0) return status;
+            disconnect();
+            // a kept-alive connection may have been closed by the server meanwhile
+            if (!reused) break;
+        }
+        return -1;
+    }
+
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+
+    string url() const { return "http://" + host_header + path; }
+
+private:
+    static const int TIMEOUT_SEC = 5;
+
+    bool connect_to(string &why) {
+        struct addrinfo hints = {}, *res = nullptr;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0) { why = string("cannot resolve ") + host + ": " + gai_strerror(rc); return false; }
+        why = "no address for " + host;
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            // SO_SNDTIMEO bounds connect() too
+            struct timeval tv = {TIMEOUT_SEC, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            why = "connect to " + host + ":" + port + ": " + strerror(errno);
+            disconnect();
+        }
+        freeaddrinfo(res);
+        return fd >= 0;
+    }
+
+    int exchange(const char *type, const string &body, string &why) {
+        char head[512];
+        int n = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                         path.c_str(), host_header.c_str(), type, body.size());
+        struct iovec iov[2] = {{head, (size_t)n}, {(void*)body.data(), body.size()}};
+        size_t total = (size_t)n + body.size(), sent = 0;
+        while (sent < total) {
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+            ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) { why = string("send: ") + strerror(errno); return -1; }
+            sent += (size_t)w;
+            // skip what went out
+            for (auto &v : iov) {
+                size_t step = min(v.iov_len, (size_t)w);
+                v.iov_base = (char*)v.iov_base + step;
+                v.iov_len -= step;
+                w -= (ssize_t)step;
+            }
+        }
+        // the reply: status line and headers, then Content-Length bytes we skip
+        reply.clear();
+        size_t end;
+        char buf[4096];
+        while ((end = reply.find("\r\n\r\n")) == string::npos) {
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { why = r == 0 ? "connection closed" : string("receive: ") + strerror(errno); return -1; }
+            reply.append(buf, (size_t)r);
+            if (reply.size() > 65536) { why = "reply headers too long"; return -1; }
+        }
+        int status = 0;
+        if (sscanf(reply.c_str(), "HTTP/%*d.%*d %d", &status) != 1) { why = "malformed reply"; return -1; }
+        string headers = reply.substr(0, end);
+        for (auto &ch : headers) ch = (char)tolower((unsigned char)ch);
+        size_t cl = headers.find("\r\ncontent-length:");
+        size_t length = cl == string::npos ? 0 : strtoul(headers.c_str() + cl + 17, nullptr, 10);
+        size_t have = reply.size() - end - 4;
+        while (have < length) {
+            ssize_t r = read(fd, buf, min(sizeof(buf), length - have));
+            if (r <= 0) { why = "reply cut short"; return -1; }
+            have += (size_t)r;
+        }
+        // without a length the body runs to the end of the connection
+        if (headers.find("\r\nconnection: close") != string::npos || cl == string::npos) disconnect();
+        why = status / 100 == 2 ? string() : "HTTP " + to_string(status) + reply.substr(reply.find(' '), reply.find('\r') - reply.find(' '));
+        return status;
+    }
+
+    string host, port, path, host_header;
+    int fd = -1;
+    string reply;
+};
+
+// Exports host and top-N process metrics as OTLP/HTTP protobuf
+// (ExportMetricsServiceRequest) on its own thread. Each sample is encoded
+// into per-metric data point buffers as it arrives; every interval these
+// are wrapped into one request and queued. Failed posts are retried with
+// backoff; the queue is bounded in bytes and drops its oldest batches when
+// full. All buffers are kept and reused.
+class OtlpExporter {
+public:
+    size_t top = 20;
+    int interval_ms = 10000;
+    size_t max_queued_bytes = 8 << 20;
+    int backoff_min_ms = 1000, backoff_max_ms = 60000;
+
+    // what the exporter did so far; read from any thread
+    struct Stats {
+        uint64_t samples = 0, batches = 0, sent = 0, retries = 0, dropped = 0;
+        string last_error;
+    };
+
+    ~OtlpExporter() { stop(); }
+
+    bool open(const string &url, const string &filter, string &why) {
+        if (!poster.set_url(url, "/v1/metrics", 4318, why)) return false;
+        if (!query.compile(filter, why)) return false;
+        char name[256] = {};
+        gethostname(name, sizeof(name) - 1);
+        hostname = name;
+        boot_time = read_boot_time();
+        return true;
+    }
+
+    void start(Sampler &sampler) {
+        frames = &sampler.frames;
+        reader = sampler.frames.register_reader();
+        wake = sampler.add_wake_fd();
+        if (pipe2(stop_pipe, O_CLOEXEC) != 0) stop_pipe[0] = stop_pipe[1] = -1;
+        worker = thread([this]{ loop(); });
+    }
+    // sends what is still buffered, once, and returns
+    void stop() {
+        if (!worker.joinable()) return;
+        if (write(stop_pipe[1], "", 1) < 0) {}
+        worker.join();
+        frames->unregister_reader(reader);
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+
+    Stats stats() {
+        lock_guard<mutex> lk(stats_mtx);
+        return st;
+    }
+
+    // Encodes one sample's data points. now_ns is the sample's wall time.
+    void add_sample(const Frame &f, uint64_t now_ns) {
+        static const double hz = (double)max(1L, sysconf(_SC_CLK_TCK));
+        const vector<ProcInfo> &procs = *f.procs;
+        if (!query.empty()) {
+            QueryContext ctx{f.users.get(), f.mem_total_kb, boot_time, (time_t)(now_ns / 1000000000ULL)};
+            query.select(f.columns->get(), ctx, sel);
+        }
+        sort_order(procs, order, SORT_CPU, query.empty() ? nullptr : &sel);
+        if (f.total_cpu_percent >= 0) add_point(M_HOST_CPU, nullptr, 0, now_ns, f.total_cpu_percent / 100.0);
+        if (f.mem_total_kb) {
+            attrs.clear();
+            string_attr(attrs, "system.memory.state", "used", 7);
+            add_point(M_HOST_MEM, &attrs, 0, now_ns, (double)(f.mem_total_kb - f.mem_available_kb) * 1024.0);
+            add_point(M_HOST_MEM_LIMIT, nullptr, 0, now_ns, (double)f.mem_total_kb * 1024.0);
+        }
+        for (size_t i = 0; i < min(top, order.size()); ++i) {
+            const ProcInfo &p = procs[order[i]];
+            attrs.clear();
+            int_attr(attrs, "process.pid", p.pid, 7);
+            string_attr(attrs, "process.executable.name", p.name, 7);
+            string_attr(attrs, "process.owner", user_name(*f.users, p.uid), 7);
+            uint64_t start_ns = (uint64_t)(boot_time * 1e9 + (double)p.starttime / hz * 1e9);
+            add_point(M_PROC_CPU, &attrs, 0, now_ns, p.cpu_percent / 100.0);
+            add_point(M_PROC_MEM, &attrs, 0, now_ns, (double)p.mem_kb * 1024.0);
+            add_point(M_PROC_TIME, &attrs, start_ns, now_ns, (double)p.total_time / hz);
+        }
+        samples_in_batch++;
+        lock_guard<mutex> lk(stats_mtx);
+        st.samples++;
+    }
+
+    // Wraps the data points gathered so far into one request and queues it.
+    void end_batch() {
+        if (!samples_in_batch) return;
+        samples_in_batch = 0;
+        string batch = spare.empty() ? string() : std::move(spare.back());
+        if (!spare.empty()) spare.pop_back();
+        batch.clear();
+        // innermost first: metrics, then scope, resource and request
+        scope_buf.clear();
+        ProtoWriter scope(scope_buf);
+        msg.clear();
+        ProtoWriter sc(msg);
+        sc.bytes(1, "sysmon", 6);
+        scope.bytes(1, msg); // InstrumentationScope
+        for (int m = 0; m < M_COUNT; ++m) {
+            if (points[m].empty()) continue;
+            const MetricDef &d = METRICS[m];
+            msg.clear();
+            ProtoWriter mw(msg);
+            mw.bytes(1, d.name, strlen(d.name));
+            mw.bytes(2, d.description, strlen(d.description));
+            mw.bytes(3, d.unit, strlen(d.unit));
+            data.clear();
+            data += points[m]; // repeated NumberDataPoint data_points = 1
+            ProtoWriter dw(data);
+            if (d.sum) {
+                dw.uint_field(2, 2); // AGGREGATION_TEMPORALITY_CUMULATIVE
+                dw.uint_field(3, 1); // is_monotonic
+            }
+            mw.bytes(d.sum ? 7 : 5, data); // Sum or Gauge
+            scope.bytes(2, msg); // Metric
+            points[m].clear();
+        }
+        resource_buf.clear();
+        ProtoWriter res(resource_buf);
+        msg.clear();
+        string_attr(msg, "service.name", "sysmon", 1);
+        string_attr(msg, "host.name", hostname.c_str(), 1);
+        res.bytes(1, msg); // Resource
+        res.bytes(2, scope_buf); // ScopeMetrics
+        ProtoWriter req(batch);
+        req.bytes(1, resource_buf); // ResourceMetrics
+        queued_bytes += batch.size();
+        queue.push_back(std::move(batch));
+        size_t dropped = 0;
+        while (queued_bytes > max_queued_bytes && queue.size() > 1) {
+            pop_queued();
+            dropped++;
+        }
+        lock_guard<mutex> lk(stats_mtx);
+        st.batches++;
+        st.dropped += dropped;
+    }
+
+    // Posts queued batches, oldest first, until one fails; a failure other
+    // than a rejected request waits out a backoff before the next try.
+    void send_queued(steady_clock::time_point now) {
+        while (!queue.empty() && now >= retry_at) {
+            string why;
+            int status = poster.post("application/x-protobuf", queue.front(), why);
+            bool done = status / 100 == 2;
+            // the collector will never take these; retrying would not help
+            bool rejected = status / 100 == 4 && status != 429 && status != 408;
+            lock_guard<mutex> lk(stats_mtx);
+            if (done || rejected) {
+                pop_queued();
+                backoff_ms = 0;
+                if (done) st.sent++;
+                else st.dropped++;
+                st.last_error = why;
+                continue;
+            }
+            st.retries++;
+            st.last_error = why;
+            backoff_ms = backoff_ms ? min(backoff_max_ms, backoff_ms * 2) : backoff_min_ms;
+            retry_at = now + milliseconds(backoff_ms);
+        }
+    }
+
+    size_t queued() const { return queue.size(); }
+    size_t queued_size() const { return queued_bytes; }
+    string url() const { return poster.url(); }
+
+private:
+    enum MetricId { M_HOST_CPU, M_HOST_MEM, M_HOST_MEM_LIMIT, M_PROC_CPU, M_PROC_MEM, M_PROC_TIME, M_COUNT };
+    struct MetricDef {
+        const char *name, *description, *unit;
+        bool sum;
+    };
+    static constexpr MetricDef METRICS[M_COUNT] = {
+        {"system.cpu.utilization", "Busy share of all CPUs", "1", false},
+        {"system.memory.usage", "Memory in use", "By", false},
+        {"system.memory.limit", "Total memory", "By", false},
+        {"process.cpu.utilization", "Share of all CPUs used by the process", "1", false},
+        {"process.memory.usage", "Resident set size", "By", false},
+        {"process.cpu.time", "CPU time used by the process", "s", true},
+    };
+
+    // a KeyValue with a string or int AnyValue, as the given repeated field
+    void string_attr(string &out, const char *key, const char *value, uint32_t field) {
+        kv.clear();
+        ProtoWriter w(kv);
+        w.bytes(1, key, strlen(key));
+        any.clear();
+        ProtoWriter a(any);
+        a.bytes(1, value, strlen(value));
+        w.bytes(2, any);
+        ProtoWriter(out).bytes(field, kv);
+    }
+    void int_attr(string &out, const char *key, int64_t value, uint32_t field) {
+        kv.clear();
+        ProtoWriter w(kv);
+        w.bytes(1, key, strlen(key));
+        any.clear();
+        ProtoWriter(any).uint_field(3, (uint64_t)value);
+        w.bytes(2, any);
+        ProtoWriter(out).bytes(field, kv);
+    }
+
+    // the oldest queued request goes; a few buffers are kept for reuse
+    void pop_queued() {
+        queued_bytes -= queue.front().size();
+        if (spare.size() < 4) spare.push_back(std::move(queue.front()));
+        queue.pop_front();
+    }
+
+    // one NumberDataPoint; attributes are KeyValues already encoded as its
+    // field 7
+    void add_point(int m, const string *attributes, uint64_t start_ns, uint64_t now_ns, double value) {
+        point.clear();
+        ProtoWriter w(point);
+        if (start_ns) w.fixed64(2, start_ns);
+        w.fixed64(3, now_ns);
+        w.double_field(4, value);
+        if (attributes) point += *attributes;
+        ProtoWriter(points[m]).bytes(1, point);
+    }
+
+    void loop() {
+        auto next_batch = steady_clock::now() + milliseconds(interval_ms);
+        uint64_t seen_seq = 0;
+        for (;;) {
+            auto now = steady_clock::now();
+            auto due = queue.empty() ? next_batch : min(next_batch, max(now, retry_at));
+            int wait = (int)max<long long>(0, duration_cast<milliseconds>(due - now).count());
+            struct pollfd pfds[2] = {{stop_pipe[0], POLLIN, 0}, {wake, POLLIN, 0}};
+            poll(pfds, wake >= 0 ? 2 : 1, wait);
+            if (pfds[0].revents & POLLIN) break;
+            char drain[64];
+            while (wake >= 0 && read(wake, drain, sizeof(drain)) > 0) {}
+            {
+                auto frame = frames->read(reader);
+                const Frame *f = frame.get();
+                if (f && f->procs && f->columns && f->procs_cpu_valid && f->procs_seq != seen_seq) {
+                    seen_seq = f->procs_seq;
+                    add_sample(*f, f->procs_time_ms * 1000000);
+                }
+            }
+            now = steady_clock::now();
+            if (now >= next_batch) {
+                end_batch();
+                next_batch = now + milliseconds(interval_ms);
+            }
+            send_queued(now);
+        }
+        end_batch();
+        retry_at = steady_clock::time_point();
+        send_queued(steady_clock::now());
+    }
+
+    HttpPoster poster;
+    Query query; // this thread's own copy: a compiled query is not thread safe
+    string hostname;
+    long long boot_time = 0;
+
+    EpochPublisher<Frame> *frames = nullptr;
+    int reader = -1, wake = -1;
+    int stop_pipe[2] = {-1, -1};
+    thread worker;
+
+    // encoding state, reused from sample to sample
+    vector<uint64_t> sel;
+    vector<uint32_t> order;
+    string points[M_COUNT];
+    string attrs, point, kv, any, msg, data, scope_buf, resource_buf;
+    size_t samples_in_batch = 0;
+
+    deque<string> queue; // encoded requests waiting to be sent
+    vector<string> spare; // sent ones, kept for their capacity
+    size_t queued_bytes = 0;
+    int backoff_ms = 0;
+    steady_clock::time_point retry_at;
+
+    mutex stats_mtx;
+    Stats st;
+};
+
+// A stand-in OTLP collector on a loopback port for --check-otlp: answers the
+// first `failures` requests with 503, the rest with 200, and keeps the bodies
+// it accepted.
+class StubCollector {
+public:
+    int failures = 0;
+    atomic<int> requests{0};
+    vector<string> accepted; // read after stop()
+
+    bool start(string &why) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(sa);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(fd, 4) != 0 ||
+            getsockname(fd, (struct sockaddr*)&sa, &len) != 0) {
+            why = strerror(errno);
+            return false;
+        }
+        port = ntohs(sa.sin_port);
+        worker = thread([this]{ loop(); });
+        return true;
+    }
+    void stop() {
+        quit = true;
+        if (worker.joinable()) worker.join();
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    ~StubCollector() { stop(); }
+    uint16_t port = 0;
+
+private:
+    void loop() {
+        while (!quit) {
+            struct pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, 20) <= 0) continue;
+            int c = accept(fd, nullptr, nullptr);
+            if (c < 0) continue;
+            serve(c);
+            close(c);
+        }
+    }
+    // one connection, kept alive until the client closes it
+    void serve(int c) {
+        string in;
+        char buf[65536];
+        while (!quit) {
+            struct pollfd p = {c, POLLIN, 0};
+            if (poll(&p, 1, 20) <= 0) continue;
+            ssize_t n = read(c, buf, sizeof(buf));
+            if (n <= 0) return;
+            in.append(buf, (size_t)n);
+            size_t end;
+            while ((end = in.find("\r\n\r\n")) != string::npos) {
+                size_t cl = in.find("Content-Length:");
+                size_t length = (cl != string::npos && cl < end) ? strtoul(in.c_str() + cl + 15, nullptr, 10) : 0;
+                if (in.size() < end + 4 + length) break;
+                string body = in.substr(end + 4, length);
+                in.erase(0, end + 4 + length);
+                bool fail = requests++ < failures;
+                if (!fail) accepted.push_back(body);
+                const char *reply = fail ? "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 4\r\n\r\nbusy"
+                                         : "HTTP/1.1 200 OK\r\nContent-Type: application/x-protobuf\r\nContent-Length: 0\r\n\r\n";
+                if (write(c, reply, strlen(reply)) < 0) return;
+            }
+        }
+    }
+
+    int fd = -1;
+    atomic<bool> quit{false};
+    thread worker;
+};
+
+// Runs the OTLP exporter against a stub collector that refuses the first two
+// posts: every batch must arrive once, decode, and carry the expected data
+// points. Then checks that the queue stays within its byte limit and times
+// the encoding.
+int check_otlp() {
+    int failures = 0;
+    auto check = [&](bool ok, const string &what) {
+        printf("%s %s\n", ok ? "PASS" : "FAIL", what.c_str());
+        if (!ok) failures++;
+    };
+    // a synthetic frame of 50 processes
+    vector<ProcInfo> procs(50);
+    for (size_t i = 0; i < procs.size(); ++i) {
+        ProcInfo &p = procs[i];
+        p.pid = 100 + (int)i;
+        p.cpu_percent = (float)(i % 7);
+        p.mem_kb = 1000 * (uint32_t)i;
+        p.total_time = 100 * i;
+        p.starttime = 5000 + i;
+        p.uid = i % 3 ? 1000 : 0;
+        set_comm(p, "proc" + to_string(i));
+    }
+    Frame f;
+    f.procs = make_shared<const vector<ProcInfo>>(procs);
+    f.columns = make_shared<const LazyColumns>(f.procs);
+    UserCache users;
+    users.resolve(*f.procs);
+    f.users = users.shared;
+    f.procs_cpu_valid = true;
+    f.total_cpu_percent = 42.5;
+    f.mem_total_kb = 8 << 20;
+    f.mem_available_kb = 6 << 20;
+
+    StubCollector stub;
+    stub.failures = 2;
+    string why;
+    if (!stub.start(why)) { printf("FAIL stub collector: %s\n", why.c_str()); return 1; }
+    OtlpExporter ex;
+    ex.top = 5;
+    ex.backoff_min_ms = 10;
+    ex.backoff_max_ms = 50;
+    if (!ex.open("http://127.0.0.1:" + to_string(stub.port), "", why)) { printf("FAIL exporter: %s\n", why.c_str()); return 1; }
+    const int BATCHES = 3, PER_BATCH = 2;
+    uint64_t t = 1700000000ULL * 1000000000ULL;
+    for (int b = 0; b < BATCHES; ++b) {
+        for (int s = 0; s < PER_BATCH; ++s) ex.add_sample(f, t += 1000000000ULL);
+        ex.end_batch();
+    }
+    auto deadline = steady_clock::now() + seconds(5);
+    while (ex.queued() && steady_clock::now() < deadline) {
+        ex.send_queued(steady_clock::now());
+        this_thread::sleep_for(milliseconds(5));
+    }
+    stub.stop();
+    OtlpExporter::Stats st = ex.stats();
+    check(st.sent == BATCHES && stub.accepted.size() == BATCHES, "all " + to_string(BATCHES) + " batches delivered (" + to_string(st.sent) + " sent)");
+    check(st.retries == 2 && stub.requests == BATCHES + 2, "two refused posts retried (" + to_string(st.retries) + " retries, " + to_string(stub.requests.load()) + " requests)");
+
+    // request > resource_metrics > scope_metrics > metrics > gauge/sum > data points
+    bool decoded = true;
+    map<string, size_t> points;
+    size_t with_start = 0, attributes = 0;
+    for (const string &body : stub.accepted) {
+        decoded = decoded && proto_walk(body.data(), body.size(), [&](uint32_t f1, int, uint64_t, const char *rm, size_t rn) {
+            if (f1 != 1) return;
+            decoded = decoded && proto_walk(rm, rn, [&](uint32_t f2, int, uint64_t, const char *sm, size_t sn) {
+                if (f2 != 2) return;
+                decoded = decoded && proto_walk(sm, sn, [&](uint32_t f3, int, uint64_t, const char *m, size_t mn) {
+                    if (f3 != 2) return;
+                    string name;
+                    decoded = decoded && proto_walk(m, mn, [&](uint32_t f4, int, uint64_t, const char *d, size_t dn) {
+                        if (f4 == 1) name.assign(d, dn);
+                        if (f4 != 5 && f4 != 7) return;
+                        decoded = decoded && proto_walk(d, dn, [&](uint32_t f5, int, uint64_t, const char *pt, size_t pn) {
+                            if (f5 != 1) return;
+                            points[name]++;
+                            decoded = decoded && proto_walk(pt, pn, [&](uint32_t f6, int, uint64_t, const char*, size_t) {
+                                if (f6 == 2) with_start++;
+                                if (f6 == 7) attributes++;
+                            });
+                        });
+                    });
+                });
+            });
+        });
+    }
+    size_t samples = BATCHES * PER_BATCH;
+    check(decoded, "requests decode as protobuf");
+    check(points["system.cpu.utilization"] == samples && points["system.memory.usage"] == samples, "host metrics: one point per sample");
+    check(points["process.cpu.utilization"] == samples * 5 && points["process.memory.usage"] == samples * 5 && points["process.cpu.time"] == samples * 5,
+          "process metrics: top 5 per sample");
+    check(with_start == samples * 5 && attributes == samples * (1 + 3 * 3 * 5), "start times and attributes present");
+
+    // nothing is sent here, so the queue has to shed its oldest batches
+    OtlpExporter bounded;
+    bounded.open("http://127.0.0.1:9", "", why);
+    bounded.max_queued_bytes = 16384;
+    for (int b = 0; b < 50; ++b) {
+        bounded.add_sample(f, t += 1000000000ULL);
+        bounded.end_batch();
+    }
+    st = bounded.stats();
+    check(bounded.queued_size() <= bounded.max_queued_bytes && st.dropped == 50 - bounded.queued(),
+          "queue bounded at " + to_string(bounded.max_queued_bytes) + " bytes (" + to_string(bounded.queued()) + " kept, " + to_string(st.dropped) + " dropped)");
+
+    OtlpExporter bench;
+    bench.open("http://127.0.0.1:9", "", why);
+    bench.max_queued_bytes = 0; // keeps one batch; the rest go back to the spare buffers
+    const int N = 2000;
+    auto t0 = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        bench.add_sample(f, t += 1000000000ULL);
+        if (i % 5 == 4) bench.end_batch();
+    }
+    double us = duration<double, micro>(steady_clock::now() - t0).count() / N;
+    printf("encoding: %.1f us per sample of top %zu\n", us, bench.top);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) return 2;
+    int refresh_sec = opt.refresh_sec;
+
+    BackendRegistry registry;
+    register_backends(registry, opt.proc_root);
+    if (opt.list_backends) { list_backends(registry); return 0; }
+    if (opt.check_backends) return check_backends(registry, opt.proc_root);
+    if (opt.bench_backends) return bench_backends(registry, opt.bench_backends);
+    if (opt.bench_render) return bench_render(opt.bench_render);
+    if (opt.bench_query) return bench_query(opt.bench_query);
+    if (opt.check_query) return check_query();
+    if (opt.check_otlp) return check_otlp();
+    if (opt.check_record) return check_record();
+    if (opt.check_scale) return check_scale(opt.proc_root.empty() ? string("/proc") : opt.proc_root, opt.scale_k ? opt.scale_k : 500);
+    if (!opt.compare_path.empty()) return compare_recording(opt.compare_path, opt.compare_from, opt.compare_to, opt.resolution_ms);
+    Query query;
+    string filter_text = opt.filter;
+    {
+        string why;
+        if (!query.compile(filter_text, why)) { cerr << "bad filter '" << filter_text << "': " << why << "\n"; return 2; }
+    }
+    if (!opt.recording_path.empty()) return arrow_recording(opt.arrow_path, opt.recording_path, opt.compare_from, opt.compare_to, opt.resolution_ms, query);
+    // batch output and the server neither read nor replace the state of the
+    // interactive UI
+    if (opt.batch || !opt.http.empty()) opt.state_path.clear();
+    HttpServer server;
+    if (!opt.http.empty()) {
+        string why;
+        if (!server.open(opt.http, why)) { cerr << "cannot serve on " << opt.http << ": " << why << "\n"; return 2; }
+        // the server takes these through a signalfd; every thread started
+        // from here on inherits the mask
+        sigset_t stop_signals;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    }
+
+    unsigned wanted_fields = FIELDS_DEFAULT;
+    CollectorBackend *backend = (opt.backend == "auto") ? registry.choose(wanted_fields) : registry.find(opt.backend);
+    if (!backend) {
+        cerr << "unknown backend '" << opt.backend << "'; try --list-backends\n";
+        return 2;
+    }
+    if (!backend->available()) {
+        cerr << "backend '" << backend->name() << "' is not available (" << backend->unavailable_reason() << "), using procfs\n";
+        backend = registry.choose(wanted_fields);
+        if (!backend) return 2;
+    }
+    if ((backend->fields() & wanted_fields) != wanted_fields) {
+        cerr << "warning: backend '" << backend->name() << "' does not provide: "
+             << field_names(wanted_fields & ~backend->fields()) << "\n";
+    }
+
+    FsProber fs_prober;
+    unique_ptr<ScaleCollector> scale;
+    Sampler sampler(backend, wanted_fields, refresh_sec, fs_prober);
+    sampler.use_registry(&registry);
+    for (auto &pp : opt.periods) {
+        if (!sampler.set_period(pp.first, pp.second)) cerr << "unknown collector '" << pp.first << "' in --period\n";
+    }
+    if (opt.scale_k) {
+        scale.reset(new ScaleCollector(opt.proc_root.empty() ? string("/proc") : opt.proc_root, opt.scale_k));
+        sampler.use_scale(scale.get());
+        // the saved list would only be the top K
+        opt.state_path.clear();
+    }
+    Recorder recorder;
+    if (!opt.record_path.empty()) {
+        string why;
+        // the top K changes membership with every sort, so it is not recorded
+        if (opt.scale_k) cerr << "note: --record is ignored in scale mode\n";
+        else if (!recorder.open(opt.record_path, opt.record_tiers, opt.record_sync_ms, why)) { cerr << "cannot record to " << opt.record_path << ": " << why << "\n"; return 2; }
+        else {
+            for (auto &r : recorder.recovered()) cerr << "note: " << r << "\n";
+            sampler.use_recorder(&recorder);
+        }
+    }
+    SavedState saved;
+    bool warm = false;
+    if (!opt.state_path.empty()) {
+        string why;
+        warm = load_state(opt.state_path, saved, why);
+        if (!warm && !why.empty()) cerr << "note: not using " << opt.state_path << ": " << why << "\n";
+        if (warm) sampler.preload(saved);
+    }
+    vector<string> isolation_failed;
+    CgroupPlacement cgroup;
+    if (!opt.isolation.cgroup.empty()) {
+        string why;
+        if (!prepare_cgroup(opt.isolation, cgroup, why)) {
+            isolation_failed.push_back(why);
+            release_cgroup(cgroup);
+            cgroup = CgroupPlacement();
+        }
+    }
+    OtlpExporter exporter;
+    if (!opt.otlp_url.empty()) {
+        string why;
+        exporter.top = opt.otlp_top;
+        exporter.interval_ms = opt.otlp_interval * 1000;
+        if (!exporter.open(opt.otlp_url, filter_text, why)) { cerr << "cannot export to " << opt.otlp_url << ": " << why << "\n"; return 2; }
+        exporter.start(sampler);
+    }
+    // what went wrong in the background, once the screen is gone
+    auto report_outputs = [&]() {
+        recorder.close();
+        if (!sampler.backend_warning().empty()) cerr << "warning: " << sampler.backend_warning() << "\n";
+        if (!recorder.error.empty()) cerr << "warning: recording stopped after " << recorder.samples << " samples: " << recorder.error << "\n";
+        if (!recorder.warnings().empty()) cerr << "warning: recording: " << recorder.warnings() << "\n";
+        OtlpExporter::Stats es = exporter.stats();
+        if (es.dropped || !es.last_error.empty()) {
+            cerr << "warning: OTLP export to " << exporter.url() << ": " << es.sent << " batches sent, " << es.dropped << " dropped";
+            if (!es.last_error.empty()) cerr << ", last error: " << es.last_error;
+            cerr << "\n";
+        }
+    };
+    int reader = sampler.frames.register_reader();
+    for (auto &w : sampler.start(opt.isolation, cgroup)) isolation_failed.push_back(w);
+    for (auto &w : isolation_failed) cerr << "warning: sampler isolation: " << w << "\n";
+    if (opt.batch || !opt.http.empty()) {
+        int status = !opt.batch ? server.run(sampler, reader, filter_text)
+                   : !opt.arrow_path.empty() ? arrow_output(sampler, reader, opt.arrow_path, query, opt.batch)
+                   : batch_output(sampler, reader, query, opt.sort_mode, opt.batch);
+        exporter.stop();
+        sampler.stop();
+        sampler.frames.unregister_reader(reader);
+        release_cgroup(cgroup);
+        report_outputs();
+        return status;
+    }
+
+    unique_ptr<Renderer> term;
+    if (opt.renderer == "ansi") term.reset(new AnsiRenderer(STDOUT_FILENO, STDIN_FILENO, true));
+    else term.reset(new NcursesRenderer());
+    int rows = term->rows(), cols = term->cols();
+
+    
+    int header_h = 3;
+    int panel_h = 7;
+    unique_ptr<Canvas> header = term->canvas(header_h, cols, 0, 0);
+    unique_ptr<Canvas> panel = term->canvas(panel_h, cols, header_h, 0);
+    unique_ptr<Canvas> body = term->canvas(rows - header_h, cols, header_h, 0);
+    PanelMode panel_mode = PANEL_NONE;
+    bool show_sock_col = false;
+    bool show_cpu_cols = false;
+    int ncpus = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+    auto layout = [&]() {
+        if (panel_mode == PANEL_FS) panel_h = 11;
+        else if (panel_mode == PANEL_CORES) panel_h = max(4, min(11, ncpus + 2));
+        else panel_h = 7;
+        panel->place(panel_h, cols, header_h, 0);
+        int top = header_h + (panel_mode != PANEL_NONE ? panel_h : 0);
+        body->place(max(4, rows - top), cols, top, 0);
+        term->repaint();
+    };
+    // panel collectors only run while their panel is on screen
+    auto update_enabled = [&]() {
+        sampler.set_enabled(COLLECT_KERNEL, panel_mode == PANEL_KERNEL);
+        sampler.set_enabled(COLLECT_FS, panel_mode == PANEL_FS);
+        sampler.set_enabled(COLLECT_SOCKETS, panel_mode == PANEL_NET || show_sock_col);
+    };
+    auto set_panel = [&](PanelMode m) {
+        panel_mode = (panel_mode == m) ? PANEL_NONE : m;
+        update_enabled();
+        layout();
+    };
+
+    SortMode sort_mode = opt.sort_mode;
+    if (sort_mode != SORT_CPU) sampler.set_sort(sort_mode);
+    int selected = 0;
+    int page_offset = 0;
+    long long boot_time = read_boot_time();
+
+    CmdlineCache cmdlines;
+    if (warm) for (auto &c : saved.cmdlines) cmdlines.preload(c.first, c.second);
+    saved = SavedState();
+    SockCountCache sock_cache;
+    // the UI's sorted view of the current frame's process list
+    vector<uint32_t> order;
+    uint64_t shown_seq = 0, order_seq = 0;
+    vector<uint64_t> filter_sel; // rows of the shown list that pass the filter
+    // A frozen view keeps its own Frame: a copy of the live one's shared
+    // pointers, so the process list and panels stay alive without being copied
+    // or pinning an epoch, and the sampler carries on as usual.
+    unique_ptr<const Frame> frozen;
+    steady_clock::time_point frozen_at;
+    // compare view: the shown process list against a marked baseline
+    Comparison cmp;
+    vector<uint32_t> cmp_order;
+    uint64_t cmp_seq = 0;
+    bool compare_view = false;
+    int hscroll = 0;
+    bool dirty = false;
 
     bool running = true;
-    auto last_refresh = steady_clock::now() - seconds(refresh_sec);
 
     while (running) {
         
-        int ch = getch();
+        int ch = term->key();
+        bool resort = false, toggle_freeze = false, mark_baseline = false;
         if (ch != ERR) {
+            dirty = true;
             if (ch == 'q' || ch == 'Q') { running = false; break; }
+            else if (ch == KEY_RESIZE) {
+                rows = term->rows();
+                cols = term->cols();
+                header->place(header_h, cols, 0, 0);
+                layout();
+            }
             else if (ch == KEY_UP) { if (selected > 0) selected--; if (selected < page_offset) page_offset = selected; }
             else if (ch == KEY_DOWN) { selected++; }
             else if (ch == KEY_NPAGE) { // page down
-                int body_rows = getmaxy(body) - 3;
+                int body_rows = body->rows() - 3;
                 selected += max(1, body_rows);
             }
-            else if (ch == KEY_PPAGE) { int body_rows = getmaxy(body) - 3; selected -= max(1, body_rows); if (selected < 0) selected = 0; }
+            else if (ch == KEY_PPAGE) { int body_rows = body->rows() - 3; selected -= max(1, body_rows); if (selected < 0) selected = 0; }
+            else if (ch == KEY_LEFT) { hscroll = max(0, hscroll - 8); }
+            else if (ch == KEY_RIGHT) { hscroll += 8; }
+            else if (ch == KEY_HOME) { hscroll = 0; }
             else if (ch == 's' || ch == 'S') {
                 if (sort_mode == SORT_CPU) sort_mode = SORT_MEM;
                 else if (sort_mode == SORT_MEM) sort_mode = SORT_PID;
                 else sort_mode = SORT_CPU;
+                sampler.set_sort(sort_mode);
+                resort = true;
+            }
+            else if (ch == 'v' || ch == 'V') {
+                set_panel(PANEL_KERNEL);
+            }
+            else if (ch == 'f' || ch == 'F') {
+                set_panel(PANEL_FS);
+            }
+            else if (ch == 'n' || ch == 'N') {
+                set_panel(PANEL_NET);
+            }
+            else if (ch == 'h' || ch == 'H') {
+                set_panel(PANEL_CORES);
+            }
+            else if (ch == 'c' || ch == 'C') {
+                show_sock_col = !show_sock_col;
+                update_enabled();
+            }
+            else if (ch == 'a' || ch == 'A') {
+                show_cpu_cols = !show_cpu_cols;
+            }
+            else if (ch == 'z' || ch == 'Z') {
+                toggle_freeze = true;
+            }
+            else if (ch == 'b' || ch == 'B') {
+                mark_baseline = true;
+            }
+            else if (ch == 'd' || ch == 'D') {
+                compare_view = !compare_view;
+                cmp_seq = 0;
             }
             else if (ch == 'r' || ch == 'R') {
-                last_refresh = steady_clock::now() - seconds(refresh_sec); // force immediate refresh in next loop
-            }
-            else if (ch == 'k' || ch == 'K') {
-               
-                vector<ProcInfo> pv;
-                for (auto &kv : cur_procs) pv.push_back(kv.second);
-                sort_processes(pv, sort_mode);
-                if (selected >= 0 && selected < (int)pv.size()) {
-                    int pid = pv[selected].pid;
-                    confirm_kill(stdscr, pid);
-                    
-                    last_refresh = steady_clock::now() - seconds(refresh_sec);
+                sampler.trigger_all();
+            }
+            else if (ch == '/') {
+                string text = filter_text, why;
+                while (prompt_line(*term, "Filter", "e.g. cpu > 5 and user != root and name ~ \"^python\"  (Enter apply, Esc cancel)", text, why)) {
+                    Query q;
+                    if (!q.compile(text, why)) continue;
+                    query = std::move(q);
+                    filter_text = text;
+                    resort = true;
+                    break;
                 }
             }
         }
 
-        auto now = steady_clock::now();
-        if (now - last_refresh >= seconds(refresh_sec)) {
-           
-            read_total_cpu(cur_cpu_fields);
-            unsigned long long cur_total_cpu = total_cpu_time(cur_cpu_fields);
-
-        
-            read_meminfo(mem_total_kb, mem_free_kb, mem_available_kb);
+        {
+            auto frame = sampler.frames.read(reader);
+            const Frame *f = frame.get();
+            if (f && f->seq != shown_seq) { shown_seq = f->seq; dirty = true; }
+            // back to live, the selection follows the process it was on
+            ProcKey follow{-1, 0};
+            if (toggle_freeze && frozen) {
+                if (selected < (int)order.size() && frozen->procs) follow = proc_key((*frozen->procs)[order[selected]]);
+                frozen.reset();
+            } else if (toggle_freeze && f) {
+                frozen.reset(new Frame(*f));
+                frozen_at = steady_clock::now();
+            }
+            // the process list and panels come from view, the header from f
+            const Frame *view = frozen ? frozen.get() : f;
+            static const vector<ProcInfo> no_procs;
+            const vector<ProcInfo> &procs = (view && view->procs) ? *view->procs : no_procs;
+            if (view && view->procs_seq != order_seq) { order_seq = view->procs_seq; resort = true; }
+            if (resort && !query.empty() && view) {
+                shared_ptr<const ProcColumns> cols = view->columns ? view->columns->shared() : build_columns(procs);
+                QueryContext ctx{view->users.get(), view->mem_total_kb, boot_time, time(nullptr)};
+                query.select(*cols, ctx, filter_sel);
+            }
+            if (resort) sort_order(procs, order, sort_mode, query.empty() ? nullptr : &filter_sel);
+            if (follow.pid >= 0 && !compare_view) {
+                for (size_t i = 0; i < order.size(); ++i) {
+                    if (proc_key(procs[order[i]]) == follow) { selected = (int)i; break; }
+                }
+            }
+            if (mark_baseline && view && view->procs) {
+                cmp.before = view->procs;
+                cmp.before_time = view->procs_time_ms / 1000;
+                cmp_seq = 0;
+            }
+            if (compare_view && cmp.before && view && view->procs && (view->procs_seq != cmp_seq || resort)) {
+                if (view->procs_seq != cmp_seq) {
+                    cmp.after = view->procs;
+                    cmp.after_time = view->procs_time_ms / 1000;
+                    compare_snapshots(cmp, (double)max(1L, sysconf(_SC_CLK_TCK)));
+                    cmp_seq = view->procs_seq;
+                }
+                sort_deltas(cmp, cmp_order, sort_mode);
+            }
+            bool comparing = compare_view && cmp.before && cmp.after;
+            size_t listed = comparing ? cmp_order.size() : order.size();
 
-        
-            collect_processes(cur_procs, mem_total_kb);
-            update_cpu_percent(old_procs, cur_procs, old_total_cpu, cur_total_cpu);
+            if ((ch == 'k' || ch == 'K') && !comparing) {
+                if (selected >= 0 && selected < (int)order.size()) {
+                    confirm_kill(*term, proc_key(procs[order[selected]]));
+                    
+                    sampler.trigger(COLLECT_PROCS);
+                }
+            }
 
-            
-            unsigned long long old_idle = 0, cur_idle = 0;
-            if (old_cpu_fields.size() >= 4) old_idle = old_cpu_fields[3] + (old_cpu_fields.size() > 4 ? old_cpu_fields[4] : 0);
-            if (cur_cpu_fields.size() >= 4) cur_idle = cur_cpu_fields[3] + (cur_cpu_fields.size() > 4 ? cur_cpu_fields[4] : 0);
-            unsigned long long idle_delta = (cur_idle - old_idle);
-            unsigned long long total_delta = (cur_total_cpu - old_total_cpu);
-            if (total_delta == 0) total_delta = 1;
-            total_cpu_percent = 100.0 * (1.0 - ((double)idle_delta / (double)total_delta));
-
-          
-            vector<ProcInfo> pv;
-            pv.reserve(cur_procs.size());
-            for (auto &kv : cur_procs) pv.push_back(kv.second);
-            for (auto &p : pv) {
-                if (mem_total_kb > 0) p.mem_percent = 100.0 * (double)p.mem_kb / (double)mem_total_kb;
-                else p.mem_percent = 0.0;
-            }
-
-      
-            sort_processes(pv, sort_mode);
-
-  
-            if (selected >= (int)pv.size()) selected = max(0, (int)pv.size()-1);
-            if (selected < 0) selected = 0;
+            if (dirty && f) {
+                if (selected >= (int)listed) selected = max(0, (int)listed-1);
+                if (selected < 0) selected = 0;
 
     
-            int body_rows = getmaxy(body) - 3;
-            if (body_rows < 1) body_rows = 1;
-            if (selected < page_offset) page_offset = selected;
-            else if (selected >= page_offset + body_rows) page_offset = selected - body_rows + 1;
+                int body_rows = body->rows() - 3;
+                if (body_rows < 1) body_rows = 1;
+                if (selected < page_offset) page_offset = selected;
+                else if (selected >= page_offset + body_rows) page_offset = selected - body_rows + 1;
 
-         
-            draw_header(header, mem_total_kb, total_cpu_percent, refresh_sec, sort_mode);
-            draw_processes(body, pv, selected, page_offset);
-
-        
-            old_procs = cur_procs;
-            old_cpu_fields = cur_cpu_fields;
-            old_total_cpu = total_cpu_time(old_cpu_fields);
+                auto now = steady_clock::now();
+                string notice;
+                if (compare_view && !cmp.before) {
+                    notice = "no baseline, b marks one";
+                } else if (frozen) {
+                    notice = "FROZEN " + format_staleness(duration<double>(now - frozen_at).count()) + ", z: live";
+                } else if (f->scan_total) {
+                    notice = "Scanning " + to_string(f->scan_done);
+                    if (f->scan_total != SIZE_MAX) notice += "/" + to_string(f->scan_total);
+                } else {
+                    for (int id : {COLLECT_CPU, COLLECT_MEM, COLLECT_PROCS}) {
+                        const CollectorStatus &cs = f->collectors[id];
+                        if (!cs.stale(now)) continue;
+                        notice += notice.empty() ? "STALE: " : ", ";
+                        notice += cs.name + " " + format_staleness(cs.age_sec(now));
+                    }
+                }
+                if (!query.empty() && !comparing) {
+                    if (!notice.empty()) notice += ", ";
+                    notice += "filter " + (filter_text.size() > 40 ? filter_text.substr(0, 37) + "..." : filter_text) + ": " + to_string(order.size()) + "/" + to_string(procs.size());
+                }
+                draw_header(*header, f->mem_total_kb, f->mem_available_kb, f->total_cpu_percent, refresh_sec, sort_mode, f->backend, notice);
+                const ProcInfo *sel = nullptr;
+                if (comparing && !cmp_order.empty()) sel = &cmp.proc(cmp.rows[cmp_order[selected]]);
+                else if (!comparing && !order.empty()) sel = &procs[order[selected]];
+                if (panel_mode == PANEL_KERNEL && view->kernel) draw_kernel_panel(*panel, *view->kernel, format_staleness(view->collectors[COLLECT_KERNEL].age_sec(now)));
+                else if (panel_mode == PANEL_FS && view->mounts) draw_fs_panel(*panel, *view->mounts, fs_prober, format_staleness(view->collectors[COLLECT_FS].age_sec(now)));
+                else if (panel_mode == PANEL_NET && view->sockets) draw_net_panel(*panel, *view->sockets, sock_cache, sel, format_staleness(view->collectors[COLLECT_SOCKETS].age_sec(now)));
+                else if (panel_mode == PANEL_CORES) draw_cores_panel(*panel, procs, view->procs_cpu_valid, ncpus, format_staleness(view->collectors[COLLECT_PROCS].age_sec(now)));
+                const SocketTable *sock_col = (show_sock_col && view->sockets) ? view->sockets.get() : nullptr;
+                if (comparing) {
+                    draw_compare(*body, cmp, *view->users, cmp_order, selected, page_offset, cmdlines, hscroll);
+                } else {
+                    draw_processes(*body, procs, view->history.get(), *view->users, view->mem_total_kb, order, view->procs_cpu_valid, selected, page_offset, boot_time, cmdlines, hscroll, show_cpu_cols, ncpus, sock_col, sock_cache);
+                    if (view->scale) draw_scale_summary(*body, *view->scale);
+                }
+                term->present();
+                dirty = false;
+            }
+        }
 
-            last_refresh = now;
+        // wakes on a key press or a new frame
+        struct pollfd pfds[2] = {{STDIN_FILENO, POLLIN, 0}, {sampler.wake_fd(), POLLIN, 0}};
+        poll(pfds, sampler.wake_fd() >= 0 ? 2 : 1, 50);
+        if (pfds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(sampler.wake_fd(), drain, sizeof(drain)) > 0) {}
         }
+    }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    exporter.stop();
+    sampler.stop();
+    sampler.frames.unregister_reader(reader);
+    string state_error;
+    if (!opt.state_path.empty()) {
+        SavedState st = sampler.export_state();
+        // only command lines of processes that are still listed are worth keeping
+        for (auto &p : st.procs) {
+            auto it = cmdlines.entries.find(proc_key(p));
+            if (it != cmdlines.entries.end()) st.cmdlines.push_back({it->first, it->second.cmdline});
+        }
+        save_state(opt.state_path, st, state_error);
     }
+    release_cgroup(cgroup);
 
-    delwin(header);
-    delwin(body);
-    endwin();
+    header.reset();
+    panel.reset();
+    body.reset();
+    term.reset();
+    // repeated here since the screen covered them
+    for (auto &w : isolation_failed) cerr << "warning: sampler isolation: " << w << "\n";
+    if (!state_error.empty()) cerr << "warning: state not saved: " << state_error << "\n";
+    report_outputs();
     return 0;
 }